@@ -0,0 +1,107 @@
+/*
+ * cache_bench - Hit throughput of the cache as the threads looking objects
+ *     up go from one to max_threads, doubling each round. Every thread
+ *     fetches and releases the same small set of objects, spread over the
+ *     shards, so the rounds show how lookups scale with contention. Usage:
+ *
+ *         cache_bench [iterations] [max_threads]
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/proxy_cache/cache.h"
+
+#define ITERATIONS  1000000         /* Lookups per thread and round */
+#define NOBJECTS    256             /* Objects cached and looked up */
+#define OBJECT_LEN  1024            /* Content bytes of each object */
+#define LINE_LEN    64
+
+static Cache cache;
+static char request_lines[NOBJECTS][LINE_LEN];
+static const char request_headers[] = "Host: www.example.com\r\n";
+static long iterations;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * fetch_loop - Look the objects up in turn, starting at a different one in
+ *     each thread.
+ */
+static void *
+fetch_loop(void *vargp)
+{
+    long start = (long) vargp, misses = 0;
+    CacheObject *object;
+
+    for (long i = 0; i < iterations; i++) {
+        object = cache_fetch(&cache, request_lines[(start + i) % NOBJECTS],
+                             request_headers);
+        if (object)
+            cache_release(object);
+        else
+            misses++;
+    }
+
+    return (void *) misses;
+}
+
+int
+main(int argc, char **argv)
+{
+    int max_threads = argc > 2 ? atoi(argv[2])
+                               : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    long misses;
+    char content[OBJECT_LEN];
+    void *thread_misses;
+    double start, seconds;
+    pthread_t *tids;
+
+    iterations = argc > 1 ? atol(argv[1]) : ITERATIONS;
+    if (iterations < 1 || max_threads < 1) {
+        fprintf(stderr, "usage: %s [iterations] [max_threads]\n", argv[0]);
+        return 1;
+    }
+
+    if (cache_init(&cache, 4 * NOBJECTS * (OBJECT_LEN + MAX_KEY_LEN), 0) < 0) {
+        fprintf(stderr, "cache_init failed\n");
+        return 1;
+    }
+    memset(content, 'x', sizeof(content));
+    for (int i = 0; i < NOBJECTS; i++) {
+        snprintf(request_lines[i], LINE_LEN, "GET /static/%d.js HTTP/1.1", i);
+        cache_write(&cache, request_lines[i], request_headers,
+                    "HTTP/1.1 200 OK", "Content-Type: text/javascript\r\n",
+                    content, sizeof(content), 0, time(NULL) + 3600);
+    }
+
+    tids = malloc(max_threads * sizeof(pthread_t));
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        misses = 0;
+        start = now();
+        for (long i = 0; i < nthreads; i++)
+            pthread_create(&tids[i], NULL, fetch_loop,
+                           (void *) (i * NOBJECTS / nthreads));
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(tids[i], &thread_misses);
+            misses += (long) thread_misses;
+        }
+        seconds = now() - start;
+
+        printf("%3d threads %12.0f hits/s %10.0f hits/s/thread %6ld misses\n",
+               nthreads, nthreads * iterations / seconds,
+               iterations / seconds, misses);
+    }
+    free(tids);
+
+    return 0;
+}
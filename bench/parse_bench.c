@@ -0,0 +1,136 @@
+/*
+ * parse_bench - Parse throughput of the HTTP head parser, against the line
+ *     at a time sscanf and strcat parse it replaced. Usage:
+ *
+ *         parse_bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/proxy_serve/parse.h"
+
+#define ITERATIONS 1000000
+#define LINE_LEN   8192
+
+static const char request_head[] =
+    "GET http://www.example.com/static/js/app.3f2a9c.js?v=12 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:98.0) Gecko/20100101 "
+    "Firefox/98.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Cookie: session=5f0c2b7a9e; theme=dark; consent=1\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n";
+
+static const char response_head[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+    "Server: Apache\r\n"
+    "Last-Modified: Sat, 05 Nov 1994 08:49:37 GMT\r\n"
+    "ETag: \"3e86-410-3596fbbc\"\r\n"
+    "Cache-Control: public, max-age=3600\r\n"
+    "Content-Type: application/javascript\r\n"
+    "Content-Length: 48213\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static volatile size_t sink;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * parse_spans - The head parsed into spans, fed as a single read.
+ */
+static void
+parse_spans(const char *head, size_t len, HttpKind kind)
+{
+    HttpParser parser;
+
+    http_parser_init(&parser, kind);
+    if (http_parse(&parser, head, len) != 1)
+        abort();
+    sink += parser.nheaders;
+}
+
+/*
+ * parse_lines - The head parsed as before: each line copied out, scanned
+ *     with sscanf and appended to the header block with strcat.
+ */
+static void
+parse_lines(const char *head, size_t len)
+{
+    const char *p = head, *end = head + len, *eol;
+    char linebuf[LINE_LEN], headers[LINE_LEN], a[LINE_LEN], b[LINE_LEN],
+    c[LINE_LEN];
+    size_t n;
+
+    headers[0] = '\0';
+    for (int first = 1; p < end; first = 0, p = eol) {
+        eol = (const char *) memchr(p, '\n', end - p) + 1;
+        n = eol - p;
+        memcpy(linebuf, p, n);
+        linebuf[n] = '\0';
+
+        if (first) {
+            sscanf(linebuf, "%s %s %s", a, b, c);
+            continue;
+        }
+        if (sscanf(linebuf, "Host: %s", a) != 1)
+            sscanf(linebuf, "content-length: %zu", &n);
+        strcat(headers, linebuf);
+    }
+    sink += strlen(headers);
+}
+
+static void
+report(const char *name, double seconds, long iterations, size_t len)
+{
+    printf("%-24s %10.0f heads/s %8.1f MB/s\n", name, iterations / seconds,
+           iterations * len / seconds / 1e6);
+}
+
+int
+main(int argc, char **argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : ITERATIONS;
+    size_t request_len = sizeof(request_head) - 1;
+    size_t response_len = sizeof(response_head) - 1;
+    double start;
+
+    start = now();
+    for (long i = 0; i < iterations; i++)
+        parse_spans(request_head, request_len, HTTP_REQUEST);
+    report("request, spans", now() - start, iterations, request_len);
+
+    start = now();
+    for (long i = 0; i < iterations; i++)
+        parse_lines(request_head, request_len);
+    report("request, sscanf/strcat", now() - start, iterations, request_len);
+
+    start = now();
+    for (long i = 0; i < iterations; i++)
+        parse_spans(response_head, response_len, HTTP_RESPONSE);
+    report("response, spans", now() - start, iterations, response_len);
+
+    start = now();
+    for (long i = 0; i < iterations; i++)
+        parse_lines(response_head, response_len);
+    report("response, sscanf/strcat", now() - start, iterations,
+           response_len);
+
+    return 0;
+}
@@ -1,13 +1,26 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "proxy_cache/cache.h"
+#include "proxy_event/event.h"
+#include "proxy_metrics/metrics.h"
+#include "proxy_pool/pool.h"
+#include "proxy_serve/refresh.h"
 #include "proxy_serve/serve.h"
+#include "proxy_upstream/flight.h"
+#include "proxy_upstream/upstream.h"
+#include "socket_interface/dns.h"
 #include "socket_interface/interface.h"
 
 #define safe_free(ptr) sfree((void **) &(ptr))
@@ -18,56 +31,425 @@ typedef struct vargp {
     Cache *proxy_cache;
 } Vargp;
 
+/* One accept loop and its listening socket, with its own pool in pool mode */
+typedef struct acceptor {
+    int listenfd;
+    int cpu;                        /* CPU to run on, -1 if not pinned */
+    int use_pool, nworkers, reject;
+    size_t queue_size;
+    Pool pool;
+    Cache *proxy_cache;
+    pthread_t tid;
+} Acceptor;
+
+/* Where and how often the cache is saved, for a warm restart */
+typedef struct snapshot {
+    Cache *proxy_cache;
+    const char *path;
+    int interval;                   /* Seconds, 0 to save only on shutdown */
+    sigset_t signals;               /* Asking for a shutdown */
+} Snapshot;
+
+static void
+usage(const char *prog);
+
+static size_t
+parse_size(const char *arg);
+
+static void *
+accept_loop(void *vargp);
+
+static void *
+snapshot_loop(void *vargp);
+
+static void
+pin_cpu(int cpu);
+
 static void*
 client_serve(void* vargp);
 
 static void
-sfree(void **ptr);
+serve_client(int clientfd, void *proxy_cache);
 
 static void
-free_resources(Request *client_request, Response *server_response);
+sfree(void **ptr);
+
 
 int 
 main(int argc, char **argv)
 {
-    int connfd, listenfd;
-    char hostname[MAX_LINE], port[PORT_LEN];
-    socklen_t client_len;
-    struct sockaddr_storage client_addr;
-    pthread_t tid;
+    int opt, ncpus, nloops, nworkers, nshards, nlisteners, reject, pin;
+    int hugepages, nrefreshers;
+    int max_idle, idle_timeout, keep_alive, dns_ttl, nloaded;
+    int *listenfds;
+    long slots;
+    char *end;
+    const char *mode, *disk_dir;
+    size_t queue_size, cache_size, disk_size;
+    pthread_t snapshot_tid;
     Cache proxy_cache;
-    Vargp *vargp;
+    Acceptor *acceptors;
+    Snapshot snapshot;
 
     signal(SIGPIPE, SIG_IGN);
 
+    /* Parse command-line options */
+    mode = "thread";
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nloops = ncpus;
+    nworkers = POOL_WORKERS;
+    queue_size = POOL_QUEUE_SIZE;
+    reject = 0;
+    nshards = 0;
+    pin = 0;
+    max_idle = UPSTREAM_MAX_IDLE;
+    idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+    keep_alive = KEEP_ALIVE_TIMEOUT;
+    dns_ttl = DNS_TTL;
+    cache_size = MAX_CACHE_SIZE;
+    hugepages = 0;
+    disk_dir = NULL;
+    disk_size = DISK_SIZE;
+    snapshot.path = NULL;
+    snapshot.interval = 0;
+    nrefreshers = REFRESH_WORKERS;
+    while ((opt = getopt(argc, argv,
+                         "m:n:w:q:rl:cu:U:k:d:s:HD:S:f:i:R:")) != -1) {
+        switch (opt) {
+        case 'm':
+            mode = optarg;
+            break;
+        case 'n':
+            nloops = atoi(optarg);
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'q':
+            slots = strtol(optarg, &end, 10);
+            if (end == optarg || *end || slots < 1 || slots > POOL_MAX_QUEUE)
+                usage(argv[0]);
+            queue_size = slots;
+            break;
+        case 'r':
+            reject = 1;
+            break;
+        case 'l':
+            if ((nshards = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'c':
+            pin = 1;
+            break;
+        case 'u':
+            max_idle = atoi(optarg);
+            break;
+        case 'U':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'k':
+            keep_alive = atoi(optarg);
+            break;
+        case 'd':
+            dns_ttl = atoi(optarg);
+            break;
+        case 's':
+            if ((cache_size = parse_size(optarg)) < MAX_OBJECT_SIZE)
+                usage(argv[0]);
+            break;
+        case 'H':
+            hugepages = 1;
+            break;
+        case 'D':
+            disk_dir = optarg;
+            break;
+        case 'S':
+            if (!(disk_size = parse_size(optarg)))
+                usage(argv[0]);
+            break;
+        case 'f':
+            snapshot.path = optarg;
+            break;
+        case 'i':
+            snapshot.interval = atoi(optarg);
+            break;
+        case 'R':
+            nrefreshers = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
     /* Check command-line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if (argc - optind != 1 || nloops < 1 || nworkers < 1
+        || max_idle < 0 || idle_timeout < 1 || keep_alive < 0 || dns_ttl < 0
+        || snapshot.interval < 0 || nrefreshers < 0
+        || (strcmp(mode, "thread") && strcmp(mode, "pool")
+            && strcmp(mode, "event")))
+        usage(argv[0]);
+
+    /* 
+     * Open one listening socket, or one per shard on the same port and let
+     * the kernel spread the incoming connections over them
+     */
+    nlisteners = nshards ? nshards : 1;
+    listenfds = malloc(nlisteners * sizeof(int));
+    for (int i = 0; i < nlisteners; i++) {
+        if (nshards)
+            listenfds[i] = open_listenfd_reuseport(argv[optind]);
+        else
+            listenfds[i] = open_listenfd(argv[optind]);
+        if (listenfds[i] < 0) {
+            fprintf(stderr, "can't listen on port %s\n", argv[optind]);
+            exit(1);
+        }
+    }
+    if (cache_init(&proxy_cache, cache_size, hugepages) < 0) {
+        fprintf(stderr, "can't reserve %zu bytes for the cache\n", cache_size);
         exit(1);
     }
+    if (disk_dir && cache_init_disk(&proxy_cache, disk_dir, disk_size) < 0) {
+        fprintf(stderr, "can't set up the disk cache in %s\n", disk_dir);
+        exit(1);
+    }
+    if (snapshot.path) {
+        /* A bad snapshot only means a cold start */
+        if ((nloaded = cache_load(&proxy_cache, snapshot.path)) > 0)
+            fprintf(stderr, "loaded %d cached objects from %s\n", nloaded,
+                    snapshot.path);
+
+        /*
+         * Shutdown signals are blocked before any thread is started, so
+         * they all inherit the mask and only the snapshot thread takes them
+         */
+        snapshot.proxy_cache = &proxy_cache;
+        sigemptyset(&snapshot.signals);
+        sigaddset(&snapshot.signals, SIGINT);
+        sigaddset(&snapshot.signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &snapshot.signals, NULL);
+        pthread_create(&snapshot_tid, NULL, snapshot_loop, &snapshot);
+    }
+    upstream_init(max_idle, idle_timeout);
+    flight_init();
+    refresh_init(&proxy_cache, nrefreshers);
+    keep_alive_init(keep_alive);
+    /* Only the event loops can't wait for getaddrinfo */
+    dns_init(dns_ttl, strcmp(mode, "event") ? 0 : DNS_RESOLVERS);
+
+    if (!strcmp(mode, "event")) {
+        if (nshards)    /* A loop per shard */
+            nloops = nshards;
+        event_serve(listenfds, nlisteners, &proxy_cache, nloops, pin);
+        fprintf(stderr, "event loops stopped\n");
+        exit(1);
+    }
+
+    acceptors = calloc(nlisteners, sizeof(Acceptor));
+    for (int i = 0; i < nlisteners; i++) {
+        acceptors[i].listenfd = listenfds[i];
+        acceptors[i].cpu = pin ? i % ncpus : -1;
+        acceptors[i].use_pool = !strcmp(mode, "pool");
+        acceptors[i].nworkers = nworkers / nlisteners > 0 ?
+                                nworkers / nlisteners : 1;
+        acceptors[i].queue_size = queue_size;
+        acceptors[i].reject = reject;
+        acceptors[i].proxy_cache = &proxy_cache;
+    }
+
+    if (!nshards) {
+        accept_loop(&acceptors[0]);
+    } else {
+        for (int i = 0; i < nlisteners; i++)
+            pthread_create(&acceptors[i].tid, NULL, accept_loop, &acceptors[i]);
+        for (int i = 0; i < nlisteners; i++)
+            pthread_join(acceptors[i].tid, NULL);
+    }
+
+    exit(1);
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-m thread|pool|event] [-n loops] "
+                    "[-w workers] [-q slots] [-r] [-l shards] [-c] "
+                    "[-u idle] [-U seconds] [-k seconds] [-d seconds] "
+                    "[-s bytes] [-H] [-D dir] [-S bytes] [-f file] "
+                    "[-i seconds] [-R workers] <port>\n",
+            prog);
+    fprintf(stderr, "  -m  serving mode: a thread per connection (default), "
+                    "a worker pool or epoll event loops\n");
+    fprintf(stderr, "  -n  number of event loops (default: one per core)\n");
+    fprintf(stderr, "  -w  number of pool workers (default: %d)\n",
+            POOL_WORKERS);
+    fprintf(stderr, "  -q  pool accept queue slots, at most %d (default: %d)\n",
+            POOL_MAX_QUEUE, POOL_QUEUE_SIZE);
+    fprintf(stderr, "  -r  reject with 503 when the queue is full instead of "
+                    "waiting\n");
+    fprintf(stderr, "  -l  number of SO_REUSEPORT listeners, each one "
+                    "accepting and serving on its own\n");
+    fprintf(stderr, "  -c  pin the shards (or event loops) to CPUs\n");
+    fprintf(stderr, "  -u  idle keep-alive connections kept per server, 0 to "
+                    "disable (default: %d)\n", UPSTREAM_MAX_IDLE);
+    fprintf(stderr, "  -U  seconds an idle server connection is kept "
+                    "(default: %d)\n", UPSTREAM_IDLE_TIMEOUT);
+    fprintf(stderr, "  -k  seconds an idle client connection is kept, 0 to "
+                    "close after each response (default: %d)\n",
+            KEEP_ALIVE_TIMEOUT);
+    fprintf(stderr, "  -d  seconds a DNS resolution is cached, 0 to disable "
+                    "(default: %d)\n", DNS_TTL);
+    fprintf(stderr, "  -s  cache size in bytes, with an optional K, M or G "
+                    "suffix (default: %d)\n", MAX_CACHE_SIZE);
+    fprintf(stderr, "  -H  back the cache with huge pages\n");
+    fprintf(stderr, "  -D  directory of a second cache tier on disk, for the "
+                    "objects evicted from memory\n");
+    fprintf(stderr, "  -S  disk tier size in bytes, with an optional K, M or G "
+                    "suffix (default: %luM)\n", DISK_SIZE >> 20);
+    fprintf(stderr, "  -f  cache snapshot saved on SIGINT or SIGTERM and "
+                    "loaded on start\n");
+    fprintf(stderr, "  -i  seconds between snapshots, 0 to save only on "
+                    "shutdown (default: 0)\n");
+    fprintf(stderr, "  -R  workers refreshing the cached responses about to "
+                    "expire, 0 to disable (default: %d)\n", REFRESH_WORKERS);
+    exit(1);
+}
+
+/*
+ * parse_size - Parse a byte count such as 4096, 64K or 1G. Returns 0 if
+ *     arg isn't one.
+ */
+static size_t
+parse_size(const char *arg)
+{
+    char *end;
+    unsigned long long size;
+
+    size = strtoull(arg, &end, 10);
+    if (end == arg)
+        return 0;
+
+    switch (*end) {
+    case 'G': case 'g':
+        size <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        size <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        size <<= 10;
+        end++;
+        break;
+    }
+
+    return *end ? 0 : size;
+}
+
+/*
+ * snapshot_loop - Save the cache every interval seconds, if set, and once
+ *     more on a shutdown signal before exiting, so a restart finds it warm.
+ */
+static void *
+snapshot_loop(void *vargp)
+{
+    int sig, nsaved;
+    struct timespec interval;
+    Snapshot *snapshot = vargp;
+
+    interval.tv_sec = snapshot->interval;
+    interval.tv_nsec = 0;
+
+    for (;;) {
+        if (snapshot->interval)
+            sig = sigtimedwait(&snapshot->signals, NULL, &interval);
+        else
+            sig = sigwaitinfo(&snapshot->signals, NULL);
+        if (sig < 0 && errno != EAGAIN)
+            continue;
+
+        nsaved = cache_save(snapshot->proxy_cache, snapshot->path);
+        if (sig > 0) {
+            if (nsaved >= 0)
+                fprintf(stderr, "saved %d cached objects to %s\n", nsaved,
+                        snapshot->path);
+            exit(0);
+        }
+    }
 
-    listenfd = open_listenfd(argv[1]);
-    cache_init(&proxy_cache);
+    return NULL;
+}
+
+/*
+ * accept_loop - Accept connections on the acceptor's listening socket and
+ *     hand them to a new thread, or to the acceptor's own worker pool. When
+ *     pinned, the threads it starts inherit its CPU.
+ */
+static void *
+accept_loop(void *vargp)
+{
+    int connfd;
+    socklen_t client_len;
+    struct sockaddr_storage client_addr;
+    pthread_t tid;
+    Vargp *client_vargp;
+    Acceptor *acceptor = vargp;
+
+    if (acceptor->cpu >= 0)
+        pin_cpu(acceptor->cpu);
+
+    if (acceptor->use_pool
+        && pool_init(&acceptor->pool, acceptor->nworkers, acceptor->queue_size,
+                     acceptor->reject, serve_client,
+                     acceptor->proxy_cache) < 0) {
+        fprintf(stderr, "can't start the worker pool\n");
+        exit(1);
+    }
+    if (acceptor->use_pool)
+        metrics_add_pool(&acceptor->pool);
 
     while (1) {
         client_len = sizeof(client_addr);
-        if ((connfd = accept(listenfd, (SA* ) &client_addr, &client_len)) < 0) {
-            fprintf(stderr, "Connection to (%s, %s) failed\n", hostname, port);
+        if ((connfd = accept(acceptor->listenfd, (SA* ) &client_addr,
+                             &client_len)) < 0) {
+            fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            continue;
+        }
+
+        if (acceptor->use_pool) {
+            /* The queue is full, shed the connection */
+            if (pool_submit(&acceptor->pool, connfd) < 0) {
+                client_error(connfd, "accept queue", "503",
+                             "service unavailable",
+                             "the proxy is overloaded, try again later");
+                close(connfd);
+            }
             continue;
         }
-        vargp = malloc(sizeof(Vargp));
-        vargp->clientfd = connfd;
-        vargp->proxy_cache = &proxy_cache;
-        pthread_create(&tid,NULL, client_serve, vargp); 
+
+        client_vargp = malloc(sizeof(Vargp));
+        client_vargp->clientfd = connfd;
+        client_vargp->proxy_cache = acceptor->proxy_cache;
+        pthread_create(&tid,NULL, client_serve, client_vargp); 
     }
+
+    return NULL;
+}
+
+static void
+pin_cpu(int cpu)
+{
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+        fprintf(stderr, "can't pin thread to CPU %d\n", cpu);
 }
 
 static void*
 client_serve(void *vargp)
 {
     int clientfd;
-    Request client_request;
-    Response server_respone;
     Cache *proxy_cache;
 
     clientfd = ((Vargp *)vargp)->clientfd;
@@ -79,27 +461,62 @@ client_serve(void *vargp)
     /* detach the thread after ending its job */
     pthread_detach(pthread_self());
 
-    /* initialize client_request and server_response resources with zero */
-    memset(&client_request, 0, sizeof(Request));
-    memset(&server_respone, 0, sizeof(Response));
-
-    /* parse HTTP request */
-    if (!(parse_request(clientfd, &client_request) < 0)) {
-        /* forward the request to the server if it parsed successfully */
-        if (!(forward_request(&client_request, proxy_cache,
-                              &server_respone) < 0)) {
-            /* forward server response to the client after requesting 
-             *  successfully */
-            if (!(forward_response(clientfd, &server_respone) < 0)) {
-                /* code region if any dependent action after successfull 
-                 * server_respone */
+    serve_client(clientfd, proxy_cache);
+    return NULL;
+}
+
+/*
+ * serve_client - Answer the requests of the client one after the other
+ *     while the connection is kept alive. Reads give up once the client
+ *     stays idle for longer than the keep-alive timeout, and writes once it
+ *     stops reading for as long.
+ */
+static void
+serve_client(int clientfd, void *proxy_cache)
+{
+    int keep_alive;
+    struct timeval timeout;
+    Request client_request;
+    Response server_respone;
+    Sio sio;
+    Arena *arena = arena_get();
+
+    if ((timeout.tv_sec = keep_alive_timeout()) > 0) {
+        timeout.tv_usec = 0;
+        setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                   sizeof(timeout));
+        setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout));
+    }
+
+    metrics_connection(1);
+    sio_initbuf(&sio, clientfd);
+    do {
+        /* initialize client_request and server_response resources with zero */
+        memset(&client_request, 0, sizeof(Request));
+        memset(&server_respone, 0, sizeof(Response));
+        keep_alive = 0;
+
+        /* parse HTTP request */
+        if (!(parse_request(&sio, arena, &client_request) < 0)) {
+            /* answer the request from the cache or the server if it parsed 
+             * successfully */
+            if (!(forward_request(clientfd, &client_request, proxy_cache,
+                                  arena, &server_respone) < 0)) {
+                metrics_record(STAGE_TOTAL, client_request.rq_start);
+                keep_alive = response_keep_alive(&client_request,
+                                                 &server_respone);
             }
         }
-    }
 
-    free_resources(&client_request, &server_respone);
-    close(clientfd);
-    return NULL;
+        /* The request was allocated from the arena */
+        release_response(&server_respone);
+        arena_reset(arena);
+    } while (keep_alive);
+
+    arena_put(arena);
+    sio_close(clientfd);
+    metrics_connection(0);
 }
 
 static void
@@ -111,17 +528,3 @@ sfree(void **ptr)
     }
 }
 
-
-static void
-free_resources(Request *client_request, Response *server_response)
-{
-    safe_free(client_request->rq_headers);
-    safe_free(client_request->rq_hostname);
-    safe_free(client_request->rq_method);
-    safe_free(client_request->rq_port);
-    safe_free(client_request->rq_uri);
-
-    safe_free(server_response->rs_content);
-    safe_free(server_response->rs_headers);
-    safe_free(server_response->rs_line);
-}
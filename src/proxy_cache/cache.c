@@ -1,188 +1,1071 @@
-#include <semaphore.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "cache.h"
 
-static unsigned long
-generate_tag(const char *request_line, const char *request_headers);
+#define SNAPSHOT_MAGIC      "PXCACHE"
+#define SNAPSHOT_VERSION    4
+#define SNAPSHOT_ALIGN      8
+
+/* Request headers left out of the cache key, see is_neutral */
+static const char *neutral_headers[] = {
+    "Host", "User-Agent", "User_Agent", "Accept", "Accept-Charset",
+    "Accept-Encoding", "Accept-Language", "Referer", "Cache-Control",
+    "Pragma", "If-None-Match", "If-Modified-Since", "Connection",
+    "Proxy-Connection", "Keep-Alive", "Upgrade-Insecure-Requests", "DNT",
+    NULL
+};
+
+/* Start of a snapshot file, followed by its records */
+typedef struct snapshot_header {
+    char magic[8];
+    unsigned version;
+    unsigned unused;
+    unsigned long long nobjects;
+    unsigned long long size;        /* Bytes of records */
+    unsigned long long checksum;    /* FNV-1a of the records */
+} SnapshotHeader;
+
+/*
+ * An object in a snapshot, followed by its content, line, headers and key,
+ * padded to SNAPSHOT_ALIGN
+ */
+typedef struct snapshot_record {
+    unsigned key_len;
+    unsigned line_len, headers_len; /* With their terminating NULs */
+    unsigned char freq, in_main;
+    unsigned short unused;
+    unsigned long long content_length;
+    long long refresh, expires;
+} SnapshotRecord;
+
+/* An object being saved, with its place in the queues */
+typedef struct saved_object {
+    CacheObject *object;
+    unsigned char freq, in_main;
+} SavedObject;
+
+static size_t
+normalize_key(const char *request_line, const char *request_headers,
+              char *key);
 
 static int
-find_empty_line(Cache *cache);
+is_neutral(const char *name, size_t name_len);
+
+static unsigned long long
+hash_key(const char *key, size_t key_len);
+
+static unsigned long long
+fnv1a(unsigned long long hash, const void *data, size_t len);
+
+static void
+insert(Cache *cache, const char *key, size_t key_len, unsigned long long hash,
+       const char *response_line, const char *response_headers,
+       const void *content, size_t content_length, time_t refresh,
+       time_t expires, unsigned char freq, int in_main);
 
 static int
-find_and_distruct_victim(Cache *cache);
+save_shard(CacheShard *shard, FILE *fp, SnapshotHeader *header);
 
 static int
-find_line(Cache *cache, unsigned int tag);
+write_bytes(FILE *fp, const void *data, size_t len, SnapshotHeader *header);
 
-void
-cache_init(Cache *cache)
+static void
+shard_init(CacheShard *shard, size_t max_bytes, Slab *slab);
+
+static CacheShard *
+find_shard(Cache *cache, unsigned long long hash);
+
+static size_t
+probe(CacheShard *shard, unsigned long long hash, const char *key,
+      size_t key_len);
+
+static void
+index_remove(CacheShard *shard, size_t pos);
+
+static void
+index_grow(CacheShard *shard);
+
+static void
+fifo_push(CacheFifo *fifo, CacheLine *line);
+
+static CacheLine *
+fifo_pop(CacheFifo *fifo);
+
+static int
+is_ghost(CacheShard *shard, unsigned long long hash);
+
+static int
+evict(CacheShard *shard);
+
+static void
+unlock_demoting(CacheShard *shard);
+
+static size_t
+object_size(size_t key_len, const char *response_line,
+            const char *response_headers, size_t content_length);
+
+static CacheObject *
+new_object(void *block, Slab *slab, const char *key, size_t key_len,
+           const char *response_line, const char *response_headers,
+           const void *content, size_t content_length);
+
+static void *
+alloc_evicting(CacheShard *shard, size_t size);
+
+static void
+free_line(CacheShard *shard, CacheLine *line);
+
+/*
+ * cache_init - Make room for max_bytes of objects, split over up to
+ *     CACHE_SHARDS shards picked by key hash, each with an equal part of the
+ *     budget. A shard never gets less than the largest object, so small
+ *     budgets use fewer shards. Each shard has its own index, queues and
+ *     readers-writer lock, so requests for different shards never contend.
+ *
+ *     The objects are kept in a slab arena reserved up front, optionally on
+ *     huge pages, so the memory used stays put however objects come and go.
+ *     Returns 0, or -1 if the arena can't be reserved.
+ */
+int
+cache_init(Cache *cache, size_t max_bytes, int hugepages)
+{
+    size_t nshards;
+
+    if (slab_init(&cache->slab, max_bytes, hugepages) < 0)
+        return -1;
+
+    nshards = max_bytes / MAX_OBJECT_SIZE;
+    if (nshards > CACHE_SHARDS)
+        nshards = CACHE_SHARDS;
+    if (nshards < 1)
+        nshards = 1;
+
+    cache->nshards = nshards;
+    cache->max_bytes = max_bytes;
+    cache->disk = NULL;
+    cache->shards = calloc(nshards, sizeof(CacheShard));
+    for (int i = 0; i < cache->nshards; i++)
+        shard_init(&cache->shards[i], max_bytes / nshards, &cache->slab);
+
+    return 0;
+}
+
+/*
+ * cache_init_disk - Add a second tier of max_bytes on disk, in dir. The
+ *     objects evicted from the main queue, those that were hit, are demoted
+ *     to it; they are served from there without a copy, and promoted back
+ *     to RAM when hit again. Returns 0, or -1 if the tier can't be set up.
+ */
+int
+cache_init_disk(Cache *cache, const char *dir, size_t max_bytes)
 {
-    cache->readcnt = 0;
-    cache->highest_timestamp = 0;
-    sem_init(&cache->write_mutex, 0, 1);
-    sem_init(&cache->readcnt_mutex, 0, 1);
-    sem_init(&cache->timestamp_mutex, 0, 1);
-    memset(cache->cache_set, 0, sizeof(cache->cache_set));
+    cache->disk = malloc(sizeof(Disk));
+    if (disk_init(cache->disk, dir, max_bytes) < 0) {
+        free(cache->disk);
+        cache->disk = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < cache->nshards; i++)
+        cache->shards[i].disk = cache->disk;
+    return 0;
 }
 
+/*
+ * cache_write - Cache the response to the request, if it's small enough. It
+ *     stays fresh until expires, and should be fetched again in the
+ *     background when hit from refresh on; the cache keeps it past expires,
+ *     for the caller to revalidate.
+ */
 void
 cache_write(Cache *cache, const char *request_line, const char *request_headers,
-            const char *response_line, const char *response_headers, 
-            const void *content, const size_t content_length)
+            const char *response_line, const char *response_headers,
+            const void *content, const size_t content_length, time_t refresh,
+            time_t expires)
 {
-    int index;
-    unsigned int tag; 
-    size_t object_size;
-    char *response_line_ptr, *response_headers_ptr;
-    void *content_ptr;
+    size_t key_len;
+    unsigned long long hash;
+    char key[MAX_KEY_LEN];
 
     /* check if the object_size can be fit in the cache line */
-    object_size = content_length + strlen(response_line) 
-                  + strlen(response_headers);
-    if (object_size > MAX_OBJECT_SIZE)
+    if (content_length + strlen(response_line) + strlen(response_headers)
+        > MAX_OBJECT_SIZE)
         return;
 
-    /* Create copy to be cached */
-    tag = generate_tag(request_line, request_headers);
+    if (!(key_len = normalize_key(request_line, request_headers, key)))
+        return;
+    hash = hash_key(key, key_len);
 
-    /* 
-     * Allocate for response content to avoid allocation overhead while
-     * acquiring the mutex 
-     */
-    response_line_ptr = strdup(response_line);
-    response_headers_ptr = strdup(response_headers);
-    content_ptr = malloc(content_length);
-    memcpy(content_ptr, content, content_length);
-
-    /* Acquire the the write mutex to protect writing process */
-    sem_wait(&cache->write_mutex);
-
-    /* Find empty cache line */
-    index = find_empty_line(cache);
-    if (index < 0)
-        index = find_and_distruct_victim(cache); // misleading name
-    
-    /* Place cache line */
-    cache->cache_set[index].valid = 1;
-    cache->cache_set[index].tag = tag;
-    cache->cache_set[index].timestamp = ++cache->highest_timestamp;
-    cache->cache_set[index].content_length = content_length;
-    cache->cache_set[index].response_line = response_line_ptr;
-    cache->cache_set[index].response_headers = response_headers_ptr;
-    cache->cache_set[index].content = content_ptr;
-
-    /* Release the write_mutex */
-    sem_post(&cache->write_mutex);
+    insert(cache, key, key_len, hash, response_line, response_headers,
+           content, content_length, refresh, expires, 0, 0);
 }
 
-int
-cache_fetch(Cache *cache, const char *request_line, const char *request_headers,
-            char **response_line, char **response_headers, void **content,
-            size_t *content_length)
-{
-    unsigned int tag;
-    int index, is_cached;
-
-    tag = generate_tag(request_line, request_headers);
-    sem_wait(&cache->readcnt_mutex);
-    cache->readcnt++;
-    if (cache->readcnt == 1)    /* First in */
-        sem_wait(&cache->write_mutex);
-    sem_post(&cache->readcnt_mutex);
-
-    index = find_line(cache, tag);
-    if (index < 0) {
-        is_cached = 0;
+/*
+ * cache_fetch - Look up the response to the request, in RAM then on disk.
+ *     On a hit, returns the cached object itself, no copy is made: the
+ *     caller reads from it and gives it back with cache_release. Returns
+ *     NULL on a miss.
+ *
+ *     A hit only bumps the small frequency counter of the line, readers
+ *     never touch the queues and so can share the lock.
+ */
+CacheObject *
+cache_fetch(Cache *cache, const char *request_line,
+            const char *request_headers)
+{
+    int promote;
+    size_t key_len;
+    unsigned char freq;
+    unsigned long long hash;
+    char key[MAX_KEY_LEN];
+    CacheLine *line;
+    CacheShard *shard;
+    CacheObject *object;
+
+    if (!(key_len = normalize_key(request_line, request_headers, key)))
+        return NULL;
+    hash = hash_key(key, key_len);
+
+    /* Readers of a shard share its lock */
+    shard = find_shard(cache, hash);
+    pthread_rwlock_rdlock(&shard->lock);
+
+    line = shard->index[probe(shard, hash, key, key_len)].line;
+    if (!line) {
+        object = NULL;
     } else {
-        is_cached = 1;
-        *response_line = strdup(cache->cache_set[index].response_line);
-        *response_headers = strdup(cache->cache_set[index].response_headers);
-        
-        *content = malloc(cache->cache_set[index].content_length);
-        memcpy(*content, cache->cache_set[index].content, 
-               cache->cache_set[index].content_length);
-        *content_length = cache->cache_set[index].content_length;
-
-        sem_wait(&cache->timestamp_mutex);
-        cache->cache_set[index].timestamp = ++cache->highest_timestamp;
-        sem_post(&cache->timestamp_mutex);
-    }
-
-    
-    sem_wait(&cache->readcnt_mutex);
-    cache->readcnt--;
-    if (cache->readcnt == 0)    /* Last out */
-        sem_post(&cache->write_mutex);
-    sem_post(&cache->readcnt_mutex);
-
-    return is_cached;
-}
-
-static unsigned long
-generate_tag(const char *request_line, const char *request_headers)
-{
-    size_t len = strlen(request_line) + strlen(request_headers);
-    unsigned long hash = 5381;
-    char *hash_str;
-
-    /* Build the string that will be hashed */
-    hash_str = (char *) malloc(len + 1);
-    hash_str[0] = '\0';
-    strcat(hash_str, request_line);
-    strcat(hash_str, request_headers);
-    
-    for (int i = 0; i < len; i++)
-        hash = ((hash << 5) + hash) + hash_str[i]; /* hash * 33 + c */
-    
-    free(hash_str);
-    return hash;
+        object = line->object;
+        atomic_fetch_add_explicit(&object->refcnt, 1, memory_order_relaxed);
+
+        /* Racing readers may lose a bump, the count is only a hint */
+        freq = atomic_load_explicit(&line->freq, memory_order_relaxed);
+        if (freq < CACHE_MAX_FREQ)
+            atomic_store_explicit(&line->freq, freq + 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (!object && cache->disk
+        && (object = disk_fetch(cache->disk, hash, key, key_len, &promote))) {
+        if (promote)
+            insert(cache, key, key_len, hash, object->response_line,
+                   object->response_headers, object->content,
+                   object->content_length, object->refresh, object->expires,
+                   0, 0);
+    } else if (!object) {
+        atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+    }
+
+    return object;
 }
 
-static int
-find_empty_line(Cache *cache)
+/*
+ * cache_key - The key the response to the request is cached under, at most
+ *     MAX_KEY_LEN bytes and not terminated. Returns its length, or 0 if the
+ *     response can't be cached.
+ */
+size_t
+cache_key(const char *request_line, const char *request_headers, char *key)
+{
+    return normalize_key(request_line, request_headers, key);
+}
+
+/*
+ * cache_retain - Take another reference to object, for a reader that
+ *     already holds one.
+ */
+void
+cache_retain(CacheObject *object)
 {
-    for (int i = 0; i < CACHE_LINES; i++) {
-        if (cache->cache_set[i].valid) 
-            return i;
+    atomic_fetch_add_explicit(&object->refcnt, 1, memory_order_relaxed);
+}
+
+/*
+ * cache_release - Drop a reference to object. An evicted object is only
+ *     freed once its last reader is done with it.
+ */
+void
+cache_release(CacheObject *object)
+{
+    if (atomic_fetch_sub_explicit(&object->refcnt, 1,
+                                  memory_order_acq_rel) > 1)
+        return;
+
+    if (object->segment)
+        disk_release(object);
+    else
+        slab_free(object->slab, object);
+}
+
+/*
+ * cache_stats - Take a snapshot of the counters and usage of all shards.
+ */
+void
+cache_stats(Cache *cache, CacheStats *stats)
+{
+    CacheShard *shard;
+    SlabStats slab;
+
+    memset(stats, 0, sizeof(CacheStats));
+    stats->max_bytes = cache->max_bytes;
+    slab_stats(&cache->slab, &slab);
+    stats->arena_bytes = slab.arena_bytes;
+    stats->arena_used = slab.chunk_bytes;
+    for (int i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[i];
+        stats->hits += atomic_load(&shard->hits);
+        stats->misses += atomic_load(&shard->misses);
+        stats->evictions += atomic_load(&shard->evictions);
+
+        pthread_rwlock_rdlock(&shard->lock);
+        stats->objects += shard->nlines;
+        stats->bytes += shard->small.bytes + shard->main.bytes;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+
+    if (cache->disk)
+        disk_stats(cache->disk, &stats->disk);
+}
+
+/*
+ * cache_save - Write the objects in RAM to a snapshot at path, with their
+ *     queue and hit count, to be loaded by cache_load on the next start. The
+ *     snapshot is written next to path then renamed over it, so path always
+ *     holds a whole one. The shards are only locked while their objects are
+ *     collected, and serve on while those are written.
+ *
+ *     Returns the number of objects saved, or -1 on error.
+ */
+int
+cache_save(Cache *cache, const char *path)
+{
+    char tmp[PATH_MAX];
+    FILE *fp;
+    SnapshotHeader header;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(fp = fopen(tmp, "w"))) {
+        perror(tmp);
+        return -1;
+    }
+
+    /* The header is filled in once the records are written */
+    memset(&header, 0, sizeof(SnapshotHeader));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.checksum = 14695981039346656037ULL;
+    if (fwrite(&header, sizeof(SnapshotHeader), 1, fp) != 1)
+        goto error;
+
+    for (int i = 0; i < cache->nshards; i++) {
+        if (save_shard(&cache->shards[i], fp, &header) < 0)
+            goto error;
+    }
+
+    if (fflush(fp) || fseek(fp, 0, SEEK_SET)
+        || fwrite(&header, sizeof(SnapshotHeader), 1, fp) != 1
+        || fflush(fp) || fsync(fileno(fp)) < 0)
+        goto error;
+    fclose(fp);
+
+    if (rename(tmp, path) < 0) {
+        perror(path);
+        unlink(tmp);
+        return -1;
     }
+    return header.nobjects;
 
+error:
+    perror(tmp);
+    fclose(fp);
+    unlink(tmp);
     return -1;
 }
 
+/*
+ * cache_load - Cache the objects of the snapshot at path, read through a
+ *     mapping of the file, back in the queues they were in. A snapshot of
+ *     another version, cut short or corrupted is ignored as a whole.
+ *
+ *     Returns the number of objects loaded, 0 if there's no snapshot, or -1
+ *     if it can't be used.
+ */
+int
+cache_load(Cache *cache, const char *path)
+{
+    int fd;
+    char *map, *p, *end, *content, *line, *headers, *key;
+    size_t size;
+    unsigned long long nobjects;
+    struct stat st;
+    SnapshotHeader *header;
+    SnapshotRecord *record;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno == ENOENT)
+            return 0;
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        fprintf(stderr, "%s: not a cache snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("snapshot mmap error");
+        return -1;
+    }
+
+    header = (SnapshotHeader *) map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))
+        || header->version != SNAPSHOT_VERSION
+        || header->size != st.st_size - sizeof(SnapshotHeader)
+        || header->checksum != fnv1a(14695981039346656037ULL, header + 1,
+                                     header->size)) {
+        fprintf(stderr, "%s: bad or incomplete cache snapshot\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    end = map + st.st_size;
+    nobjects = 0;
+    for (p = (char *) (header + 1); p + sizeof(SnapshotRecord) <= end;
+         p += size) {
+        record = (SnapshotRecord *) p;
+        size = (sizeof(SnapshotRecord) + record->content_length
+                + record->line_len + record->headers_len + record->key_len
+                + SNAPSHOT_ALIGN - 1) & ~(size_t) (SNAPSHOT_ALIGN - 1);
+        if (size > (size_t) (end - p) || !record->line_len
+            || !record->headers_len || record->key_len > MAX_KEY_LEN)
+            break;
+
+        content = (char *) (record + 1);
+        line = content + record->content_length;
+        headers = line + record->line_len;
+        key = headers + record->headers_len;
+        if (line[record->line_len - 1] || headers[record->headers_len - 1])
+            break;
+
+        insert(cache, key, record->key_len, hash_key(key, record->key_len),
+               line, headers, content, record->content_length,
+               record->refresh, record->expires, record->freq,
+               record->in_main);
+        nobjects++;
+    }
+
+    munmap(map, st.st_size);
+    return nobjects;
+}
+
+/*
+ * save_shard - Write the records of the objects of shard, each queue from
+ *     its oldest object so they are loaded back in order. References to the
+ *     objects are taken with the shard locked, and the records are written
+ *     once it's unlocked.
+ */
 static int
-find_and_distruct_victim(Cache *cache)
+save_shard(CacheShard *shard, FILE *fp, SnapshotHeader *header)
 {
-    int index, least_recent_used;
+    static const char zeros[SNAPSHOT_ALIGN];
+    int rc = 0;
+    size_t n = 0;
+    CacheLine *line;
+    CacheObject *object;
+    SavedObject *saved;
+    SnapshotRecord record;
 
-    index = 0;
-    least_recent_used = cache->cache_set[0].timestamp;
-    for (int i = 1; i < CACHE_LINES; i++) {
-        if (cache->cache_set[i].timestamp < least_recent_used) {
-            index = i;
-            least_recent_used = cache->cache_set[i].timestamp;
+    pthread_rwlock_rdlock(&shard->lock);
+    saved = malloc((shard->nlines + 1) * sizeof(SavedObject));
+    for (int in_main = 0; in_main < 2; in_main++) {
+        for (line = in_main ? shard->main.head : shard->small.head; line;
+             line = line->next) {
+            atomic_fetch_add(&line->object->refcnt, 1);
+            saved[n].object = line->object;
+            saved[n].freq = atomic_load_explicit(&line->freq,
+                                                 memory_order_relaxed);
+            saved[n++].in_main = in_main;
         }
     }
+    pthread_rwlock_unlock(&shard->lock);
+
+    for (size_t i = 0; i < n; i++) {
+        object = saved[i].object;
+        memset(&record, 0, sizeof(SnapshotRecord));
+        record.key_len = object->key_len;
+        record.line_len = strlen(object->response_line) + 1;
+        record.headers_len = strlen(object->response_headers) + 1;
+        record.freq = saved[i].freq;
+        record.in_main = saved[i].in_main;
+        record.content_length = object->content_length;
+        record.refresh = object->refresh;
+        record.expires = object->expires;
 
-    /* Free the memory used by the victim line */
-    // safe_free
-    free(cache->cache_set[index].response_line);
-    free(cache->cache_set[index].response_headers);
-    free(cache->cache_set[index].content);
+        /* The key comes right after the headers in the object */
+        if (!rc && (write_bytes(fp, &record, sizeof(SnapshotRecord),
+                                header) < 0
+                    || write_bytes(fp, object->content,
+                                   object->content_length + record.line_len
+                                   + record.headers_len + record.key_len,
+                                   header) < 0
+                    || write_bytes(fp, zeros, (SNAPSHOT_ALIGN - header->size
+                                               % SNAPSHOT_ALIGN)
+                                              % SNAPSHOT_ALIGN, header) < 0))
+            rc = -1;
+        header->nobjects++;
+        cache_release(object);
+    }
 
-    return index;
+    free(saved);
+    return rc;
 }
 
+/*
+ * write_bytes - Write len bytes of the records, adding them to the checksum
+ *     and size of the snapshot.
+ */
 static int
-find_line(Cache *cache, unsigned int tag)
+write_bytes(FILE *fp, const void *data, size_t len, SnapshotHeader *header)
 {
-    for (int i = 0; i < CACHE_LINES; i++) {
-        if (cache->cache_set[i].valid && cache->cache_set[i].tag == tag)
-            return i;
+    if (fwrite(data, 1, len, fp) != len)
+        return -1;
+
+    header->checksum = fnv1a(header->checksum, data, len);
+    header->size += len;
+    return 0;
+}
+
+/*
+ * insert - Cache an object under key. The object is charged the slab chunks
+ *     it takes against the shard budget, and enters the small queue unless
+ *     in_main is set or its key was evicted from it lately. When the arena
+ *     is short of chunks of its size, objects of the shard are evicted until
+ *     some are freed; if none are, the object isn't cached.
+ */
+static void
+insert(Cache *cache, const char *key, size_t key_len, unsigned long long hash,
+       const char *response_line, const char *response_headers,
+       const void *content, size_t content_length, time_t refresh,
+       time_t expires, unsigned char freq, int in_main)
+{
+    size_t size, charge, pos;
+    CacheObject *object;
+    CacheLine *line, *new_line;
+    CacheShard *shard;
+
+    /* What the object costs, bookkeeping included */
+    size = object_size(key_len, response_line, response_headers,
+                       content_length);
+    charge = slab_chunk_size(&cache->slab, size)
+             + slab_chunk_size(&cache->slab, sizeof(CacheLine));
+    shard = find_shard(cache, hash);
+    if (charge > shard->max_bytes)
+        return;
+
+    /*
+     * Allocate for response content to avoid allocation overhead while
+     * acquiring the mutex
+     */
+    object = new_object(alloc_evicting(shard, size), &cache->slab, key,
+                        key_len, response_line, response_headers, content,
+                        content_length);
+    new_line = alloc_evicting(shard, sizeof(CacheLine));
+    if (!object || !new_line) {
+        if (object)
+            cache_release(object);
+        if (new_line)
+            slab_free(&cache->slab, new_line);
+        return;
     }
 
-    return -1;
+    /* Lock the shard of the key for writing */
+    pthread_rwlock_wrlock(&shard->lock);
+
+    object->refresh = refresh;
+    object->expires = expires;
+
+    if ((line = shard->index[probe(shard, hash, key, key_len)].line)) {
+        /* Cached meanwhile by another request, replace it in place */
+        cache_release(line->object);
+        line->object = object;
+        if (line->in_main)
+            shard->main.bytes += charge - line->size;
+        else
+            shard->small.bytes += charge - line->size;
+        line->size = charge;
+
+        while (shard->small.bytes + shard->main.bytes > shard->max_bytes
+               && evict(shard) >= 0)
+            ;
+    } else {
+        while (shard->small.bytes + shard->main.bytes + charge
+               > shard->max_bytes && evict(shard) >= 0)
+            ;
+
+        line = new_line;
+        new_line = NULL;
+        line->hash = hash;
+        line->object = object;
+        line->size = charge;
+        atomic_init(&line->freq, freq);
+        line->in_main = in_main || is_ghost(shard, hash);
+        fifo_push(line->in_main ? &shard->main : &shard->small, line);
+
+        if (2 * (shard->nlines + 1) > shard->index_mask + 1)
+            index_grow(shard);
+        /* Evictions and growth may have moved the slot */
+        pos = probe(shard, hash, key, key_len);
+        shard->index[pos].hash = hash;
+        shard->index[pos].line = line;
+        shard->nlines++;
+    }
+
+    unlock_demoting(shard);
+
+    if (new_line)   /* Not needed to replace an object */
+        slab_free(&cache->slab, new_line);
+}
+
+static void
+shard_init(CacheShard *shard, size_t max_bytes, Slab *slab)
+{
+    size_t ghost_size;
+
+    /* About as many ghosts as there are small objects in the shard */
+    for (ghost_size = 64; ghost_size < max_bytes / 4096; ghost_size <<= 1)
+        ;
+
+    shard->index = calloc(64, sizeof(CacheSlot));
+    shard->index_mask = 63;
+    shard->nlines = 0;
+    shard->ghost = calloc(ghost_size, sizeof(unsigned long long));
+    shard->ghost_mask = ghost_size - 1;
+    shard->max_bytes = max_bytes;
+    shard->slab = slab;
+    shard->disk = NULL;
+    shard->demoted = NULL;
+
+    pthread_rwlock_init(&shard->lock, NULL);
+    atomic_init(&shard->hits, 0);
+    atomic_init(&shard->misses, 0);
+    atomic_init(&shard->evictions, 0);
+}
+
+/*
+ * find_shard - The shard is picked with the high half of the hash, the low
+ *     bits index the slots within the shard. The last bytes of the key barely
+ *     reach the high bits of FNV-1a, so they're spread there first by a
+ *     Fibonacci multiply, or shards would fill unevenly.
+ */
+static CacheShard *
+find_shard(Cache *cache, unsigned long long hash)
+{
+    return &cache->shards[((hash * 0x9e3779b97f4a7c15ULL) >> 32)
+                          % cache->nshards];
+}
+
+/*
+ * normalize_key - Build the cache key of a request, "method host uri", out
+ *     of the request line and the Host header, followed by the request
+ *     headers that may change the response, as "name:value" lines. Only the
+ *     headers known not to, listed in neutral_headers, are left out so that
+ *     the clients share the cached object; credentials such as Cookie or
+ *     Authorization stay in. Returns the key length, or 0 if the key would
+ *     be longer than MAX_KEY_LEN: the response is then not cached.
+ */
+static size_t
+normalize_key(const char *request_line, const char *request_headers,
+              char *key)
+{
+    size_t len, n, name_len;
+    const char *host, *uri, *line, *value;
+
+    /* Method */
+    n = strcspn(request_line, " ");
+    len = n < MAX_KEY_LEN / 4 ? n : MAX_KEY_LEN / 4;
+    memcpy(key, request_line, len);
+    key[len++] = ' ';
+
+    /* Host, case insensitive */
+    for (host = request_headers; host && strncasecmp(host, "Host:", 5);
+         host = (host = strchr(host, '\n')) ? host + 1 : NULL)
+        ;
+    if (host) {
+        host += 5;
+        host += strspn(host, " \t");
+        n = strcspn(host, " \t\r\n");
+        for (size_t i = 0; i < n && len < MAX_KEY_LEN / 2; i++)
+            key[len++] = tolower((unsigned char) host[i]);
+    }
+    key[len++] = ' ';
+
+    /* Uri, up to the version */
+    uri = request_line + strcspn(request_line, " ");
+    uri += strspn(uri, " ");
+    n = strcspn(uri, " \r\n");
+    if (n > MAX_KEY_LEN - len)
+        return 0;
+    memcpy(key + len, uri, n);
+    len += n;
+
+    /* The headers, names lowercased and values trimmed */
+    for (line = request_headers; line && *line;
+         line = (line = strchr(line, '\n')) ? line + 1 : NULL) {
+        name_len = strcspn(line, ":\r\n");
+        if (line[name_len] != ':' || is_neutral(line, name_len))
+            continue;
+
+        value = line + name_len + 1;
+        value += strspn(value, " \t");
+        for (n = strcspn(value, "\r\n");
+             n && (value[n - 1] == ' ' || value[n - 1] == '\t'); n--)
+            ;
+        if (len + name_len + n + 2 > MAX_KEY_LEN)
+            return 0;
+
+        key[len++] = '\n';
+        for (size_t i = 0; i < name_len; i++)
+            key[len++] = tolower((unsigned char) line[i]);
+        key[len++] = ':';
+        memcpy(key + len, value, n);
+        len += n;
+    }
+
+    return len;
+}
+
+/*
+ * is_neutral - Whether the request header named name, of name_len bytes, is
+ *     known not to change the response: the proxy answers or replaces it
+ *     itself, or the server has to name it in Vary if it does, which keeps
+ *     the response from being cached.
+ */
+static int
+is_neutral(const char *name, size_t name_len)
+{
+    for (int i = 0; neutral_headers[i]; i++) {
+        if (strlen(neutral_headers[i]) == name_len
+            && !strncasecmp(name, neutral_headers[i], name_len))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * hash_key - 64-bit FNV-1a hash of the key bytes.
+ */
+static unsigned long long
+hash_key(const char *key, size_t key_len)
+{
+    return fnv1a(14695981039346656037ULL, key, key_len);
+}
+
+/*
+ * fnv1a - Go on with an FNV-1a hash over len more bytes.
+ */
+static unsigned long long
+fnv1a(unsigned long long hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/*
+ * probe - Find the index slot of key: the slot holding it if it's cached,
+ *     else the empty slot where it would go. A slot only matches if the
+ *     whole key is the same, not just its hash.
+ */
+static size_t
+probe(CacheShard *shard, unsigned long long hash, const char *key,
+      size_t key_len)
+{
+    size_t pos;
+    CacheSlot *slot;
+
+    for (pos = hash & shard->index_mask; ; pos = (pos + 1) & shard->index_mask) {
+        slot = &shard->index[pos];
+        if (!slot->line)
+            return pos;
+        if (slot->hash != hash)
+            continue;
+
+        if (slot->line->object->key_len == key_len
+            && !memcmp(slot->line->object->key, key, key_len))
+            return pos;
+    }
+}
+
+/*
+ * index_remove - Empty the slot at pos, then shift back the slots after it
+ *     that would no longer be reachable, so no tombstone is needed.
+ */
+static void
+index_remove(CacheShard *shard, size_t pos)
+{
+    size_t next, home;
+
+    for (next = (pos + 1) & shard->index_mask; shard->index[next].line;
+         next = (next + 1) & shard->index_mask) {
+        home = shard->index[next].hash & shard->index_mask;
+
+        /* Move it if its home isn't cyclically in (pos, next] */
+        if (((next - home) & shard->index_mask)
+            >= ((next - pos) & shard->index_mask)) {
+            shard->index[pos] = shard->index[next];
+            pos = next;
+        }
+    }
+
+    shard->index[pos].line = NULL;
+}
+
+/*
+ * index_grow - Double the index, the number of objects a shard holds
+ *     depends on their sizes and isn't known up front.
+ */
+static void
+index_grow(CacheShard *shard)
+{
+    size_t old_size, pos;
+    CacheSlot *old;
+
+    old = shard->index;
+    old_size = shard->index_mask + 1;
+    shard->index = calloc(2 * old_size, sizeof(CacheSlot));
+    shard->index_mask = 2 * old_size - 1;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (!old[i].line)
+            continue;
+        for (pos = old[i].hash & shard->index_mask; shard->index[pos].line;
+             pos = (pos + 1) & shard->index_mask)
+            ;
+        shard->index[pos] = old[i];
+    }
+
+    free(old);
+}
+
+static void
+fifo_push(CacheFifo *fifo, CacheLine *line)
+{
+    line->next = NULL;
+    if (fifo->tail)
+        fifo->tail->next = line;
+    else
+        fifo->head = line;
+    fifo->tail = line;
+    fifo->bytes += line->size;
+}
+
+static CacheLine *
+fifo_pop(CacheFifo *fifo)
+{
+    CacheLine *line;
+
+    if (!(line = fifo->head))
+        return NULL;
+    if (!(fifo->head = line->next))
+        fifo->tail = NULL;
+    fifo->bytes -= line->size;
+    return line;
+}
+
+/*
+ * is_ghost - Whether the key of hash was evicted from the small queue
+ *     lately. The ghost is forgotten, the key is being cached again.
+ */
+static int
+is_ghost(CacheShard *shard, unsigned long long hash)
+{
+    unsigned long long *ghost = &shard->ghost[hash & shard->ghost_mask];
+
+    if (*ghost != hash || !hash)
+        return 0;
+    *ghost = 0;
+    return 1;
+}
+
+/*
+ * evict - One step of S3-FIFO. While the small queue holds more than a tenth
+ *     of the budget, its oldest object moves on to the main queue if it was
+ *     hit, else it's evicted and its hash kept as a ghost. Otherwise the main
+ *     queue is a CLOCK: its oldest object goes round again, one hit less, or
+ *     is evicted if none are left, and demoted to the disk tier if any. The
+ *     demoted object is only written once the shard is unlocked.
+ *
+ *     Returns 1 if an object was evicted, 0 if one was only moved, or -1 if
+ *     the shard is empty.
+ */
+static int
+evict(CacheShard *shard)
+{
+    unsigned char freq;
+    CacheLine *line;
+    CacheDemotion *demotion;
+
+    if (shard->small.head
+        && (shard->small.bytes > shard->max_bytes / 10 || !shard->main.head)) {
+        line = fifo_pop(&shard->small);
+        if (atomic_load_explicit(&line->freq, memory_order_relaxed)) {
+            atomic_store_explicit(&line->freq, 0, memory_order_relaxed);
+            line->in_main = 1;
+            fifo_push(&shard->main, line);
+            return 0;
+        }
+        shard->ghost[line->hash & shard->ghost_mask] = line->hash;
+    } else if ((line = fifo_pop(&shard->main))) {
+        freq = atomic_load_explicit(&line->freq, memory_order_relaxed);
+        if (freq) {
+            atomic_store_explicit(&line->freq, freq - 1, memory_order_relaxed);
+            fifo_push(&shard->main, line);
+            return 0;
+        }
+        if (shard->disk) {
+            demotion = malloc(sizeof(CacheDemotion));
+            demotion->hash = line->hash;
+            demotion->object = line->object;
+            cache_retain(line->object);
+            demotion->next = shard->demoted;
+            shard->demoted = demotion;
+        }
+    } else {
+        return -1;
+    }
+
+    free_line(shard, line);
+    atomic_fetch_add_explicit(&shard->evictions, 1, memory_order_relaxed);
+    return 1;
+}
+
+/*
+ * unlock_demoting - Unlock the shard, then write the objects its evictions
+ *     demoted to the disk tier: copying them doesn't hold up its readers.
+ */
+static void
+unlock_demoting(CacheShard *shard)
+{
+    CacheDemotion *demotion, *next;
+
+    next = shard->demoted;
+    shard->demoted = NULL;
+    pthread_rwlock_unlock(&shard->lock);
+
+    while ((demotion = next)) {
+        next = demotion->next;
+        disk_write(shard->disk, demotion->hash, demotion->object);
+        cache_release(demotion->object);
+        free(demotion);
+    }
+}
+
+/*
+ * object_size - The size of the block holding a cache object.
+ */
+static size_t
+object_size(size_t key_len, const char *response_line,
+            const char *response_headers, size_t content_length)
+{
+    return sizeof(CacheObject) + content_length + strlen(response_line) + 1
+           + strlen(response_headers) + 1 + key_len;
+}
+
+/*
+ * new_object - Build a cache object in a single chunk of slab, the content
+ *     first to keep it aligned, then the line, the headers and the key. The
+ *     cache holds the first reference. Returns NULL if no chunk was had.
+ */
+static CacheObject *
+new_object(void *block, Slab *slab, const char *key, size_t key_len,
+           const char *response_line, const char *response_headers,
+           const void *content, size_t content_length)
+{
+    size_t line_len, headers_len;
+    CacheObject *object = block;
+
+    if (!object)
+        return NULL;
+    line_len = strlen(response_line) + 1;
+    headers_len = strlen(response_headers) + 1;
+
+    atomic_init(&object->refcnt, 1);
+    object->slab = slab;
+    object->segment = NULL;
+    object->content = object->data;
+    object->content_length = content_length;
+    object->response_line = object->data + content_length;
+    object->response_headers = object->response_line + line_len;
+    object->key = object->response_headers + headers_len;
+    object->key_len = key_len;
+
+    memcpy(object->content, content, content_length);
+    memcpy(object->response_line, response_line, line_len);
+    memcpy(object->response_headers, response_headers, headers_len);
+    memcpy(object->key, key, key_len);
+
+    return object;
+}
+
+/*
+ * alloc_evicting - Allocate from the arena, evicting objects of the shard
+ *     if it's full. The arena is shared by the shards and a page only goes
+ *     back to the pool once all its chunks are free, so evicting objects of
+ *     other sizes may free nothing: after CACHE_ALLOC_EVICTIONS of them, it
+ *     gives up and returns NULL. Called with the shard unlocked, demoted
+ *     objects free their chunks once written, before the last try.
+ */
+static void *
+alloc_evicting(CacheShard *shard, size_t size)
+{
+    int rc, evicted = 0;
+    void *ptr;
+
+    if ((ptr = slab_alloc(shard->slab, size)))
+        return ptr;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    while (!(ptr = slab_alloc(shard->slab, size))
+           && evicted < CACHE_ALLOC_EVICTIONS && (rc = evict(shard)) >= 0)
+        evicted += rc;
+    unlock_demoting(shard);
+
+    return ptr ? ptr : slab_alloc(shard->slab, size);
 }
 
+/*
+ * free_line - Drop a line out of its queue from the index and free it, the
+ *     cache's reference to its object goes away.
+ */
+static void
+free_line(CacheShard *shard, CacheLine *line)
+{
+    index_remove(shard, probe(shard, line->hash, line->object->key,
+                              line->object->key_len));
+    shard->nlines--;
+    cache_release(line->object);
+    slab_free(shard->slab, line);
+}
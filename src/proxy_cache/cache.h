@@ -1,43 +1,144 @@
 #ifndef CACHE_H
 #define CACHE_H
 
-#include <semaphore.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
+#include <time.h>
+
+#include "disk.h"
+#include "slab.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE  1049000     /* 1MB total cache size */
 #define MAX_OBJECT_SIZE 102400      /* 1KB cache object size */
-#define CACHE_LINES (MAX_CACHE_SIZE / MAX_OBJECT_SIZE)
+#define MAX_KEY_LEN     8192        /* Longest normalized request key */
+#define CACHE_SHARDS    16          /* Independently locked shards */
+#define CACHE_MAX_FREQ  3           /* Hits remembered per object */
+#define CACHE_ALLOC_EVICTIONS 16    /* Evicted at most to free a chunk */
 
-typedef struct cache_line {
+/*
+ * A cached response, immutable once cached. The key, line, headers and
+ * content all live in the one slab chunk; the chunk is given back when the
+ * cache and every reader holding it have released it. An object served from
+ * the disk tier points into its mapped segment instead.
+ */
+typedef struct cache_object {
+    atomic_int refcnt;
+    Slab *slab;                     /* Where the object was allocated */
+    DiskSegment *segment;           /* Segment it's read from, or NULL */
+    char *key;                      /* Normalized request, not terminated */
+    size_t key_len;
     char *response_line, *response_headers;
     void *content;
     size_t content_length;
-    unsigned long long timestamp;
-    unsigned int tag;
-    unsigned char valid;
+    time_t refresh;                 /* Refreshed in the background from then */
+    time_t expires;                 /* Fresh until then */
+    char data[];
+} CacheObject;
+
+/* The cache's bookkeeping for an object, only changed with its shard locked */
+typedef struct cache_line {
+    unsigned long long hash;        /* 64-bit hash of the key */
+    CacheObject *object;
+    size_t size;                    /* Bytes charged to the shard */
+    atomic_uchar freq;              /* Hits, bumped by readers without lock */
+    unsigned char in_main;          /* In the main queue, else the small one */
+    struct cache_line *next;
 } CacheLine;
 
+/* Open-addressing index entry, line is NULL for an empty slot */
+typedef struct cache_slot {
+    unsigned long long hash;
+    CacheLine *line;
+} CacheSlot;
+
+typedef struct cache_fifo {
+    CacheLine *head, *tail;
+    size_t bytes;
+} CacheFifo;
+
+/* An object evicted to the disk tier, written once its shard is unlocked */
+typedef struct cache_demotion {
+    unsigned long long hash;
+    CacheObject *object;            /* Held by the demotion */
+    struct cache_demotion *next;
+} CacheDemotion;
+
+/*
+ * A part of the cache with its own byte budget, index, lock and S3-FIFO
+ * queues: new objects go through the small queue, those hit while there
+ * move on to the main queue, and the keys evicted from the small queue are
+ * remembered by the ghost table to go straight to the main one next time.
+ */
+typedef struct cache_shard {
+    CacheSlot *index;               /* At most half full, linear probing */
+    size_t index_mask, nlines;
+    CacheFifo small, main;
+    unsigned long long *ghost;      /* Hashes of recently evicted keys */
+    size_t ghost_mask;
+    size_t max_bytes;
+    Slab *slab;
+    Disk *disk;                     /* Where evicted objects go, or NULL */
+    CacheDemotion *demoted;         /* Evicted, not written to disk yet */
+    pthread_rwlock_t lock;
+    atomic_ullong hits, misses, evictions;
+} CacheShard;
+
 typedef struct cache {
-    CacheLine cache_set[CACHE_LINES];
-    sem_t write_mutex, readcnt_mutex, timestamp_mutex;
-    unsigned long long highest_timestamp;
-    unsigned long long readcnt;
+    CacheShard *shards;
+    int nshards;
+    size_t max_bytes;
+    Slab slab;                      /* Holds the objects and their lines */
+    Disk *disk;                     /* Second tier, NULL if there's none */
 } Cache;
 
-void
-cache_init(Cache *cache);
+typedef struct cache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long objects;
+    unsigned long long bytes;       /* Charged to the budget */
+    unsigned long long max_bytes;
+    unsigned long long arena_bytes; /* Reserved for the slab */
+    unsigned long long arena_used;  /* Chunks in use, evicted ones included */
+    DiskStats disk;                 /* All 0 without a disk tier */
+} CacheStats;
+
+int
+cache_init(Cache *cache, size_t max_bytes, int hugepages);
+
+int
+cache_init_disk(Cache *cache, const char *dir, size_t max_bytes);
+
+int
+cache_save(Cache *cache, const char *path);
+
+int
+cache_load(Cache *cache, const char *path);
 
 void
 cache_write(Cache *cache, const char *request_line, const char *request_headers,
-            const char *response_line, const char *response_headers, 
-            const void *content, const size_t content_length);
+            const char *response_line, const char *response_headers,
+            const void *content, const size_t content_length, time_t refresh,
+            time_t expires);
 
-int
-cache_fetch(Cache *cache, const char *request_line, const char *request_headers,
-            char **response_line, char **response_headers, void **content,
-            size_t *content_length);
+CacheObject *
+cache_fetch(Cache *cache, const char *request_line,
+            const char *request_headers);
+
+size_t
+cache_key(const char *request_line, const char *request_headers, char *key);
+
+void
+cache_retain(CacheObject *object);
+
+void
+cache_release(CacheObject *object);
+
+void
+cache_stats(Cache *cache, CacheStats *stats);
 
 #endif
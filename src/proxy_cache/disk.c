@@ -0,0 +1,334 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define RECORD_ALIGN 8
+
+/*
+ * An object in the log, followed by its content, line, headers and key, in
+ * the order of a cache object
+ */
+typedef struct disk_record {
+    unsigned long long hash;
+    unsigned key_len;
+    unsigned line_len, headers_len; /* With their terminating NULs */
+    unsigned unused;
+    size_t content_length;
+    time_t refresh, expires;
+} DiskRecord;
+
+static size_t
+record_size(size_t key_len, size_t line_len, size_t headers_len,
+            size_t content_length);
+
+static DiskEntry *
+find_entry(Disk *disk, unsigned long long hash, const char *key,
+           size_t key_len);
+
+static void
+drop_segment(Disk *disk, int index);
+
+/*
+ * disk_init - Create the segment files of a log of nbytes in dir, and map
+ *     them. Files left by a previous run are emptied. Returns 0, or -1 if a
+ *     segment can't be created.
+ */
+int
+disk_init(Disk *disk, const char *dir, size_t nbytes)
+{
+    char path[PATH_MAX];
+    size_t nbuckets;
+    DiskSegment *segment;
+
+    memset(disk, 0, sizeof(Disk));
+
+    /* At least two segments, one to fill while the other is kept */
+    disk->segment_size = nbytes / 2 < DISK_SEGMENT_SIZE ?
+                         nbytes / 2 : DISK_SEGMENT_SIZE;
+    disk->segment_size &= ~(size_t) (getpagesize() - 1);
+    if (disk->segment_size < 2 * MAX_OBJECT_SIZE) {
+        fprintf(stderr, "disk cache of %zu bytes is too small\n", nbytes);
+        return -1;
+    }
+    disk->nsegments = nbytes / disk->segment_size;
+
+    disk->segments = calloc(disk->nsegments, sizeof(DiskSegment));
+    for (int i = 0; i < disk->nsegments; i++) {
+        segment = &disk->segments[i];
+        snprintf(path, sizeof(path), "%s/segment-%03d", dir, i);
+        if ((segment->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0
+            || ftruncate(segment->fd, disk->segment_size) < 0) {
+            perror(path);
+            return -1;
+        }
+        segment->map = mmap(NULL, disk->segment_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, segment->fd, 0);
+        if (segment->map == MAP_FAILED) {
+            perror("segment mmap error");
+            return -1;
+        }
+        atomic_init(&segment->readers, 0);
+    }
+
+    /* About a bucket per 8K of log */
+    for (nbuckets = 1024; nbuckets < nbytes / 8192; nbuckets <<= 1)
+        ;
+    disk->buckets = calloc(nbuckets, sizeof(DiskEntry *));
+    disk->bucket_mask = nbuckets - 1;
+
+    pthread_mutex_init(&disk->mutex, NULL);
+    atomic_init(&disk->hits, 0);
+    atomic_init(&disk->demoted, 0);
+    atomic_init(&disk->promoted, 0);
+
+    return 0;
+}
+
+/*
+ * disk_write - Append object, evicted from RAM, to the log unless the same
+ *     response is there already. A different one, refreshed or revalidated
+ *     since it was written, replaces it: the old record is left for its
+ *     segment to be recycled. When the current segment is full, the oldest
+ *     one is recycled, or the object dropped if it's still being served from.
+ */
+void
+disk_write(Disk *disk, unsigned long long hash, CacheObject *object)
+{
+    int next;
+    size_t size, line_len, headers_len;
+    char *p;
+    DiskEntry *entry;
+    DiskRecord *record, *old;
+    DiskSegment *segment;
+
+    line_len = strlen(object->response_line) + 1;
+    headers_len = strlen(object->response_headers) + 1;
+    size = record_size(object->key_len, line_len, headers_len,
+                       object->content_length);
+    if (size > disk->segment_size)
+        return;
+
+    pthread_mutex_lock(&disk->mutex);
+
+    /* Written when it was last evicted, count its hits anew */
+    if ((entry = find_entry(disk, hash, object->key, object->key_len))) {
+        old = (DiskRecord *) (disk->segments[entry->segment].map
+                              + entry->offset);
+        if (old->expires == object->expires
+            && old->refresh == object->refresh
+            && old->content_length == object->content_length) {
+            entry->hits = 0;
+            pthread_mutex_unlock(&disk->mutex);
+            return;
+        }
+    }
+
+    segment = &disk->segments[disk->current];
+    if (segment->used + size > disk->segment_size) {
+        next = (disk->current + 1) % disk->nsegments;
+        if (atomic_load(&disk->segments[next].readers)) {
+            pthread_mutex_unlock(&disk->mutex);
+            return;
+        }
+        if (entry && entry->segment == next)
+            entry = NULL;           /* Dropped with the old record */
+        drop_segment(disk, next);
+        disk->current = next;
+        segment = &disk->segments[next];
+    }
+
+    /* The page cache writes it back on its own */
+    record = (DiskRecord *) (segment->map + segment->used);
+    record->hash = hash;
+    record->key_len = object->key_len;
+    record->line_len = line_len;
+    record->headers_len = headers_len;
+    record->content_length = object->content_length;
+    record->refresh = object->refresh;
+    record->expires = object->expires;
+    p = (char *) (record + 1);
+    memcpy(p, object->content, object->content_length);
+    p += object->content_length;
+    memcpy(p, object->response_line, line_len);
+    p += line_len;
+    memcpy(p, object->response_headers, headers_len);
+    p += headers_len;
+    memcpy(p, object->key, object->key_len);
+
+    if (entry) {                    /* Repoint it, the old record is dead */
+        old = (DiskRecord *) (disk->segments[entry->segment].map
+                              + entry->offset);
+        disk->bytes -= record_size(old->key_len, old->line_len,
+                                   old->headers_len, old->content_length);
+    } else {
+        entry = malloc(sizeof(DiskEntry));
+        entry->hash = hash;
+        entry->next = disk->buckets[hash & disk->bucket_mask];
+        disk->buckets[hash & disk->bucket_mask] = entry;
+        disk->objects++;
+    }
+    entry->segment = disk->current;
+    entry->offset = segment->used;
+    entry->hits = 0;
+
+    segment->used += size;
+    disk->bytes += size;
+
+    pthread_mutex_unlock(&disk->mutex);
+
+    atomic_fetch_add(&disk->demoted, 1);
+}
+
+/*
+ * disk_fetch - Look key up in the log. On a hit, returns a cache object
+ *     pointing into the mapped segment, the content is not copied; it's
+ *     given back with cache_release like objects in RAM. promote is set on
+ *     the hit that should bring the object back to RAM.
+ */
+CacheObject *
+disk_fetch(Disk *disk, unsigned long long hash, const char *key,
+           size_t key_len, int *promote)
+{
+    DiskEntry *entry;
+    DiskRecord *record;
+    DiskSegment *segment;
+    CacheObject *object;
+
+    pthread_mutex_lock(&disk->mutex);
+
+    if (!(entry = find_entry(disk, hash, key, key_len))) {
+        pthread_mutex_unlock(&disk->mutex);
+        return NULL;
+    }
+
+    /* The segment isn't recycled while it's read from */
+    segment = &disk->segments[entry->segment];
+    atomic_fetch_add(&segment->readers, 1);
+    record = (DiskRecord *) (segment->map + entry->offset);
+    *promote = ++entry->hits == DISK_PROMOTE_HITS;
+
+    pthread_mutex_unlock(&disk->mutex);
+
+    atomic_fetch_add(&disk->hits, 1);
+    if (*promote)
+        atomic_fetch_add(&disk->promoted, 1);
+
+    object = malloc(sizeof(CacheObject));
+    atomic_init(&object->refcnt, 1);
+    object->slab = NULL;
+    object->segment = segment;
+    object->content = record + 1;
+    object->content_length = record->content_length;
+    object->refresh = record->refresh;
+    object->expires = record->expires;
+    object->response_line = (char *) object->content + record->content_length;
+    object->response_headers = object->response_line + record->line_len;
+    object->key = object->response_headers + record->headers_len;
+    object->key_len = record->key_len;
+
+    return object;
+}
+
+/*
+ * disk_release - Free an object served from the log, once unused.
+ */
+void
+disk_release(CacheObject *object)
+{
+    atomic_fetch_sub(&object->segment->readers, 1);
+    free(object);
+}
+
+/*
+ * disk_stats - Take a snapshot of the log counters and usage.
+ */
+void
+disk_stats(Disk *disk, DiskStats *stats)
+{
+    stats->hits = atomic_load(&disk->hits);
+    stats->demoted = atomic_load(&disk->demoted);
+    stats->promoted = atomic_load(&disk->promoted);
+
+    pthread_mutex_lock(&disk->mutex);
+    stats->objects = disk->objects;
+    stats->bytes = disk->bytes;
+    pthread_mutex_unlock(&disk->mutex);
+
+    stats->max_bytes = disk->nsegments * disk->segment_size;
+}
+
+static size_t
+record_size(size_t key_len, size_t line_len, size_t headers_len,
+            size_t content_length)
+{
+    return (sizeof(DiskRecord) + content_length + line_len + headers_len
+            + key_len + RECORD_ALIGN - 1) & ~(size_t) (RECORD_ALIGN - 1);
+}
+
+/*
+ * find_entry - Find the entry of key, comparing the whole key stored in the
+ *     log, with the log locked.
+ */
+static DiskEntry *
+find_entry(Disk *disk, unsigned long long hash, const char *key,
+           size_t key_len)
+{
+    char *stored;
+    DiskEntry *entry;
+    DiskRecord *record;
+
+    for (entry = disk->buckets[hash & disk->bucket_mask]; entry;
+         entry = entry->next) {
+        if (entry->hash != hash)
+            continue;
+
+        record = (DiskRecord *) (disk->segments[entry->segment].map
+                                 + entry->offset);
+        stored = (char *) (record + 1) + record->content_length
+                 + record->line_len + record->headers_len;
+        if (record->key_len == key_len && !memcmp(stored, key, key_len))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/*
+ * drop_segment - Empty a segment to be written again, removing the entries
+ *     of its records, with the log locked. Records replaced by later ones
+ *     have no entry left and were already uncounted.
+ */
+static void
+drop_segment(Disk *disk, int index)
+{
+    size_t offset, size;
+    DiskEntry **link, *entry;
+    DiskRecord *record;
+    DiskSegment *segment = &disk->segments[index];
+
+    for (offset = 0; offset < segment->used; offset += size) {
+        record = (DiskRecord *) (segment->map + offset);
+        size = record_size(record->key_len, record->line_len,
+                           record->headers_len, record->content_length);
+
+        for (link = &disk->buckets[record->hash & disk->bucket_mask];
+             (entry = *link); link = &entry->next) {
+            if (entry->segment == index && entry->offset == offset) {
+                *link = entry->next;
+                free(entry);
+                disk->objects--;
+                disk->bytes -= size;
+                break;
+            }
+        }
+    }
+
+    segment->used = 0;
+}
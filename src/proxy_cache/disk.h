@@ -0,0 +1,72 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define DISK_SIZE           (1024UL * 1024 * 1024)  /* Default L2 size */
+#define DISK_SEGMENT_SIZE   (64UL * 1024 * 1024)    /* Largest segment file */
+#define DISK_PROMOTE_HITS   2       /* L2 hits moving an object back to RAM */
+
+struct cache_object;
+
+/* A segment file of the log, mapped whole */
+typedef struct disk_segment {
+    int fd;
+    char *map;
+    size_t used;                    /* Bytes appended */
+    atomic_int readers;             /* Objects served from it in use */
+} DiskSegment;
+
+/* Where the record of a key is in the log */
+typedef struct disk_entry {
+    unsigned long long hash;
+    int segment;
+    size_t offset;
+    unsigned hits;                  /* Since it was last demoted */
+    struct disk_entry *next;
+} DiskEntry;
+
+/*
+ * The second tier of the cache, an append-only log of segment files on
+ * local disk. Segments are filled in turn and the oldest one is recycled
+ * when the log is full, dropping its objects.
+ */
+typedef struct disk {
+    DiskSegment *segments;
+    int nsegments, current;
+    size_t segment_size;
+    DiskEntry **buckets;
+    size_t bucket_mask;
+    unsigned long long objects, bytes;
+    pthread_mutex_t mutex;
+    atomic_ullong hits, demoted, promoted;
+} Disk;
+
+typedef struct disk_stats {
+    unsigned long long hits;
+    unsigned long long demoted;     /* Written from RAM */
+    unsigned long long promoted;    /* Read back into RAM */
+    unsigned long long objects;
+    unsigned long long bytes;
+    unsigned long long max_bytes;
+} DiskStats;
+
+int
+disk_init(Disk *disk, const char *dir, size_t nbytes);
+
+void
+disk_write(Disk *disk, unsigned long long hash, struct cache_object *object);
+
+struct cache_object *
+disk_fetch(Disk *disk, unsigned long long hash, const char *key,
+           size_t key_len, int *promote);
+
+void
+disk_release(struct cache_object *object);
+
+void
+disk_stats(Disk *disk, DiskStats *stats);
+
+#endif
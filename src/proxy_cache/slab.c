@@ -0,0 +1,270 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+static int
+find_class(Slab *slab, size_t size);
+
+static SlabPage *
+take_page(Slab *slab, int cls);
+
+static void
+give_page(Slab *slab, SlabPage *page);
+
+static void
+partial_add(SlabClass *class, SlabPage *page);
+
+static void
+partial_remove(SlabClass *class, SlabPage *page);
+
+/*
+ * slab_init - Reserve an arena for nbytes of chunks, and the size classes
+ *     to cut it in. A page of slack per class is added, as the last page
+ *     given to a class is seldom full; pages are made smaller for small
+ *     arenas so the slack stays a fraction of them. With hugepages, the
+ *     arena is mapped on huge pages if some are reserved, else advised to be
+ *     backed by transparent ones.
+ *
+ *     Returns 0, or -1 if the arena can't be mapped.
+ */
+int
+slab_init(Slab *slab, size_t nbytes, int hugepages)
+{
+    size_t size;
+    SlabClass *class;
+
+    memset(slab, 0, sizeof(Slab));
+
+    /* Classes grow by SLAB_GROWTH up to the largest chunk */
+    for (slab->page_size = SLAB_MAX_PAGE; slab->page_size > SLAB_MAX_CHUNK
+         && slab->page_size > nbytes / 16; slab->page_size >>= 1)
+        ;
+    for (size = SLAB_MIN_CHUNK; slab->nclasses < SLAB_MAX_CLASSES;
+         size = (size_t) (size * SLAB_GROWTH + SLAB_ALIGN - 1)
+                & ~(size_t) (SLAB_ALIGN - 1)) {
+        class = &slab->classes[slab->nclasses++];
+        class->size = size < SLAB_MAX_CHUNK ? size : SLAB_MAX_CHUNK;
+        class->per_page = slab->page_size / class->size;
+        pthread_mutex_init(&class->mutex, NULL);
+        if (class->size == SLAB_MAX_CHUNK)
+            break;
+    }
+
+    slab->npages = (nbytes + slab->page_size - 1) / slab->page_size
+                   + slab->nclasses;
+    slab->arena_size = slab->npages * slab->page_size;
+    slab->arena = MAP_FAILED;
+    if (hugepages) {
+        slab->arena_size = (slab->arena_size + HUGE_PAGE_SIZE - 1)
+                           & ~(size_t) (HUGE_PAGE_SIZE - 1);
+        slab->npages = slab->arena_size / slab->page_size;
+        slab->arena = mmap(NULL, slab->arena_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        slab->hugepages = slab->arena != MAP_FAILED;
+    }
+    if (slab->arena == MAP_FAILED) {
+        slab->arena = mmap(NULL, slab->arena_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab->arena == MAP_FAILED) {
+            perror("slab arena mmap error");
+            return -1;
+        }
+        if (hugepages)
+            madvise(slab->arena, slab->arena_size, MADV_HUGEPAGE);
+    }
+
+    /* All pages start in the pool, the first ones on top */
+    slab->pages = malloc(slab->npages * sizeof(SlabPage));
+    slab->free_pages = malloc(slab->npages * sizeof(size_t));
+    for (size_t i = 0; i < slab->npages; i++) {
+        slab->pages[i].cls = -1;
+        slab->free_pages[i] = slab->npages - 1 - i;
+    }
+    slab->nfree = slab->npages;
+    pthread_mutex_init(&slab->pool_mutex, NULL);
+
+    return 0;
+}
+
+/*
+ * slab_chunk_size - The size of the chunk that holds size bytes, what an
+ *     allocation really costs. Returns 0 if size is over the largest chunk.
+ */
+size_t
+slab_chunk_size(Slab *slab, size_t size)
+{
+    int cls;
+
+    if ((cls = find_class(slab, size)) < 0)
+        return 0;
+    return slab->classes[cls].size;
+}
+
+/*
+ * slab_alloc - Hand out a chunk of at least size bytes, out of a page of its
+ *     class that has room, else out of a new page. Returns NULL if size is
+ *     over the largest chunk or the arena has no free page left.
+ */
+void *
+slab_alloc(Slab *slab, size_t size)
+{
+    int cls;
+    SlabChunk *chunk;
+    SlabClass *class;
+    SlabPage *page;
+
+    if ((cls = find_class(slab, size)) < 0)
+        return NULL;
+    class = &slab->classes[cls];
+
+    pthread_mutex_lock(&class->mutex);
+
+    if (!(page = class->partial) && !(page = take_page(slab, cls))) {
+        pthread_mutex_unlock(&class->mutex);
+        return NULL;
+    }
+
+    /* Reuse a chunk given back, else cut the next one */
+    if ((chunk = page->free)) {
+        page->free = chunk->next;
+    } else {
+        chunk = (SlabChunk *) (slab->arena + (page - slab->pages)
+                               * slab->page_size + page->carved * class->size);
+        page->carved++;
+    }
+    if (++page->used == class->per_page)
+        partial_remove(class, page);
+    class->used++;
+
+    pthread_mutex_unlock(&class->mutex);
+
+    return chunk;
+}
+
+/*
+ * slab_free - Give back a chunk. A page with no chunk left in use goes back
+ *     to the pool, to be cut for whatever class needs it next.
+ */
+void
+slab_free(Slab *slab, void *ptr)
+{
+    SlabChunk *chunk = ptr;
+    SlabPage *page;
+    SlabClass *class;
+
+    page = &slab->pages[((char *) ptr - slab->arena) / slab->page_size];
+    class = &slab->classes[page->cls];
+
+    pthread_mutex_lock(&class->mutex);
+
+    chunk->next = page->free;
+    page->free = chunk;
+    if (page->used-- == class->per_page)
+        partial_add(class, page);
+    class->used--;
+
+    if (!page->used) {
+        partial_remove(class, page);
+        give_page(slab, page);
+    }
+
+    pthread_mutex_unlock(&class->mutex);
+}
+
+/*
+ * slab_stats - Take a snapshot of the arena usage.
+ */
+void
+slab_stats(Slab *slab, SlabStats *stats)
+{
+    SlabClass *class;
+
+    stats->arena_bytes = slab->arena_size;
+    stats->chunk_bytes = 0;
+    for (int i = 0; i < slab->nclasses; i++) {
+        class = &slab->classes[i];
+        pthread_mutex_lock(&class->mutex);
+        stats->chunk_bytes += class->used * class->size;
+        pthread_mutex_unlock(&class->mutex);
+    }
+
+    pthread_mutex_lock(&slab->pool_mutex);
+    stats->used_pages = slab->npages - slab->nfree;
+    pthread_mutex_unlock(&slab->pool_mutex);
+}
+
+static int
+find_class(Slab *slab, size_t size)
+{
+    for (int i = 0; i < slab->nclasses; i++) {
+        if (slab->classes[i].size >= size)
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * take_page - Give a page from the pool to class cls, with its mutex held.
+ */
+static SlabPage *
+take_page(Slab *slab, int cls)
+{
+    SlabPage *page;
+
+    pthread_mutex_lock(&slab->pool_mutex);
+    if (!slab->nfree) {
+        pthread_mutex_unlock(&slab->pool_mutex);
+        return NULL;
+    }
+    page = &slab->pages[slab->free_pages[--slab->nfree]];
+    pthread_mutex_unlock(&slab->pool_mutex);
+
+    page->cls = cls;
+    page->used = 0;
+    page->carved = 0;
+    page->free = NULL;
+    partial_add(&slab->classes[cls], page);
+    return page;
+}
+
+/*
+ * give_page - Put an unused page back in the pool. Its memory is kept
+ *     resident, it will be cut again soon.
+ */
+static void
+give_page(Slab *slab, SlabPage *page)
+{
+    page->cls = -1;
+
+    pthread_mutex_lock(&slab->pool_mutex);
+    slab->free_pages[slab->nfree++] = page - slab->pages;
+    pthread_mutex_unlock(&slab->pool_mutex);
+}
+
+static void
+partial_add(SlabClass *class, SlabPage *page)
+{
+    page->prev = NULL;
+    page->next = class->partial;
+    if (class->partial)
+        class->partial->prev = page;
+    class->partial = page;
+}
+
+static void
+partial_remove(SlabClass *class, SlabPage *page)
+{
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        class->partial = page->next;
+    if (page->next)
+        page->next->prev = page->prev;
+}
@@ -0,0 +1,71 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SLAB_MAX_PAGE   (1024 * 1024)   /* Unit the arena is handed out in */
+#define SLAB_MIN_CHUNK  64              /* Smallest chunk */
+#define SLAB_MAX_CHUNK  (128 * 1024)    /* Largest chunk, and smallest page */
+#define SLAB_GROWTH     1.25            /* Size ratio between classes */
+#define SLAB_ALIGN      16
+#define SLAB_MAX_CLASSES 64
+
+typedef struct slab_chunk {
+    struct slab_chunk *next;
+} SlabChunk;
+
+/* A page of the arena, cut into chunks of one class while in use */
+typedef struct slab_page {
+    int cls;                        /* -1 while in the free pool */
+    unsigned used;                  /* Chunks handed out */
+    unsigned carved;                /* Chunks cut so far, the rest untouched */
+    SlabChunk *free;                /* Chunks given back */
+    struct slab_page *prev, *next;  /* In its class's partial list */
+} SlabPage;
+
+/* The chunks of a size, taken from its pages that still have room */
+typedef struct slab_class {
+    size_t size;
+    unsigned per_page;
+    size_t used;                    /* Chunks handed out */
+    SlabPage *partial;
+    pthread_mutex_t mutex;
+} SlabClass;
+
+typedef struct slab {
+    char *arena;
+    size_t arena_size;
+    int hugepages;                  /* Arena backed by huge pages */
+    size_t page_size;
+    SlabPage *pages;
+    size_t npages;
+    SlabClass classes[SLAB_MAX_CLASSES];
+    int nclasses;
+    size_t *free_pages;             /* Stack of free page numbers */
+    size_t nfree;
+    pthread_mutex_t pool_mutex;
+} Slab;
+
+typedef struct slab_stats {
+    unsigned long long arena_bytes;
+    unsigned long long used_pages;  /* Pages given to a class */
+    unsigned long long chunk_bytes; /* Handed out chunks, whole */
+} SlabStats;
+
+int
+slab_init(Slab *slab, size_t nbytes, int hugepages);
+
+size_t
+slab_chunk_size(Slab *slab, size_t size);
+
+void *
+slab_alloc(Slab *slab, size_t size);
+
+void
+slab_free(Slab *slab, void *ptr);
+
+void
+slab_stats(Slab *slab, SlabStats *stats);
+
+#endif
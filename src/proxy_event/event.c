@@ -0,0 +1,1397 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "../proxy_cache/cache.h"
+#include "../proxy_metrics/metrics.h"
+#include "../proxy_serve/serve.h"
+#include "../proxy_upstream/flight.h"
+#include "../proxy_upstream/upstream.h"
+#include "../socket_interface/dns.h"
+#include "../socket_interface/interface.h"
+
+typedef enum source_kind {
+    SOURCE_LISTENER,
+    SOURCE_CLIENT,
+    SOURCE_UPSTREAM,
+    SOURCE_WAKE
+} SourceKind;
+
+typedef enum conn_state {
+    CONN_READ_REQUEST,      /* Waiting for the whole (next) request head */
+    CONN_WAIT_FLIGHT,       /* Waiting for another request to fetch it */
+    CONN_RESOLVE,           /* Waiting for the server name to be resolved */
+    CONN_CONNECT,           /* Connection to the server in progress */
+    CONN_SEND_REQUEST,      /* Writing the request to the server */
+    CONN_READ_RESPONSE,     /* Waiting for the whole response head */
+    CONN_RELAY,             /* Relaying the response body to the client */
+    CONN_WRITE_CACHED       /* Writing a cached response to the client */
+} ConnState;
+
+struct conn;
+struct event_loop;
+
+typedef struct event_source {
+    SourceKind kind;
+    uint32_t events;                /* Events currently registered */
+    int registered;
+    struct conn *conn;
+} EventSource;
+
+typedef struct conn {
+    struct event_loop *loop;
+    EventSource client_src, upstream_src;
+    int clientfd, upstreamfd;
+    int reused;                     /* Upstream connection from the pool */
+    int overread;                   /* Server sent more than the body */
+    ConnState state;
+    Request client_request;
+    Response server_response;
+    Arena *arena;                   /* Of the current request */
+    char *request_line, *request_headers;
+    char *conditional;              /* Revalidation headers, or empty */
+    char *buf;                      /* Request head, then response head */
+    size_t buf_len, buf_size;
+    HttpParser parser;              /* Of the head being read into buf */
+    char *pipelined;                /* Client bytes read past the request */
+    size_t pipelined_len;
+    size_t head_len;                /* Pipelined request head, when ready */
+    struct iovec up[3];             /* Request bytes pending to the server */
+    int up_cnt;
+    struct iovec out[HEAD_IOVCNT + CHUNK_IOVCNT + 1]; /* Response bytes */
+    int out_cnt;                    /* pending to the client */
+    size_t body_len;                /* Body bytes received from the server */
+    ChunkDecoder chunks;            /* Of a chunked body */
+    char chunk_line[CHUNK_LINE_SIZE]; /* Of the chunk pending to the client */
+    int body_end;                   /* A body of unknown length is all read */
+    Stage stage;                    /* Copy of the body kept for the cache */
+    int pipefd[2];                  /* Splice pipe for uncached bodies */
+    size_t pipe_len;                /* Body bytes sitting in the pipe */
+    /* When the stages in progress started, in ns */
+    unsigned long long connect_start, origin_start, response_start;
+    unsigned long long idle_deadline; /* In ms, 0 if not waiting */
+    struct conn *idle_prev, *idle_next;
+    Flight *flight;                 /* Led, or followed while waiting */
+    FlightWaiter waiter;
+    unsigned long long wait_deadline; /* In ms, 0 if not following */
+    struct conn *wait_prev, *wait_next, *next_woken;
+    DnsWaiter resolver;             /* Of the server name, while resolving */
+    struct conn *next_ready, *next_closed;
+    char relay[RELAY_BUFSIZE];
+} Conn;
+
+typedef struct event_loop {
+    int epfd, listenfd;
+    EventSource listen_src;
+    Cache *proxy_cache;
+    Conn *ready;                    /* Pipelined requests to start */
+    Conn *idle_head, *idle_tail;    /* Waiting for a request, oldest first */
+    Conn *closed;                   /* Freed after each epoll_wait batch */
+    Conn *wait_head, *wait_tail;    /* Following a flight, oldest first */
+    int wakefd;                     /* Written once woken is filled */
+    EventSource wake_src;
+    pthread_mutex_t woken_mutex;
+    Conn *woken;                    /* Handed back by other threads */
+    pthread_t tid;
+} EventLoop;
+
+static void *
+event_loop_run(void *vargp);
+
+static void
+accept_clients(EventLoop *loop);
+
+static int
+client_event(EventLoop *loop, Conn *conn, uint32_t events);
+
+static int
+upstream_event(EventLoop *loop, Conn *conn, uint32_t events);
+
+static int
+start_request(EventLoop *loop, Conn *conn, size_t head_len);
+
+static int
+write_cached(EventLoop *loop, Conn *conn);
+
+static int
+follow_flight(EventLoop *loop, Conn *conn);
+
+static int
+resume_request(EventLoop *loop, Conn *conn);
+
+static void
+wake_conn(void *arg);
+
+static void
+wake_conns(EventLoop *loop);
+
+static void
+stop_following(EventLoop *loop, Conn *conn);
+
+static void
+stop_resolving(EventLoop *loop, Conn *conn);
+
+static int
+fetch_upstream(EventLoop *loop, Conn *conn);
+
+static int
+finish_request(EventLoop *loop, Conn *conn);
+
+static void
+start_ready(EventLoop *loop);
+
+static int
+connect_upstream(EventLoop *loop, Conn *conn);
+
+static int
+open_upstream(EventLoop *loop, Conn *conn);
+
+static int
+advance_upstream(EventLoop *loop, Conn *conn, uint32_t events);
+
+static void
+release_upstream(EventLoop *loop, Conn *conn);
+
+static int
+start_response(EventLoop *loop, Conn *conn, size_t head_len);
+
+static int
+relay_body(EventLoop *loop, Conn *conn);
+
+static int
+queue_body(Conn *conn, char *buf, size_t n);
+
+static int
+splice_body(EventLoop *loop, Conn *conn);
+
+static int
+flush_client(EventLoop *loop, Conn *conn);
+
+static int
+flush_pipe(Conn *conn);
+
+static int
+read_head(int fd, Conn *conn, size_t *head_len);
+
+
+static void
+idle_add(EventLoop *loop, Conn *conn);
+
+static void
+idle_remove(EventLoop *loop, Conn *conn);
+
+static int
+expire_idle(EventLoop *loop);
+
+static void
+wait_add(EventLoop *loop, Conn *conn);
+
+static void
+wait_remove(EventLoop *loop, Conn *conn);
+
+static int
+expire_waiting(EventLoop *loop);
+
+static unsigned long long
+now_ms(void);
+
+static int
+write_iov(int fd, struct iovec *iov, int *iovcnt);
+
+static int
+watch(EventLoop *loop, int fd, EventSource *src, uint32_t events);
+
+static int
+set_nonblock(int fd, int nonblock);
+
+static void
+clear_request(Conn *conn);
+
+static void
+close_conn(EventLoop *loop, Conn *conn);
+
+/*
+ * event_serve - Serve clients from nloops epoll event loops, each one in its
+ *     own thread. Every connection is owned by the loop that accepted it and
+ *     driven through a non-blocking state machine, so no thread ever blocks
+ *     on a single client or server.
+ *
+ *     Loop i accepts on listenfds[i % nlisteners]: with a single listening
+ *     socket all the loops share it, with one SO_REUSEPORT socket per loop
+ *     each loop accepts on its own. With pin_cpus, loop i runs on CPU i.
+ *
+ *     Client connections are kept alive between requests; pipelined requests
+ *     are answered in order, and a client that stays idle longer than the
+ *     keep-alive timeout is closed. A request missing a response another
+ *     one is fetching waits for it to be cached, without blocking its loop.
+ *
+ *     Only returns on error, with -1.
+ */
+int
+event_serve(int *listenfds, int nlisteners, Cache *proxy_cache, int nloops,
+            int pin_cpus)
+{
+    int listenfd, ncpus;
+    EventLoop *loops;
+    cpu_set_t cpus;
+    struct epoll_event ev;
+
+    for (int i = 0; i < nlisteners; i++) {
+        if (fcntl(listenfds[i], F_SETFL,
+                  fcntl(listenfds[i], F_GETFL) | O_NONBLOCK) < 0)
+            return -1;
+    }
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    loops = calloc(nloops, sizeof(EventLoop));
+    for (int i = 0; i < nloops; i++) {
+        listenfd = listenfds[i % nlisteners];
+        if ((loops[i].epfd = epoll_create1(0)) < 0)
+            return -1;
+        loops[i].listenfd = listenfd;
+        loops[i].proxy_cache = proxy_cache;
+        loops[i].listen_src.kind = SOURCE_LISTENER;
+
+        /* Wake only one of the loops for each new connection */
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &loops[i].listen_src;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+            return -1;
+
+        /*
+         * Followers woken and names resolved by other threads are handed
+         * over through it
+         */
+        if ((loops[i].wakefd = eventfd(0, EFD_NONBLOCK)) < 0)
+            return -1;
+        loops[i].wake_src.kind = SOURCE_WAKE;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loops[i].wake_src;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wakefd, &ev) < 0)
+            return -1;
+        pthread_mutex_init(&loops[i].woken_mutex, NULL);
+
+        pthread_create(&loops[i].tid, NULL, event_loop_run, &loops[i]);
+
+        if (pin_cpus) {
+            CPU_ZERO(&cpus);
+            CPU_SET(i % ncpus, &cpus);
+            pthread_setaffinity_np(loops[i].tid, sizeof(cpus), &cpus);
+        }
+    }
+
+    for (int i = 0; i < nloops; i++)
+        pthread_join(loops[i].tid, NULL);
+
+    free(loops);
+    return -1;
+}
+
+static void *
+event_loop_run(void *vargp)
+{
+    int n, rc, timeout, wait_timeout;
+    EventLoop *loop = vargp;
+    EventSource *src;
+    Conn *conn;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        /*
+         * Sleep until the next idle client or follower times out, not at all
+         * if ready
+         */
+        timeout = expire_idle(loop);
+        wait_timeout = expire_waiting(loop);
+        if (wait_timeout >= 0 && (timeout < 0 || wait_timeout < timeout))
+            timeout = wait_timeout;
+        if (loop->ready)
+            timeout = 0;
+        if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            src = events[i].data.ptr;
+            if (src->kind == SOURCE_LISTENER) {
+                accept_clients(loop);
+                continue;
+            }
+            if (src->kind == SOURCE_WAKE) {
+                wake_conns(loop);
+                continue;
+            }
+
+            conn = src->conn;
+            if (conn->clientfd < 0)     /* Closed earlier in this batch */
+                continue;
+
+            if (src->kind == SOURCE_CLIENT)
+                rc = client_event(loop, conn, events[i].events);
+            else
+                rc = upstream_event(loop, conn, events[i].events);
+            if (rc < 0)
+                close_conn(loop, conn);
+        }
+
+        start_ready(loop);
+
+        /* No event of this batch refers to the closed connections anymore */
+        while ((conn = loop->closed)) {
+            loop->closed = conn->next_closed;
+            free(conn);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+accept_clients(EventLoop *loop)
+{
+    int connfd;
+    Conn *conn;
+
+    while (1) {
+        if ((connfd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            return;
+        }
+
+        conn = calloc(1, sizeof(Conn));
+        conn->loop = loop;
+        conn->clientfd = connfd;
+        conn->upstreamfd = -1;
+        conn->pipefd[0] = conn->pipefd[1] = -1;
+        conn->state = CONN_READ_REQUEST;
+        conn->client_src.kind = SOURCE_CLIENT;
+        conn->client_src.conn = conn;
+        conn->upstream_src.kind = SOURCE_UPSTREAM;
+        conn->upstream_src.conn = conn;
+        conn->buf_size = MAX_LINE;
+        conn->buf = malloc(conn->buf_size);
+        http_parser_init(&conn->parser, HTTP_REQUEST);
+        conn->arena = arena_get();
+        metrics_connection(1);
+
+        if (watch(loop, connfd, &conn->client_src, EPOLLIN) < 0) {
+            close_conn(loop, conn);
+            continue;
+        }
+        idle_add(loop, conn);
+    }
+}
+
+/*
+ * client_event, upstream_event - Advance the state machine of conn on an
+ *     event of its client or server socket. Return -1 once the connection
+ *     is finished, either done or failed, and has to be closed.
+ */
+static int
+client_event(EventLoop *loop, Conn *conn, uint32_t events)
+{
+    int rc;
+    size_t head_len;
+
+    if (events & EPOLLERR || (events & EPOLLHUP &&
+        !(events & (EPOLLIN | EPOLLOUT))))
+        return -1;
+
+    switch (conn->state) {
+    case CONN_READ_REQUEST:
+        rc = read_head(conn->clientfd, conn, &head_len);
+        if (!conn->client_request.rq_start && conn->buf_len)
+            conn->client_request.rq_start = metrics_now();
+        if (rc <= 0)
+            return rc;
+        return start_request(loop, conn, head_len);
+    case CONN_RELAY:
+    case CONN_WRITE_CACHED:
+        if (events & EPOLLOUT)
+            return flush_client(loop, conn);
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+static int
+upstream_event(EventLoop *loop, Conn *conn, uint32_t events)
+{
+    int rc;
+
+    rc = advance_upstream(loop, conn, events);
+
+    /* 
+     * A pooled connection may have been closed by the server just before
+     * being used, try again on another one
+     */
+    if (rc < 0 && conn->reused && (conn->state == CONN_SEND_REQUEST
+        || (conn->state == CONN_READ_RESPONSE && conn->buf_len == 0))) {
+        close(conn->upstreamfd);
+        conn->upstreamfd = -1;
+        return connect_upstream(loop, conn);
+    }
+
+    return rc;
+}
+
+static int
+advance_upstream(EventLoop *loop, Conn *conn, uint32_t events)
+{
+    int rc, err;
+    size_t head_len;
+    socklen_t len = sizeof(err);
+
+    if (events & EPOLLERR || (events & EPOLLHUP &&
+        !(events & (EPOLLIN | EPOLLOUT))))
+        return -1;
+
+    switch (conn->state) {
+    case CONN_CONNECT:
+        if (getsockopt(conn->upstreamfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+            || err != 0)
+            return -1;
+        metrics_record(STAGE_CONNECT, conn->connect_start);
+        conn->state = CONN_SEND_REQUEST;
+        /* fall through */
+    case CONN_SEND_REQUEST:
+        if ((rc = write_iov(conn->upstreamfd, conn->up, &conn->up_cnt)) <= 0)
+            return rc;
+        conn->origin_start = metrics_now();
+        conn->state = CONN_READ_RESPONSE;
+        conn->buf_len = 0;
+        http_parser_init(&conn->parser, HTTP_RESPONSE);
+        return watch(loop, conn->upstreamfd, &conn->upstream_src, EPOLLIN);
+    case CONN_READ_RESPONSE:
+        if ((rc = read_head(conn->upstreamfd, conn, &head_len)) <= 0)
+            return rc;
+        return start_response(loop, conn, head_len);
+    case CONN_RELAY:
+        return relay_body(loop, conn);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * start_request - Parse the received request head, then either write the
+ *     cached response or get it from the server, or from the request already
+ *     fetching it.
+ */
+static int
+start_request(EventLoop *loop, Conn *conn, size_t head_len)
+{
+    Response *server_response = &conn->server_response;
+
+    idle_remove(loop, conn);
+
+    if (parse_request_head(conn->clientfd, conn->buf, &conn->parser,
+                           conn->arena, &conn->client_request) < 0)
+        return -1;
+
+    /* Keep the start of the next pipelined requests, buf is reused */
+    if (conn->buf_len > head_len) {
+        conn->pipelined_len = conn->buf_len - head_len;
+        conn->pipelined = malloc(conn->pipelined_len);
+        memcpy(conn->pipelined, conn->buf + head_len, conn->pipelined_len);
+    }
+
+    /* Nothing more is read from the client */
+    if (watch(loop, conn->clientfd, &conn->client_src, 0) < 0)
+        return -1;
+
+    if (conn->client_request.rq_metrics) {
+        metrics_response(loop->proxy_cache, server_response);
+        return write_cached(loop, conn);
+    }
+
+    build_request(&conn->client_request, conn->arena, &conn->request_line,
+                  &conn->request_headers);
+
+    if (fetch_cached(&conn->client_request, loop->proxy_cache,
+                     conn->request_line, conn->request_headers,
+                     server_response))
+        return write_cached(loop, conn);
+
+    return follow_flight(loop, conn);
+}
+
+/*
+ * follow_flight - Fetch the missed response from the server if no other
+ *     request is, else wait for the one that is to cache it, up to
+ *     FLIGHT_TIMEOUT, without blocking the loop.
+ */
+static int
+follow_flight(EventLoop *loop, Conn *conn)
+{
+    int leader;
+
+    conn->flight = join_flight(conn->request_line, conn->request_headers,
+                               &leader);
+    if (leader)
+        return fetch_upstream(loop, conn);
+
+    conn->waiter.wake = wake_conn;
+    conn->waiter.arg = conn;
+    if (flight_watch(conn->flight, &conn->waiter)) {
+        flight_leave(conn->flight);
+        conn->flight = NULL;
+        return resume_request(loop, conn);
+    }
+
+    conn->state = CONN_WAIT_FLIGHT;
+    wait_add(loop, conn);
+    return 0;
+}
+
+/*
+ * resume_request - Once its leader is done or took too long, answer the
+ *     request from the cache, or else fetch the response on its own.
+ */
+static int
+resume_request(EventLoop *loop, Conn *conn)
+{
+    Response *server_response = &conn->server_response;
+
+    release_response(server_response);
+    if (fetch_cached(&conn->client_request, loop->proxy_cache,
+                     conn->request_line, conn->request_headers,
+                     server_response))
+        return write_cached(loop, conn);
+
+    return fetch_upstream(loop, conn);
+}
+
+/*
+ * wake_conn - Hand a follower whose leader is done, or a connection whose
+ *     server name is resolved, back to its loop from another thread.
+ */
+static void
+wake_conn(void *arg)
+{
+    Conn *conn = arg;
+    EventLoop *loop = conn->loop;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->woken_mutex);
+    conn->next_woken = loop->woken;
+    loop->woken = conn;
+    pthread_mutex_unlock(&loop->woken_mutex);
+
+    if (write(loop->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "eventfd write failed: %s\n", strerror(errno));
+}
+
+/*
+ * wake_conns - Resume the connections handed back to the loop.
+ */
+static void
+wake_conns(EventLoop *loop)
+{
+    uint64_t count;
+    Conn *conn, *woken;
+
+    while (read(loop->wakefd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+
+    pthread_mutex_lock(&loop->woken_mutex);
+    woken = loop->woken;
+    loop->woken = NULL;
+    pthread_mutex_unlock(&loop->woken_mutex);
+
+    while ((conn = woken)) {
+        woken = conn->next_woken;
+        if (conn->state == CONN_RESOLVE) {
+            if (open_upstream(loop, conn) < 0)
+                close_conn(loop, conn);
+            continue;
+        }
+
+        wait_remove(loop, conn);
+        flight_leave(conn->flight);
+        conn->flight = NULL;
+        if (resume_request(loop, conn) < 0)
+            close_conn(loop, conn);
+    }
+}
+
+/*
+ * stop_following - Leave the flight of a follower whose client is gone. If
+ *     its leader is done already, it's taken back from the woken ones.
+ */
+static void
+stop_following(EventLoop *loop, Conn *conn)
+{
+    Conn **link;
+
+    wait_remove(loop, conn);
+    if (flight_unwatch(conn->flight, &conn->waiter) < 0) {
+        pthread_mutex_lock(&loop->woken_mutex);
+        for (link = &loop->woken; *link != conn; link = &(*link)->next_woken)
+            ;
+        *link = conn->next_woken;
+        pthread_mutex_unlock(&loop->woken_mutex);
+    }
+    flight_leave(conn->flight);
+    conn->flight = NULL;
+}
+
+/*
+ * stop_resolving - Stop waiting for the server name of a connection whose
+ *     client is gone. If it's resolved already, it's taken back from the
+ *     woken ones.
+ */
+static void
+stop_resolving(EventLoop *loop, Conn *conn)
+{
+    Conn **link;
+
+    if (dns_unwatch(&conn->resolver) == 0)
+        return;
+
+    pthread_mutex_lock(&loop->woken_mutex);
+    for (link = &loop->woken; *link != conn; link = &(*link)->next_woken)
+        ;
+    *link = conn->next_woken;
+    pthread_mutex_unlock(&loop->woken_mutex);
+    if (!conn->resolver.error)
+        dns_release(conn->resolver.addrs);
+}
+
+/*
+ * fetch_upstream - Start fetching the response from the server, asking only
+ *     for a changed one when the cached one is stale.
+ */
+static int
+fetch_upstream(EventLoop *loop, Conn *conn)
+{
+    Response *server_response = &conn->server_response;
+
+    conn->conditional = server_response->rs_stale ?
+                        conditional_headers(server_response->rs_stale) :
+                        strdup("");
+    return connect_upstream(loop, conn);
+}
+
+/*
+ * write_cached - Write the response held by the connection, a cached one,
+ *     to the client.
+ */
+static int
+write_cached(EventLoop *loop, Conn *conn)
+{
+    Response *server_response = &conn->server_response;
+
+    conn->response_start = metrics_now();
+    response_head(conn->out, server_response,
+                  response_keep_alive(&conn->client_request, server_response),
+                  0);
+    conn->out[3].iov_base = server_response->rs_content;
+    conn->out[3].iov_len = server_response->rs_content_length;
+    conn->out_cnt = 4;
+    conn->state = CONN_WRITE_CACHED;
+    return flush_client(loop, conn);
+}
+
+/*
+ * finish_request - Once the response is out, get ready for the next request
+ *     of the client, or return -1 if the connection isn't kept alive. The
+ *     next request may have been pipelined and read already, it's started
+ *     after the current batch of events.
+ */
+static int
+finish_request(EventLoop *loop, Conn *conn)
+{
+    int rc;
+
+    metrics_record(STAGE_RESPONSE, conn->response_start);
+    metrics_record(STAGE_TOTAL, conn->client_request.rq_start);
+    if (!response_keep_alive(&conn->client_request, &conn->server_response))
+        return -1;
+
+    clear_request(conn);
+    stage_free(&conn->stage);
+    conn->reused = conn->overread = 0;
+    conn->body_len = 0;
+    conn->body_end = 0;
+    conn->state = CONN_READ_REQUEST;
+
+    conn->buf_len = 0;
+    if (conn->pipelined) {
+        memcpy(conn->buf, conn->pipelined, conn->pipelined_len);
+        conn->buf_len = conn->pipelined_len;
+        conn->client_request.rq_start = metrics_now();
+        free(conn->pipelined);
+        conn->pipelined = NULL;
+        conn->pipelined_len = 0;
+    }
+
+    http_parser_init(&conn->parser, HTTP_REQUEST);
+    if ((rc = http_parse(&conn->parser, conn->buf, conn->buf_len)) < 0)
+        return -1;
+    if (rc) {
+        conn->head_len = conn->parser.head_len;
+        conn->next_ready = loop->ready;
+        loop->ready = conn;
+        return watch(loop, conn->clientfd, &conn->client_src, 0);
+    }
+
+    idle_add(loop, conn);
+    return watch(loop, conn->clientfd, &conn->client_src, EPOLLIN);
+}
+
+/*
+ * start_ready - Start the pipelined requests that were already read. Those
+ *     that get answered right away queue their next one for the next round.
+ */
+static void
+start_ready(EventLoop *loop)
+{
+    Conn *conn, *ready;
+
+    ready = loop->ready;
+    loop->ready = NULL;
+    while ((conn = ready)) {
+        ready = conn->next_ready;
+        if (conn->clientfd < 0)     /* Closed earlier in this batch */
+            continue;
+        if (start_request(loop, conn, conn->head_len) < 0)
+            close_conn(loop, conn);
+    }
+}
+
+/*
+ * connect_upstream - Get a connection to the server, an idle one from the
+ *     pool if possible or else a new one, and wait to send the request. A
+ *     server name that isn't cached is resolved by the resolver threads
+ *     meanwhile.
+ */
+static int
+connect_upstream(EventLoop *loop, Conn *conn)
+{
+    Request *client_request = &conn->client_request;
+
+    conn->up[0].iov_base = conn->request_line;
+    conn->up[0].iov_len = strlen(conn->request_line);
+    conn->up[1].iov_base = conn->conditional;
+    conn->up[1].iov_len = strlen(conn->conditional);
+    conn->up[2].iov_base = conn->request_headers;
+    conn->up[2].iov_len = strlen(conn->request_headers);
+    conn->up_cnt = 3;
+
+    if ((conn->upstreamfd = upstream_take(client_request->rq_hostname,
+                                          client_request->rq_port)) >= 0) {
+        conn->reused = 1;
+        if (set_nonblock(conn->upstreamfd, 1) < 0)
+            return -1;
+        conn->state = CONN_SEND_REQUEST;
+        conn->upstream_src.registered = 0;
+        return watch(loop, conn->upstreamfd, &conn->upstream_src, EPOLLOUT);
+    }
+
+    conn->reused = 0;
+    conn->connect_start = metrics_now();
+    conn->resolver.wake = wake_conn;
+    conn->resolver.arg = conn;
+    conn->state = CONN_RESOLVE;
+    if (dns_lookup_async(client_request->rq_hostname, client_request->rq_port,
+                         &conn->resolver))
+        return open_upstream(loop, conn);
+    return 0;
+}
+
+/*
+ * open_upstream - Start connecting to the server once its name is resolved.
+ */
+static int
+open_upstream(EventLoop *loop, Conn *conn)
+{
+    conn->state = CONN_CONNECT;     /* No longer waiting, even on error */
+    if (conn->resolver.error)
+        return -1;
+
+    conn->upstreamfd = open_clientfd_nonblock(conn->resolver.addrs);
+    dns_release(conn->resolver.addrs);
+    if (conn->upstreamfd < 0)
+        return -1;
+
+    conn->upstream_src.registered = 0;
+    return watch(loop, conn->upstreamfd, &conn->upstream_src, EPOLLOUT);
+}
+
+/*
+ * release_upstream - Hand the server connection back to the pool once the
+ *     response is complete. It's closed instead if the server doesn't keep
+ *     it open or it isn't left at a response boundary.
+ */
+static void
+release_upstream(EventLoop *loop, Conn *conn)
+{
+    int reusable;
+    Response *server_response = &conn->server_response;
+
+    reusable = server_response->rs_keep_alive
+               && (server_response->rs_has_length || server_response->rs_chunked)
+               && !conn->overread
+               && epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->upstreamfd,
+                            NULL) == 0
+               && set_nonblock(conn->upstreamfd, 0) == 0;
+
+    upstream_release(conn->client_request.rq_hostname,
+                     conn->client_request.rq_port, conn->upstreamfd, reusable);
+    conn->upstreamfd = -1;
+}
+
+/*
+ * start_response - Parse the received response head and start relaying it
+ *     to the client along with the body bytes that came with it. The body
+ *     is also staged for the cache while the object fits in a cache line.
+ *     A 304 to a revalidation is answered with the refreshed cached response
+ *     instead, and an interim 1xx response skipped for the final one.
+ */
+static int
+start_response(EventLoop *loop, Conn *conn, size_t head_len)
+{
+    int rc;
+    size_t extra;
+    Response *server_response = &conn->server_response;
+
+    if (conn->parser.status >= 100 && conn->parser.status < 200) {
+        conn->buf_len -= head_len;
+        memmove(conn->buf, conn->buf + head_len, conn->buf_len);
+        http_parser_init(&conn->parser, HTTP_RESPONSE);
+        if ((rc = http_parse(&conn->parser, conn->buf, conn->buf_len)) <= 0)
+            return rc;
+        return start_response(loop, conn, conn->parser.head_len);
+    }
+
+    if (parse_response_head(conn->buf, &conn->parser, conn->request_headers,
+                            server_response) < 0)
+        return -1;
+    metrics_record(STAGE_ORIGIN, conn->origin_start);
+
+    if (revalidated(loop->proxy_cache, conn->request_line,
+                    conn->request_headers, server_response)) {
+        conn->overread = conn->buf_len > head_len;
+        release_upstream(loop, conn);
+        if (decode_response(&conn->client_request, server_response) < 0)
+            return -1;
+        return write_cached(loop, conn);
+    }
+
+    extra = conn->buf_len - head_len;
+    if (server_response->rs_has_length
+        && extra > server_response->rs_content_length) {
+        extra = server_response->rs_content_length;
+        conn->overread = 1;
+    }
+
+    conn->response_start = metrics_now();
+    stage_init(&conn->stage, server_response);
+    chunk_decoder_init(&conn->chunks);
+    conn->out_cnt = response_head(conn->out, server_response,
+                                  response_keep_alive(&conn->client_request,
+                                                      server_response),
+                                  response_chunked(&conn->client_request,
+                                                   server_response));
+    if (queue_body(conn, conn->buf + head_len, extra) < 0)
+        return -1;
+
+    /* The followers needn't wait for a response that won't be cached */
+    if (conn->stage.abandoned && conn->flight) {
+        flight_done(conn->flight);
+        conn->flight = NULL;
+    }
+
+    conn->state = CONN_RELAY;
+    return flush_client(loop, conn);
+}
+
+/*
+ * relay_body - Read the next chunk of the body from the server and pass it
+ *     on to the client.
+ */
+static int
+relay_body(EventLoop *loop, Conn *conn)
+{
+    ssize_t n;
+    size_t want = RELAY_BUFSIZE;
+    Response *server_response = &conn->server_response;
+
+    if (server_response->rs_has_length) {
+        if (conn->stage.abandoned)
+            return splice_body(loop, conn);
+        if (want > server_response->rs_content_length - conn->body_len)
+            want = server_response->rs_content_length - conn->body_len;
+    }
+
+    if ((n = read(conn->upstreamfd, conn->relay, want)) < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    } else if (n == 0) {
+        /* Only a body of unknown length, not chunked, ends with the close */
+        if (server_response->rs_has_length || server_response->rs_chunked)
+            return -1;
+        conn->body_end = 1;
+    }
+
+    conn->out_cnt = 0;
+    if (queue_body(conn, conn->relay, n) < 0)
+        return -1;
+    return flush_client(loop, conn);
+}
+
+/*
+ * queue_body - Queue n body bytes from the server in buf for the client,
+ *     after the bytes already queued, and stage them for the cache. A chunked
+ *     body is decoded in place first, and a body of unknown length chunked
+ *     again for a client that takes it.
+ */
+static int
+queue_body(Conn *conn, char *buf, size_t n)
+{
+    ssize_t len = n;
+    size_t used;
+    Response *server_response = &conn->server_response;
+
+    if (server_response->rs_chunked) {
+        if ((len = chunk_decode(&conn->chunks, buf, n, &used)) < 0)
+            return -1;
+        if (chunk_done(&conn->chunks)) {
+            conn->body_end = 1;
+            conn->overread |= used < n;
+        }
+    }
+
+    stage_append(&conn->stage, buf, len);
+    relay_account(len, 0);
+    server_response->rs_body_sent += len;
+    conn->body_len += len;
+
+    if (!response_chunked(&conn->client_request, server_response)) {
+        conn->out[conn->out_cnt].iov_base = buf;
+        conn->out[conn->out_cnt++].iov_len = len;
+        return 0;
+    }
+
+    conn->out_cnt += chunk_encode(conn->out + conn->out_cnt, conn->chunk_line,
+                                  buf, len);
+    if (conn->body_end) {
+        conn->out[conn->out_cnt].iov_base = CHUNK_LAST;
+        conn->out[conn->out_cnt++].iov_len = strlen(CHUNK_LAST);
+    }
+    return 0;
+}
+
+/*
+ * splice_body - Relay the next part of a body that won't be cached from the
+ *     server to the client through a pipe, without copying it to user space.
+ */
+static int
+splice_body(EventLoop *loop, Conn *conn)
+{
+    ssize_t n;
+
+    if (conn->pipefd[0] < 0 && pipe2(conn->pipefd, O_NONBLOCK) < 0)
+        return -1;
+
+    if ((n = splice(conn->upstreamfd, NULL, conn->pipefd[1], NULL,
+                    conn->server_response.rs_content_length - conn->body_len,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    } else if (n == 0) {    /* Server closed before the end of the body */
+        return -1;
+    }
+
+    conn->pipe_len += n;
+    conn->body_len += n;
+    return flush_client(loop, conn);
+}
+
+/*
+ * flush_client - Write the pending response bytes to the client. While the
+ *     client can't take them all, reading from the server is paused.
+ */
+static int
+flush_client(EventLoop *loop, Conn *conn)
+{
+    int rc;
+    Response *server_response = &conn->server_response;
+
+    if ((rc = write_iov(conn->clientfd, conn->out, &conn->out_cnt)) < 0)
+        return -1;
+    if (rc > 0 && (rc = flush_pipe(conn)) < 0)
+        return -1;
+
+    if (rc == 0) {
+        if (conn->upstreamfd >= 0
+            && watch(loop, conn->upstreamfd, &conn->upstream_src, 0) < 0)
+            return -1;
+        return watch(loop, conn->clientfd, &conn->client_src, EPOLLOUT);
+    }
+
+    if (conn->state == CONN_WRITE_CACHED)
+        return finish_request(loop, conn);
+
+    if (server_response->rs_has_length ?
+        conn->body_len == server_response->rs_content_length :
+        conn->body_end) {
+        if (!conn->stage.abandoned)
+            cache_response(loop->proxy_cache, conn->request_line,
+                           conn->request_headers, server_response,
+                           conn->stage.buf, conn->stage.len);
+        release_upstream(loop, conn);
+        return finish_request(loop, conn);
+    }
+
+    if (watch(loop, conn->clientfd, &conn->client_src, 0) < 0)
+        return -1;
+    return watch(loop, conn->upstreamfd, &conn->upstream_src, EPOLLIN);
+}
+
+/*
+ * flush_pipe - Splice the body bytes sitting in the pipe to the client. Same
+ *     return values as write_iov.
+ */
+static int
+flush_pipe(Conn *conn)
+{
+    ssize_t n;
+
+    while (conn->pipe_len > 0) {
+        if ((n = splice(conn->pipefd[0], NULL, conn->clientfd, NULL,
+                        conn->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        relay_account(n, 1);
+        conn->server_response.rs_body_sent += n;
+        conn->pipe_len -= n;
+    }
+
+    return 1;
+}
+
+/*
+ * read_head - Read from fd into the connection buffer until it holds a
+ *     whole head (line and headers up to the empty line), parsing it as it
+ *     arrives. Returns 1 and sets head_len once it does, 0 if more input is
+ *     needed and -1 on error, EOF or a head malformed or larger than MAX_BUF.
+ */
+static int
+read_head(int fd, Conn *conn, size_t *head_len)
+{
+    int rc;
+    ssize_t n;
+
+    while (1) {
+        if (conn->buf_len == conn->buf_size) {
+            if (conn->buf_size >= MAX_BUF)
+                return -1;
+            conn->buf_size *= 2;
+            conn->buf = realloc(conn->buf, conn->buf_size);
+        }
+
+        if ((n = read(fd, conn->buf + conn->buf_len,
+                      conn->buf_size - conn->buf_len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        } else if (n == 0) {
+            return -1;
+        }
+        conn->buf_len += n;
+
+        /* The parse goes on from where the last read left it */
+        if ((rc = http_parse(&conn->parser, conn->buf, conn->buf_len)) < 0) {
+            if (fd == conn->clientfd)
+                client_error(fd, "head", "400", "bad request",
+                             "the server can't understand this request");
+            return -1;
+        }
+        if (rc) {
+            *head_len = conn->parser.head_len;
+            return 1;
+        }
+    }
+}
+
+/*
+ * idle_add, idle_remove - Track the clients waiting for their next request.
+ *     They all get the same timeout, so appending keeps the list sorted by
+ *     deadline. A timeout of 0 means no keep-alive and no idle tracking.
+ */
+static void
+idle_add(EventLoop *loop, Conn *conn)
+{
+    if (keep_alive_timeout() <= 0)
+        return;
+
+    conn->idle_deadline = now_ms() + keep_alive_timeout() * 1000ULL;
+    conn->idle_next = NULL;
+    conn->idle_prev = loop->idle_tail;
+    if (loop->idle_tail)
+        loop->idle_tail->idle_next = conn;
+    else
+        loop->idle_head = conn;
+    loop->idle_tail = conn;
+}
+
+static void
+idle_remove(EventLoop *loop, Conn *conn)
+{
+    if (!conn->idle_deadline)
+        return;
+
+    if (conn->idle_prev)
+        conn->idle_prev->idle_next = conn->idle_next;
+    else
+        loop->idle_head = conn->idle_next;
+    if (conn->idle_next)
+        conn->idle_next->idle_prev = conn->idle_prev;
+    else
+        loop->idle_tail = conn->idle_prev;
+    conn->idle_deadline = 0;
+}
+
+/*
+ * expire_idle - Close the idle clients past their deadline. Returns the
+ *     time in ms until the next deadline, -1 if there's none.
+ */
+static int
+expire_idle(EventLoop *loop)
+{
+    unsigned long long now;
+    Conn *conn;
+
+    now = now_ms();
+    while ((conn = loop->idle_head)) {
+        if (conn->idle_deadline > now)
+            return conn->idle_deadline - now;
+        close_conn(loop, conn);
+    }
+
+    return -1;
+}
+
+/*
+ * wait_add, wait_remove - Track the followers waiting for their leader, all
+ *     with the same timeout, like the idle clients.
+ */
+static void
+wait_add(EventLoop *loop, Conn *conn)
+{
+    conn->wait_deadline = now_ms() + FLIGHT_TIMEOUT * 1000ULL;
+    conn->wait_next = NULL;
+    conn->wait_prev = loop->wait_tail;
+    if (loop->wait_tail)
+        loop->wait_tail->wait_next = conn;
+    else
+        loop->wait_head = conn;
+    loop->wait_tail = conn;
+}
+
+static void
+wait_remove(EventLoop *loop, Conn *conn)
+{
+    if (!conn->wait_deadline)
+        return;
+
+    if (conn->wait_prev)
+        conn->wait_prev->wait_next = conn->wait_next;
+    else
+        loop->wait_head = conn->wait_next;
+    if (conn->wait_next)
+        conn->wait_next->wait_prev = conn->wait_prev;
+    else
+        loop->wait_tail = conn->wait_prev;
+    conn->wait_deadline = 0;
+}
+
+/*
+ * expire_waiting - Stop following the leaders that took too long, their
+ *     followers fetch the response on their own. Returns the time in ms
+ *     until the next deadline, -1 if there's none.
+ */
+static int
+expire_waiting(EventLoop *loop)
+{
+    unsigned long long now;
+    Conn *conn;
+
+    now = now_ms();
+    while ((conn = loop->wait_head)) {
+        if (conn->wait_deadline > now)
+            return conn->wait_deadline - now;
+
+        wait_remove(loop, conn);
+        /* Woken meanwhile, it's resumed with the others */
+        if (flight_unwatch(conn->flight, &conn->waiter) < 0)
+            continue;
+        flight_leave(conn->flight);
+        conn->flight = NULL;
+        if (resume_request(loop, conn) < 0)
+            close_conn(loop, conn);
+    }
+
+    return -1;
+}
+
+static unsigned long long
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * write_iov - Write as much of iov as fd accepts, consuming the written
+ *     bytes from iov. Returns 1 once everything is written, 0 if fd would
+ *     block and -1 on error.
+ */
+static int
+write_iov(int fd, struct iovec *iov, int *iovcnt)
+{
+    ssize_t n;
+    int i;
+
+    while (*iovcnt > 0) {
+        if ((n = writev(fd, iov, *iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        /* Drop the fully written entries and trim the partial one */
+        for (i = 0; i < *iovcnt && (size_t) n >= iov[i].iov_len; i++)
+            n -= iov[i].iov_len;
+        if (i < *iovcnt) {
+            iov[i].iov_base = (char *) iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+        memmove(iov, iov + i, (*iovcnt - i) * sizeof(struct iovec));
+        *iovcnt -= i;
+    }
+
+    return 1;
+}
+
+/*
+ * watch - Register fd for events, skipping the system call if they are
+ *     already the registered ones.
+ */
+static int
+watch(EventLoop *loop, int fd, EventSource *src, uint32_t events)
+{
+    int op;
+    struct epoll_event ev;
+
+    if (src->registered && src->events == events)
+        return 0;
+
+    op = src->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(loop->epfd, op, fd, &ev) < 0)
+        return -1;
+
+    src->registered = 1;
+    src->events = events;
+    return 0;
+}
+
+static int
+set_nonblock(int fd, int nonblock)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0)
+        return -1;
+    flags = nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return fcntl(fd, F_SETFL, flags);
+}
+
+/*
+ * clear_request - Free what the connection allocated for its current request
+ *     and response, and end the flight it led if it's still going. The
+ *     request itself is freed with the arena.
+ */
+static void
+clear_request(Conn *conn)
+{
+    Request *client_request = &conn->client_request;
+    Response *server_response = &conn->server_response;
+
+    if (conn->flight) {
+        flight_done(conn->flight);
+        conn->flight = NULL;
+    }
+
+    release_response(server_response);
+    free(conn->conditional);
+    arena_reset(conn->arena);
+
+    memset(client_request, 0, sizeof(Request));
+    memset(server_response, 0, sizeof(Response));
+    conn->request_line = conn->request_headers = conn->conditional = NULL;
+}
+
+static void
+close_conn(EventLoop *loop, Conn *conn)
+{
+    idle_remove(loop, conn);
+    if (conn->state == CONN_WAIT_FLIGHT && conn->flight)
+        stop_following(loop, conn);
+    if (conn->state == CONN_RESOLVE)
+        stop_resolving(loop, conn);
+    if (conn->upstreamfd >= 0)
+        close(conn->upstreamfd);
+    if (conn->pipefd[0] >= 0) {
+        close(conn->pipefd[0]);
+        close(conn->pipefd[1]);
+    }
+    close(conn->clientfd);
+    conn->clientfd = conn->upstreamfd = -1;
+    metrics_connection(0);
+
+    clear_request(conn);
+    arena_put(conn->arena);
+    free(conn->pipelined);
+    free(conn->buf);
+    stage_free(&conn->stage);
+
+    conn->next_closed = loop->closed;
+    loop->closed = conn;
+}
@@ -0,0 +1,12 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "../proxy_cache/cache.h"
+
+#define MAX_EVENTS      256         /* Events handled per epoll_wait */
+
+int
+event_serve(int *listenfds, int nlisteners, Cache *proxy_cache, int nloops,
+            int pin_cpus);
+
+#endif
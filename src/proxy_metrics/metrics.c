@@ -0,0 +1,413 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "../proxy_serve/arena.h"
+#include "../proxy_serve/gzip.h"
+#include "../proxy_serve/refresh.h"
+#include "../proxy_serve/serve.h"
+#include "../proxy_upstream/flight.h"
+#include "../proxy_upstream/upstream.h"
+#include "../socket_interface/dns.h"
+
+/* Names of the stages, as their label */
+static const char *stage_names[NSTAGES] = {
+    "request", "cache", "connect", "origin", "response", "total"
+};
+
+/* The shards of all the threads that ever counted, and the pools */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_once_t once;
+    pthread_key_t key;              /* Frees the shard of an exiting thread */
+    MetricsShard *shards;
+    Pool *pools[METRICS_POOLS];
+    int npools;
+} metrics = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT
+};
+
+static __thread MetricsShard *local_shard;
+
+static MetricsShard *
+get_shard(void);
+
+static void
+make_key(void);
+
+static void
+put_shard(void *arg);
+
+static void
+bump(atomic_ullong *counter, unsigned long long n);
+
+static int
+bucket_of(unsigned long long us);
+
+static unsigned long long
+bucket_upper(int bucket);
+
+static void
+write_metric(FILE *fp, const char *name, const char *type, const char *help,
+             unsigned long long value);
+
+static void
+write_stages(FILE *fp);
+
+/*
+ * metrics_add_pool - Report the queue counters of pool, up to METRICS_POOLS
+ *     of them.
+ */
+void
+metrics_add_pool(Pool *pool)
+{
+    pthread_mutex_lock(&metrics.mutex);
+    if (metrics.npools < METRICS_POOLS)
+        metrics.pools[metrics.npools++] = pool;
+    pthread_mutex_unlock(&metrics.mutex);
+}
+
+/*
+ * metrics_now - The time a stage starts at, in ns of the monotonic clock.
+ */
+unsigned long long
+metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * metrics_record - Count a stage that started at start, from metrics_now,
+ *     and ends now. A start of 0 was never taken and isn't counted.
+ */
+void
+metrics_record(MetricStage stage, unsigned long long start)
+{
+    unsigned long long us;
+    MetricsShard *shard;
+
+    if (!start)
+        return;
+
+    us = (metrics_now() - start) / 1000;
+    shard = get_shard();
+    bump(&shard->buckets[stage][bucket_of(us)], 1);
+    bump(&shard->sum_us[stage], us);
+}
+
+/*
+ * metrics_connection - Count a client connection opened, or closed.
+ */
+void
+metrics_connection(int opened)
+{
+    MetricsShard *shard = get_shard();
+
+    bump(opened ? &shard->opened : &shard->closed, 1);
+}
+
+/*
+ * metrics_render - The counters of the proxy and of its cache, in the
+ *     Prometheus text format. Returns a string to be freed by the caller,
+ *     with its length in len.
+ */
+char *
+metrics_render(Cache *cache, size_t *len)
+{
+    char *text;
+    unsigned long long opened = 0, closed = 0;
+    FILE *fp;
+    MetricsShard *shard;
+    CacheStats cache_st;
+    FlightStats flight_st;
+    RefreshStats refresh_st;
+    UpstreamStats upstream_st;
+    DnsStats dns_st;
+    RelayStats relay_st;
+    ArenaStats arena_st;
+    GzipStats gzip_st;
+    PoolStats pool_st;
+    PoolStats pools = {0};
+
+    if (!(fp = open_memstream(&text, len)))
+        return NULL;
+
+    write_stages(fp);
+
+    pthread_mutex_lock(&metrics.mutex);
+    for (shard = metrics.shards; shard; shard = shard->next) {
+        opened += atomic_load_explicit(&shard->opened, memory_order_relaxed);
+        closed += atomic_load_explicit(&shard->closed, memory_order_relaxed);
+    }
+    for (int i = 0; i < metrics.npools; i++) {
+        pool_stats(metrics.pools[i], &pool_st);
+        pools.depth += pool_st.depth;
+        pools.queued += pool_st.queued;
+        pools.rejected += pool_st.rejected;
+        pools.wait_ns_total += pool_st.wait_ns_total;
+    }
+    pthread_mutex_unlock(&metrics.mutex);
+
+    write_metric(fp, "proxy_client_connections_active", "gauge",
+                 "Client connections open.", opened - closed);
+    write_metric(fp, "proxy_client_connections_total", "counter",
+                 "Client connections accepted.", opened);
+
+    cache_stats(cache, &cache_st);
+    write_metric(fp, "proxy_cache_hits_total", "counter",
+                 "Requests answered from the cache in memory.", cache_st.hits);
+    write_metric(fp, "proxy_cache_misses_total", "counter",
+                 "Requests not found in the cache.", cache_st.misses);
+    write_metric(fp, "proxy_cache_evictions_total", "counter",
+                 "Objects evicted from the cache in memory.",
+                 cache_st.evictions);
+    write_metric(fp, "proxy_cache_objects", "gauge",
+                 "Objects in the cache in memory.", cache_st.objects);
+    write_metric(fp, "proxy_cache_bytes", "gauge",
+                 "Bytes charged to the cache budget.", cache_st.bytes);
+    write_metric(fp, "proxy_cache_max_bytes", "gauge",
+                 "Cache budget in bytes.", cache_st.max_bytes);
+    write_metric(fp, "proxy_cache_arena_used_bytes", "gauge",
+                 "Bytes of the cache arena in use.", cache_st.arena_used);
+    write_metric(fp, "proxy_disk_hits_total", "counter",
+                 "Requests answered from the disk tier.", cache_st.disk.hits);
+    write_metric(fp, "proxy_disk_objects", "gauge",
+                 "Objects in the disk tier.", cache_st.disk.objects);
+    write_metric(fp, "proxy_disk_bytes", "gauge",
+                 "Bytes in the disk tier.", cache_st.disk.bytes);
+
+    gzip_stats(&gzip_st);
+    write_metric(fp, "proxy_gzip_compressed_total", "counter",
+                 "Bodies cached gzipped.", gzip_st.compressed);
+    write_metric(fp, "proxy_gzip_raw_bytes_total", "counter",
+                 "Bytes of the bodies cached gzipped, before compression.",
+                 gzip_st.raw_bytes);
+    write_metric(fp, "proxy_gzip_bytes_total", "counter",
+                 "Bytes of the bodies cached gzipped, after compression.",
+                 gzip_st.gzip_bytes);
+    write_metric(fp, "proxy_gzip_inflated_total", "counter",
+                 "Cached bodies inflated for a client.", gzip_st.inflated);
+
+    flight_stats(&flight_st);
+    write_metric(fp, "proxy_flight_leaders_total", "counter",
+                 "Missed requests that went to the server.",
+                 flight_st.leaders);
+    write_metric(fp, "proxy_flight_followers_total", "counter",
+                 "Missed requests that waited for another one.",
+                 flight_st.followers);
+    write_metric(fp, "proxy_flight_timeouts_total", "counter",
+                 "Waiting requests that gave up.", flight_st.timeouts);
+
+    refresh_stats(&refresh_st);
+    write_metric(fp, "proxy_refresh_queued_total", "counter",
+                 "Background refreshes queued.", refresh_st.queued);
+    write_metric(fp, "proxy_refresh_dropped_total", "counter",
+                 "Background refreshes dropped, the queue was full.",
+                 refresh_st.dropped);
+    write_metric(fp, "proxy_refresh_failed_total", "counter",
+                 "Background refreshes that failed.", refresh_st.failed);
+
+    upstream_stats(&upstream_st);
+    write_metric(fp, "proxy_upstream_reused_total", "counter",
+                 "Requests sent on a pooled server connection.",
+                 upstream_st.hits);
+    write_metric(fp, "proxy_upstream_opened_total", "counter",
+                 "Requests that needed a new server connection.",
+                 upstream_st.misses);
+
+    dns_stats(&dns_st);
+    write_metric(fp, "proxy_dns_hits_total", "counter",
+                 "Server names resolved from the DNS cache.", dns_st.hits);
+    write_metric(fp, "proxy_dns_misses_total", "counter",
+                 "Server names resolved with getaddrinfo.", dns_st.misses);
+
+    relay_stats(&relay_st);
+    write_metric(fp, "proxy_relay_copied_bytes_total", "counter",
+                 "Body bytes relayed through user space.", relay_st.copied);
+    write_metric(fp, "proxy_relay_spliced_bytes_total", "counter",
+                 "Body bytes relayed with splice.", relay_st.spliced);
+
+    arena_stats(&arena_st);
+    write_metric(fp, "proxy_arena_bytes", "gauge",
+                 "Bytes held by the request arenas in use.", arena_st.bytes);
+
+    write_metric(fp, "proxy_pool_queue_depth", "gauge",
+                 "Connections waiting for a pool worker.", pools.depth);
+    write_metric(fp, "proxy_pool_queued_total", "counter",
+                 "Connections queued for a pool worker.", pools.queued);
+    write_metric(fp, "proxy_pool_rejected_total", "counter",
+                 "Connections rejected, the queue was full.", pools.rejected);
+    fprintf(fp, "# HELP proxy_pool_wait_seconds_total Time connections "
+                "waited for a pool worker.\n"
+                "# TYPE proxy_pool_wait_seconds_total counter\n"
+                "proxy_pool_wait_seconds_total %.6f\n",
+            pools.wait_ns_total / 1e9);
+
+    if (fclose(fp)) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+/*
+ * get_shard - The shard of the calling thread, a free one or a new one the
+ *     first time.
+ */
+static MetricsShard *
+get_shard(void)
+{
+    MetricsShard *shard;
+
+    if (local_shard)
+        return local_shard;
+
+    pthread_once(&metrics.once, make_key);
+    pthread_mutex_lock(&metrics.mutex);
+    for (shard = metrics.shards; shard && shard->in_use; shard = shard->next)
+        ;
+    if (!shard) {
+        shard = calloc(1, sizeof(MetricsShard));
+        shard->next = metrics.shards;
+        metrics.shards = shard;
+    }
+    shard->in_use = 1;
+    pthread_mutex_unlock(&metrics.mutex);
+
+    pthread_setspecific(metrics.key, shard);
+    return local_shard = shard;
+}
+
+static void
+make_key(void)
+{
+    pthread_key_create(&metrics.key, put_shard);
+}
+
+/*
+ * put_shard - Give the shard of an exiting thread to the next one, with its
+ *     counts.
+ */
+static void
+put_shard(void *arg)
+{
+    MetricsShard *shard = arg;
+
+    pthread_mutex_lock(&metrics.mutex);
+    shard->in_use = 0;
+    pthread_mutex_unlock(&metrics.mutex);
+}
+
+/*
+ * bump - Add n to a counter of the calling thread's shard. No other thread
+ *     writes it, so it takes no atomic read-modify-write.
+ */
+static void
+bump(atomic_ullong *counter, unsigned long long n)
+{
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter, memory_order_relaxed)
+                          + n, memory_order_relaxed);
+}
+
+/*
+ * bucket_of - The histogram bucket of a duration: one per us up to
+ *     HIST_SUB, then HIST_SUB per power of two, so each is within 1 /
+ *     HIST_SUB of its value. Longer than the last ones go to the last.
+ */
+static int
+bucket_of(unsigned long long us)
+{
+    int shift;
+
+    if (us < HIST_SUB)
+        return us;
+
+    shift = 63 - __builtin_clzll(us) - HIST_SUB_BITS;
+    if (shift > HIST_MAX_SHIFT)
+        return HIST_BUCKETS - 1;
+    return shift * HIST_SUB + (us >> shift);
+}
+
+/*
+ * bucket_upper - The longest duration, in us, a bucket holds.
+ */
+static unsigned long long
+bucket_upper(int bucket)
+{
+    int shift;
+
+    if (bucket < HIST_SUB)
+        return bucket;
+
+    shift = bucket / HIST_SUB - 1;
+    return ((unsigned long long) (bucket % HIST_SUB + HIST_SUB + 1) << shift)
+           - 1;
+}
+
+static void
+write_metric(FILE *fp, const char *name, const char *type, const char *help,
+             unsigned long long value)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name,
+            type, name, value);
+}
+
+/*
+ * write_stages - Write the histogram of each stage, the buckets of all the
+ *     shards summed. A duration is counted in whole us, so a bucket holds
+ *     those shorter than its upper one plus 1. Only the buckets that counted
+ *     something are written, the others add nothing to the cumulative counts.
+ */
+static void
+write_stages(FILE *fp)
+{
+    unsigned long long count, sum_us;
+    unsigned long long buckets[HIST_BUCKETS];
+    MetricsShard *shard;
+
+    fprintf(fp, "# HELP proxy_stage_duration_seconds Time requests spent in "
+                "each stage.\n"
+                "# TYPE proxy_stage_duration_seconds histogram\n");
+
+    for (int stage = 0; stage < NSTAGES; stage++) {
+        pthread_mutex_lock(&metrics.mutex);
+        memset(buckets, 0, sizeof(buckets));
+        sum_us = 0;
+        for (shard = metrics.shards; shard; shard = shard->next) {
+            for (int i = 0; i < HIST_BUCKETS; i++)
+                buckets[i] += atomic_load_explicit(&shard->buckets[stage][i],
+                                                   memory_order_relaxed);
+            sum_us += atomic_load_explicit(&shard->sum_us[stage],
+                                           memory_order_relaxed);
+        }
+
+        count = 0;
+        for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+            if (!buckets[i])
+                continue;
+            count += buckets[i];
+            fprintf(fp, "proxy_stage_duration_seconds_bucket"
+                        "{stage=\"%s\",le=\"%.6f\"} %llu\n",
+                    stage_names[stage], (bucket_upper(i) + 1) / 1e6, count);
+        }
+        count += buckets[HIST_BUCKETS - 1];
+        pthread_mutex_unlock(&metrics.mutex);
+
+        fprintf(fp, "proxy_stage_duration_seconds_bucket"
+                    "{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[stage],
+                count);
+        fprintf(fp, "proxy_stage_duration_seconds_sum{stage=\"%s\"} %.6f\n",
+                stage_names[stage], sum_us / 1e6);
+        fprintf(fp, "proxy_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+                stage_names[stage], count);
+    }
+}
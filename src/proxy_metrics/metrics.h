@@ -0,0 +1,57 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "../proxy_cache/cache.h"
+#include "../proxy_pool/pool.h"
+
+#define METRICS_PATH    "/proxy-status" /* Asked of the proxy, not forwarded */
+#define HIST_SUB_BITS   3           /* Buckets per power of two, as a shift */
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT  23          /* Last bucket from about 2^26us, 67s */
+#define HIST_BUCKETS    ((HIST_MAX_SHIFT + 2) * HIST_SUB)
+#define METRICS_POOLS   64          /* Worker pools reported */
+
+/* The stages of a request timed, in the order they happen */
+typedef enum metric_stage {
+    STAGE_REQUEST,              /* First byte of its head to it parsed */
+    STAGE_CACHE,                /* Cache lookup, lock waits included */
+    STAGE_CONNECT,              /* New server connection, DNS and connect */
+    STAGE_ORIGIN,               /* Request sent to the response head read */
+    STAGE_RESPONSE,             /* Response head to its last byte written */
+    STAGE_TOTAL,                /* First byte of the request to the last */
+    NSTAGES
+} MetricStage;
+
+/*
+ * The counters of one thread, only written by it so they're never contended;
+ * they're summed with all the others when read. The shard of a thread that
+ * exits goes on counting for the next one that starts.
+ */
+typedef struct metrics_shard {
+    atomic_ullong buckets[NSTAGES][HIST_BUCKETS]; /* Durations, log-bucketed */
+    atomic_ullong sum_us[NSTAGES];
+    atomic_ullong opened, closed;   /* Client connections */
+    int in_use;                     /* By a running thread */
+    struct metrics_shard *next;
+} MetricsShard;
+
+void
+metrics_add_pool(Pool *pool);
+
+unsigned long long
+metrics_now(void);
+
+void
+metrics_record(MetricStage stage, unsigned long long start);
+
+void
+metrics_connection(int opened);
+
+char *
+metrics_render(Cache *cache, size_t *len);
+
+#endif
@@ -0,0 +1,206 @@
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pool.h"
+
+static void *
+pool_worker(void *vargp);
+
+static void
+ring_push(Pool *pool, int connfd);
+
+static int
+ring_pop(Pool *pool, unsigned long long *enqueued_ns);
+
+static void
+atomic_max(atomic_ullong *max, unsigned long long value);
+
+static unsigned long long
+now_ns(void);
+
+/*
+ * pool_init - Start nworkers long-lived threads serving the connections
+ *     submitted to a bounded queue of (at least) queue_size slots. When the
+ *     queue is full, pool_submit waits for a free slot, or fails right away
+ *     if reject is set.
+ *
+ *     The queue is a lock-free ring buffer; the two semaphores only count
+ *     free slots and queued connections so that threads can sleep on them.
+ */
+int
+pool_init(Pool *pool, int nworkers, size_t queue_size, int reject,
+          PoolServe serve, void *serve_arg)
+{
+    size_t size;
+
+    /* Round the ring up to a power of two to index it with a mask */
+    for (size = 1; size < queue_size; size <<= 1)
+        ;
+
+    pool->slots = malloc(size * sizeof(PoolSlot));
+    pool->workers = malloc(nworkers * sizeof(pthread_t));
+    if (!pool->slots || !pool->workers)
+        return -1;
+
+    for (size_t i = 0; i < size; i++)
+        atomic_init(&pool->slots[i].seq, i);
+    pool->mask = size - 1;
+    atomic_init(&pool->enqueue_pos, 0);
+    atomic_init(&pool->dequeue_pos, 0);
+    sem_init(&pool->free_slots, 0, size);
+    sem_init(&pool->items, 0, 0);
+    pool->reject = reject;
+    pool->serve = serve;
+    pool->serve_arg = serve_arg;
+    pool->nworkers = nworkers;
+
+    atomic_init(&pool->depth, 0);
+    atomic_init(&pool->max_depth, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->rejected, 0);
+    atomic_init(&pool->wait_ns_total, 0);
+    atomic_init(&pool->wait_ns_max, 0);
+
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, pool))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * pool_submit - Queue connfd to be served by a worker. Returns -1 when the
+ *     queue is full and the pool rejects instead of waiting, the caller is
+ *     then still responsible for connfd.
+ */
+int
+pool_submit(Pool *pool, int connfd)
+{
+    size_t depth, max;
+
+    if (pool->reject) {
+        if (sem_trywait(&pool->free_slots) < 0) {
+            atomic_fetch_add(&pool->rejected, 1);
+            return -1;
+        }
+    } else {
+        while (sem_wait(&pool->free_slots) < 0)
+            ;   /* Interrupted by a signal handler */
+    }
+
+    ring_push(pool, connfd);
+
+    depth = atomic_fetch_add(&pool->depth, 1) + 1;
+    max = atomic_load(&pool->max_depth);
+    while (depth > max
+           && !atomic_compare_exchange_weak(&pool->max_depth, &max, depth))
+        ;
+    atomic_fetch_add(&pool->queued, 1);
+
+    sem_post(&pool->items);
+    return 0;
+}
+
+/*
+ * pool_stats - Take a snapshot of the queue counters.
+ */
+void
+pool_stats(Pool *pool, PoolStats *stats)
+{
+    stats->depth = atomic_load(&pool->depth);
+    stats->max_depth = atomic_load(&pool->max_depth);
+    stats->queued = atomic_load(&pool->queued);
+    stats->rejected = atomic_load(&pool->rejected);
+    stats->wait_ns_total = atomic_load(&pool->wait_ns_total);
+    stats->wait_ns_max = atomic_load(&pool->wait_ns_max);
+}
+
+static void *
+pool_worker(void *vargp)
+{
+    int connfd;
+    unsigned long long enqueued_ns, wait_ns;
+    Pool *pool = vargp;
+
+    while (1) {
+        while (sem_wait(&pool->items) < 0)
+            ;   /* Interrupted by a signal handler */
+
+        connfd = ring_pop(pool, &enqueued_ns);
+        atomic_fetch_sub(&pool->depth, 1);
+        sem_post(&pool->free_slots);
+
+        wait_ns = now_ns() - enqueued_ns;
+        atomic_fetch_add(&pool->wait_ns_total, wait_ns);
+        atomic_max(&pool->wait_ns_max, wait_ns);
+
+        pool->serve(connfd, pool->serve_arg);
+    }
+
+    return NULL;
+}
+
+/*
+ * ring_push, ring_pop - Bounded multi-producer multi-consumer ring buffer.
+ *     Each slot carries a sequence number telling which ring position it is
+ *     ready for, so producers and consumers only contend on a single atomic
+ *     position counter each. The semaphores guarantee a slot or an item is
+ *     there; a slot whose previous consumer hasn't finished yet is waited for.
+ */
+static void
+ring_push(Pool *pool, int connfd)
+{
+    size_t pos;
+    PoolSlot *slot;
+
+    pos = atomic_fetch_add(&pool->enqueue_pos, 1);
+    slot = &pool->slots[pos & pool->mask];
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos)
+        sched_yield();
+
+    slot->connfd = connfd;
+    slot->enqueued_ns = now_ns();
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+static int
+ring_pop(Pool *pool, unsigned long long *enqueued_ns)
+{
+    int connfd;
+    size_t pos;
+    PoolSlot *slot;
+
+    pos = atomic_fetch_add(&pool->dequeue_pos, 1);
+    slot = &pool->slots[pos & pool->mask];
+    while (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+        sched_yield();
+
+    connfd = slot->connfd;
+    *enqueued_ns = slot->enqueued_ns;
+    atomic_store_explicit(&slot->seq, pos + pool->mask + 1,
+                          memory_order_release);
+    return connfd;
+}
+
+static void
+atomic_max(atomic_ullong *max, unsigned long long value)
+{
+    unsigned long long cur = atomic_load(max);
+
+    while (value > cur && !atomic_compare_exchange_weak(max, &cur, value))
+        ;
+}
+
+static unsigned long long
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
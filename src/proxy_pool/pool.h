@@ -0,0 +1,53 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define POOL_WORKERS    32          /* Default number of workers */
+#define POOL_QUEUE_SIZE 256         /* Default accept queue slots */
+#define POOL_MAX_QUEUE  65536       /* Most accept queue slots */
+
+typedef void (*PoolServe)(int connfd, void *arg);
+
+typedef struct pool_slot {
+    atomic_size_t seq;              /* Ring position this slot is ready for */
+    int connfd;
+    unsigned long long enqueued_ns;
+} PoolSlot;
+
+typedef struct pool_stats {
+    size_t depth, max_depth;
+    unsigned long long queued, rejected;
+    unsigned long long wait_ns_total, wait_ns_max;
+} PoolStats;
+
+typedef struct pool {
+    PoolSlot *slots;
+    size_t mask;
+    atomic_size_t enqueue_pos, dequeue_pos;
+    sem_t free_slots, items;
+    int reject;                     /* Reject instead of waiting when full */
+    PoolServe serve;
+    void *serve_arg;
+    pthread_t *workers;
+    int nworkers;
+
+    atomic_size_t depth, max_depth;
+    atomic_ullong queued, rejected;
+    atomic_ullong wait_ns_total, wait_ns_max;
+} Pool;
+
+int
+pool_init(Pool *pool, int nworkers, size_t queue_size, int reject,
+          PoolServe serve, void *serve_arg);
+
+int
+pool_submit(Pool *pool, int connfd);
+
+void
+pool_stats(Pool *pool, PoolStats *stats);
+
+#endif
@@ -0,0 +1,199 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ALIGN(size) (((size) + 15) & ~(size_t) 15)
+
+/*
+ * The pool of idle arenas is shared by every serving thread, a connection
+ * takes one when it opens and gives it back when it closes
+ */
+static struct {
+    pthread_mutex_t mutex;
+    Arena *idle;
+    atomic_ullong active, pooled, bytes, peak, created, resets;
+} arenas = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void
+free_blocks(Arena *arena);
+
+static ArenaBlock *
+new_block(size_t size);
+
+/*
+ * arena_get - Take an arena from the pool, or make one if it's empty.
+ */
+Arena *
+arena_get(void)
+{
+    Arena *arena;
+
+    pthread_mutex_lock(&arenas.mutex);
+    if ((arena = arenas.idle)) {
+        arenas.idle = arena->next;
+        atomic_fetch_sub(&arenas.pooled, 1);
+    }
+    pthread_mutex_unlock(&arenas.mutex);
+
+    if (!arena) {
+        arena = malloc(sizeof(Arena));
+        arena->blocks = new_block(ARENA_BLOCK);
+        arena->size = ARENA_BLOCK;
+        atomic_fetch_add(&arenas.created, 1);
+    }
+
+    atomic_fetch_add(&arenas.active, 1);
+    atomic_fetch_add(&arenas.bytes, arena->size);
+    return arena;
+}
+
+/*
+ * arena_put - Give an arena back to the pool once its connection is closed,
+ *     or free it if the pool is full.
+ */
+void
+arena_put(Arena *arena)
+{
+    free_blocks(arena);
+    atomic_fetch_sub(&arenas.active, 1);
+    atomic_fetch_sub(&arenas.bytes, arena->size);
+
+    pthread_mutex_lock(&arenas.mutex);
+    if (atomic_load(&arenas.pooled) < ARENA_POOL) {
+        arena->next = arenas.idle;
+        arenas.idle = arena;
+        atomic_fetch_add(&arenas.pooled, 1);
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&arenas.mutex);
+
+    if (arena) {
+        free(arena->blocks);
+        free(arena);
+    }
+}
+
+/*
+ * arena_reset - Free everything allocated from the arena, once the request
+ *     is answered. Only its first block is kept, for the next request.
+ */
+void
+arena_reset(Arena *arena)
+{
+    unsigned long long peak = atomic_load(&arenas.peak);
+
+    while (peak < arena->size
+           && !atomic_compare_exchange_weak(&arenas.peak, &peak, arena->size))
+        ;
+    atomic_fetch_add(&arenas.resets, 1);
+
+    free_blocks(arena);
+}
+
+/*
+ * arena_alloc - Allocate size bytes from the arena, aligned for any type.
+ *     A new block is added when the current one is full, at least twice as
+ *     large so a request needs only a few.
+ */
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+    void *p;
+    size_t block_size;
+    ArenaBlock *block = arena->blocks;
+
+    size = ALIGN(size);
+    if (block->size - block->used < size) {
+        block_size = block->size * 2 > size ? block->size * 2 : size;
+        block = new_block(block_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->size += block_size;
+        atomic_fetch_add(&arenas.bytes, block_size);
+    }
+
+    p = block->data + block->used;
+    block->used += size;
+    return p;
+}
+
+/*
+ * arena_grow - Grow buf, of old_size bytes, to size bytes. It's grown in
+ *     place if it's the last allocation and its block has room, otherwise
+ *     it's copied to a new allocation.
+ */
+void *
+arena_grow(Arena *arena, void *buf, size_t old_size, size_t size)
+{
+    void *p;
+    ArenaBlock *block = arena->blocks;
+
+    if ((char *) buf + ALIGN(old_size) == block->data + block->used
+        && block->size - block->used >= ALIGN(size) - ALIGN(old_size)) {
+        block->used += ALIGN(size) - ALIGN(old_size);
+        return buf;
+    }
+
+    p = arena_alloc(arena, size);
+    memcpy(p, buf, old_size);
+    return p;
+}
+
+char *
+arena_strndup(Arena *arena, const char *s, size_t len)
+{
+    char *p = arena_alloc(arena, len + 1);
+
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/*
+ * arena_stats - Take a snapshot of the counters. The memory a connection
+ *     holds is bytes over active.
+ */
+void
+arena_stats(ArenaStats *stats)
+{
+    stats->active = atomic_load(&arenas.active);
+    stats->pooled = atomic_load(&arenas.pooled);
+    stats->bytes = atomic_load(&arenas.bytes);
+    stats->peak = atomic_load(&arenas.peak);
+    stats->created = atomic_load(&arenas.created);
+    stats->resets = atomic_load(&arenas.resets);
+}
+
+/*
+ * free_blocks - Free the blocks of the arena but its first one, emptied.
+ */
+static void
+free_blocks(Arena *arena)
+{
+    ArenaBlock *block;
+
+    while ((block = arena->blocks)->next) {
+        arena->blocks = block->next;
+        arena->size -= block->size;
+        atomic_fetch_sub(&arenas.bytes, block->size);
+        free(block);
+    }
+    arena->blocks->used = 0;
+}
+
+static ArenaBlock *
+new_block(size_t size)
+{
+    ArenaBlock *block;
+
+    block = malloc(sizeof(ArenaBlock) + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
@@ -0,0 +1,55 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK 4096        /* First block of an arena, kept when reset */
+#define ARENA_POOL  1024        /* Idle arenas kept for the next connections */
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+    _Alignas(16) char data[];
+} ArenaBlock;
+
+/*
+ * The memory of the request a connection is serving, all given back at once
+ * when it's answered
+ */
+typedef struct arena {
+    ArenaBlock *blocks;         /* The one allocated from first */
+    size_t size;                /* Bytes of the blocks */
+    struct arena *next;         /* In the pool */
+} Arena;
+
+typedef struct arena_stats {
+    unsigned long long active;      /* Arenas held by connections */
+    unsigned long long pooled;      /* Idle arenas kept for reuse */
+    unsigned long long bytes;       /* Held by the active arenas */
+    unsigned long long peak;        /* Most bytes a request needed */
+    unsigned long long created;     /* Arenas not found in the pool */
+    unsigned long long resets;      /* About one per request served */
+} ArenaStats;
+
+Arena *
+arena_get(void);
+
+void
+arena_put(Arena *arena);
+
+void
+arena_reset(Arena *arena);
+
+void *
+arena_alloc(Arena *arena, size_t size);
+
+void *
+arena_grow(Arena *arena, void *buf, size_t old_size, size_t size);
+
+char *
+arena_strndup(Arena *arena, const char *s, size_t len);
+
+void
+arena_stats(ArenaStats *stats);
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chunk.h"
+
+#define CHUNK_SIZE          0   /* In the hex size of a chunk */
+#define CHUNK_EXT           1   /* In the extensions after it */
+#define CHUNK_SIZE_LF       2   /* At the end of the size line */
+#define CHUNK_DATA          3
+#define CHUNK_DATA_CR       4   /* At the line end after the data */
+#define CHUNK_DATA_LF       5
+#define CHUNK_TRAILER       6   /* At the start of a trailer line */
+#define CHUNK_TRAILER_LINE  7   /* In a trailer line */
+#define CHUNK_END_LF        8   /* At the end of the empty line */
+#define CHUNK_DONE          9
+
+static int
+hex_value(char c);
+
+void
+chunk_decoder_init(ChunkDecoder *decoder)
+{
+    decoder->state = CHUNK_SIZE;
+    decoder->size = 0;
+    decoder->digits = 0;
+}
+
+/*
+ * chunk_decode - Decode len bytes of a chunked body in buf, in place: the
+ *     data they hold is moved to the start of buf, and the size lines, their
+ *     extensions and the trailers are dropped. The decoding goes on from
+ *     where the last call left it, wherever buf was split.
+ *
+ *     Returns the number of data bytes, or -1 if the body is malformed. used
+ *     is set to the bytes of buf taken, all of them unless the body ended
+ *     before, which chunk_done then tells.
+ */
+ssize_t
+chunk_decode(ChunkDecoder *decoder, char *buf, size_t len, size_t *used)
+{
+    size_t pos = 0, out = 0, n;
+    int digit;
+    char c;
+
+    while (pos < len && decoder->state != CHUNK_DONE) {
+        if (decoder->state == CHUNK_DATA) {
+            n = len - pos < decoder->size ? len - pos : decoder->size;
+            memmove(buf + out, buf + pos, n);
+            out += n;
+            pos += n;
+            if (!(decoder->size -= n))
+                decoder->state = CHUNK_DATA_CR;
+            continue;
+        }
+
+        c = buf[pos++];
+        switch (decoder->state) {
+        case CHUNK_SIZE:
+            if ((digit = hex_value(c)) >= 0) {
+                if (decoder->size > (SIZE_MAX >> 4))
+                    return -1;
+                decoder->size = decoder->size << 4 | digit;
+                decoder->digits++;
+                break;
+            }
+            if (!decoder->digits)
+                return -1;
+            if (c == ';' || c == ' ' || c == '\t')
+                decoder->state = CHUNK_EXT;
+            else if (c == '\r' || c == '\n')
+                decoder->state = CHUNK_SIZE_LF;
+            else
+                return -1;
+            pos -= c == '\n';      /* A bare LF ends the line as well */
+            break;
+        case CHUNK_EXT:
+            if (c == '\n') {
+                decoder->state = CHUNK_SIZE_LF;
+                pos--;
+            }
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n')
+                return -1;
+            decoder->state = decoder->size ? CHUNK_DATA : CHUNK_TRAILER;
+            decoder->digits = 0;
+            break;
+        case CHUNK_DATA_CR:
+            if (c == '\r')
+                decoder->state = CHUNK_DATA_LF;
+            else if (c == '\n')
+                decoder->state = CHUNK_SIZE;
+            else
+                return -1;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                return -1;
+            decoder->state = CHUNK_SIZE;
+            break;
+        case CHUNK_TRAILER:
+            if (c == '\r')
+                decoder->state = CHUNK_END_LF;
+            else if (c == '\n')
+                decoder->state = CHUNK_DONE;
+            else
+                decoder->state = CHUNK_TRAILER_LINE;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (c == '\n')
+                decoder->state = CHUNK_TRAILER;
+            break;
+        case CHUNK_END_LF:
+            if (c != '\n')
+                return -1;
+            decoder->state = CHUNK_DONE;
+            break;
+        }
+    }
+
+    *used = pos;
+    return out;
+}
+
+/*
+ * chunk_done - The last chunk and the trailers were decoded, the body is
+ *     complete.
+ */
+int
+chunk_done(const ChunkDecoder *decoder)
+{
+    return decoder->state == CHUNK_DONE;
+}
+
+/*
+ * chunk_encode - Point iov to n bytes of data as a chunk, its size line
+ *     written to size_line. Returns the number of buffers, CHUNK_IOVCNT, or
+ *     0 for no data, which would end the body.
+ */
+int
+chunk_encode(struct iovec *iov, char *size_line, const void *data, size_t n)
+{
+    if (!n)
+        return 0;
+
+    iov[0].iov_base = size_line;
+    iov[0].iov_len = snprintf(size_line, CHUNK_LINE_SIZE, "%zx\r\n", n);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = n;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+
+    return CHUNK_IOVCNT;
+}
+
+static int
+hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
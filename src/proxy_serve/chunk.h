@@ -0,0 +1,33 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define CHUNK_LINE_SIZE 20      /* Size line of a chunk, in hex with CRLF */
+#define CHUNK_IOVCNT 3          /* Buffers of an encoded chunk */
+#define CHUNK_LAST "0\r\n\r\n"  /* Last chunk, with no trailers */
+
+/*
+ * The state of the decoding of a chunked body, fed with buffers that may
+ * split it anywhere
+ */
+typedef struct chunk_decoder {
+    int state;
+    size_t size;                /* Data bytes left in the current chunk */
+    int digits;                 /* Of its size line read so far */
+} ChunkDecoder;
+
+void
+chunk_decoder_init(ChunkDecoder *decoder);
+
+ssize_t
+chunk_decode(ChunkDecoder *decoder, char *buf, size_t len, size_t *used);
+
+int
+chunk_done(const ChunkDecoder *decoder);
+
+int
+chunk_encode(struct iovec *iov, char *size_line, const void *data, size_t n);
+
+#endif
@@ -0,0 +1,110 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "gzip.h"
+
+#define GZIP_WINDOW     (15 + 16)   /* Largest window, gzip wrapper */
+#define GZIP_MEM_LEVEL  8
+#define GZIP_TRAILER    8           /* CRC-32 and length of the data */
+
+/* Bodies compressed, their bytes before and after, and bodies inflated */
+static atomic_ullong gzip_compressed, gzip_raw_bytes, gzip_gzip_bytes,
+                     gzip_inflated;
+
+/*
+ * gzip_compress - Compress len bytes of data into a gzip stream, in one go.
+ *     Returns it, to be freed by the caller, with its length in gzip_len, or
+ *     NULL if it doesn't come out shorter than data.
+ */
+void *
+gzip_compress(const void *data, size_t len, size_t *gzip_len)
+{
+    int rc;
+    void *out;
+    z_stream zs = {0};
+
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW, GZIP_MEM_LEVEL,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    zs.avail_out = deflateBound(&zs, len);
+    if (!(out = malloc(zs.avail_out))) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = len;
+    zs.next_out = out;
+
+    rc = deflate(&zs, Z_FINISH);
+    *gzip_len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END || *gzip_len >= len) {
+        free(out);
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&gzip_compressed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&gzip_raw_bytes, len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&gzip_gzip_bytes, *gzip_len,
+                              memory_order_relaxed);
+    return out;
+}
+
+/*
+ * gzip_inflate - Decompress the gzip stream of len bytes in data, into a
+ *     buffer sized from the length its trailer gives. Returns the buffer, to
+ *     be freed by the caller, with the data length in plain_len, or NULL if
+ *     the stream is corrupt, holds more than one member or more than max
+ *     bytes.
+ */
+void *
+gzip_inflate(const void *data, size_t len, size_t max, size_t *plain_len)
+{
+    int rc;
+    size_t size;
+    const unsigned char *trailer;
+    void *out;
+    z_stream zs = {0};
+
+    if (len < GZIP_TRAILER)
+        return NULL;
+    trailer = (const unsigned char *) data + len - 4;
+    size = (size_t) trailer[0] | (size_t) trailer[1] << 8
+           | (size_t) trailer[2] << 16 | (size_t) trailer[3] << 24;
+    if (size > max || !(out = malloc(size + 1)))
+        return NULL;
+
+    if (inflateInit2(&zs, GZIP_WINDOW) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = size + 1;    /* Room to tell a lying trailer */
+
+    rc = inflate(&zs, Z_FINISH);
+    *plain_len = zs.total_out;
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END || *plain_len != size || zs.avail_in) {
+        free(out);
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&gzip_inflated, 1, memory_order_relaxed);
+    return out;
+}
+
+/*
+ * gzip_stats - Take a snapshot of the counters.
+ */
+void
+gzip_stats(GzipStats *stats)
+{
+    stats->compressed = atomic_load(&gzip_compressed);
+    stats->raw_bytes = atomic_load(&gzip_raw_bytes);
+    stats->gzip_bytes = atomic_load(&gzip_gzip_bytes);
+    stats->inflated = atomic_load(&gzip_inflated);
+}
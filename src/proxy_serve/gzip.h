@@ -0,0 +1,26 @@
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+
+#define GZIP_LEVEL      6       /* zlib's default, speed against size */
+#define GZIP_MIN_LENGTH 256     /* Shorter bodies aren't worth compressing */
+#define GZIP_MAX_RATIO  1032    /* Most deflate shrinks data by */
+
+typedef struct gzip_stats {
+    unsigned long long compressed;  /* Bodies cached compressed */
+    unsigned long long raw_bytes;   /* Their length before compression */
+    unsigned long long gzip_bytes;  /* and after */
+    unsigned long long inflated;    /* Bodies inflated for a client */
+} GzipStats;
+
+void *
+gzip_compress(const void *data, size_t len, size_t *gzip_len);
+
+void *
+gzip_inflate(const void *data, size_t len, size_t max, size_t *plain_len);
+
+void
+gzip_stats(GzipStats *stats);
+
+#endif
@@ -0,0 +1,259 @@
+#include <string.h>
+#include <strings.h>
+
+#include "parse.h"
+
+#define PARSE_START_LINE    0
+#define PARSE_HEADERS       1
+#define PARSE_DONE          2
+
+#define KNOWN_MAX_LEN       17      /* Longest known header name */
+#define KNOWN_PER_LEN       4       /* Most known names of the same length */
+
+typedef struct known_header {
+    const char *name;               /* Lowercase */
+    HeaderId id;
+} KnownHeader;
+
+/*
+ * The known headers by name length, so a name is only compared with the few
+ * of its length
+ */
+static const KnownHeader known_headers[KNOWN_MAX_LEN + 1][KNOWN_PER_LEN] = {
+    [3] = {{"age", HDR_AGE}},
+    [4] = {{"date", HDR_DATE}, {"etag", HDR_ETAG}, {"host", HDR_HOST},
+           {"vary", HDR_VARY}},
+    [6] = {{"pragma", HDR_PRAGMA}},
+    [7] = {{"expires", HDR_EXPIRES}},
+    [10] = {{"connection", HDR_CONNECTION}, {"keep-alive", HDR_KEEP_ALIVE}},
+    [13] = {{"cache-control", HDR_CACHE_CONTROL},
+            {"last-modified", HDR_LAST_MODIFIED}},
+    [14] = {{"content-length", HDR_CONTENT_LENGTH}},
+    [15] = {{"accept-encoding", HDR_ACCEPT_ENCODING}},
+    [16] = {{"content-encoding", HDR_CONTENT_ENCODING},
+            {"proxy-connection", HDR_PROXY_CONNECTION}},
+    [17] = {{"transfer-encoding", HDR_TRANSFER_ENCODING}},
+};
+
+static void
+parse_start_line(HttpParser *parser, const char *buf, size_t end,
+                 size_t next);
+
+static int
+parse_header(HttpParser *parser, const char *buf, size_t end, size_t next);
+
+static HttpSpan
+next_word(const char *buf, size_t *pos, size_t end);
+
+static HeaderId
+find_known(const char *name, size_t len);
+
+void
+http_parser_init(HttpParser *parser, HttpKind kind)
+{
+    parser->kind = kind;
+    parser->state = kind == HTTP_HEADERS ? PARSE_HEADERS : PARSE_START_LINE;
+    parser->line = parser->scan = 0;
+    parser->status = 0;
+    parser->nheaders = 0;
+    parser->head_len = 0;
+}
+
+/*
+ * http_parse - Parse the head at the start of buf, len bytes received so
+ *     far, going on from where the last call for the same head stopped: buf
+ *     may have grown or moved since, but must hold the same bytes. The bytes
+ *     searched for a line end aren't searched again, and a line is parsed
+ *     once it's complete.
+ *
+ *     Returns 1 once the head is complete, its length in parser->head_len, 0
+ *     if more of it is needed, or -1 if it's malformed: a header line with
+ *     no name, a blank before its colon or folded, or too many of them.
+ */
+int
+http_parse(HttpParser *parser, const char *buf, size_t len)
+{
+    const char *eol;
+    size_t end, next;
+
+    while (parser->state != PARSE_DONE) {
+        if (!(eol = memchr(buf + parser->scan, '\n', len - parser->scan))) {
+            parser->scan = len;
+            return 0;
+        }
+        next = eol + 1 - buf;
+        end = eol - buf;
+        if (end > parser->line && buf[end - 1] == '\r')
+            end--;
+
+        if (end == parser->line) {
+            /* Empty lines before a request line are ignored */
+            if (parser->state == PARSE_START_LINE
+                && parser->kind != HTTP_REQUEST)
+                return -1;
+            if (parser->state == PARSE_HEADERS) {
+                parser->head_len = next;
+                parser->state = PARSE_DONE;
+            }
+        } else if (parser->state == PARSE_START_LINE) {
+            parse_start_line(parser, buf, end, next);
+            parser->state = PARSE_HEADERS;
+        } else if (parse_header(parser, buf, end, next) < 0) {
+            return -1;
+        }
+
+        parser->line = parser->scan = next;
+    }
+
+    return 1;
+}
+
+/*
+ * http_span_is - The span of buf is the string s, case included.
+ */
+int
+http_span_is(const char *buf, HttpSpan span, const char *s)
+{
+    return strlen(s) == span.len && !memcmp(buf + span.off, s, span.len);
+}
+
+/*
+ * http_span_has - The span of buf holds token, whatever its case.
+ */
+int
+http_span_has(const char *buf, HttpSpan span, const char *token)
+{
+    size_t len = strlen(token);
+
+    for (size_t i = 0; i + len <= span.len; i++) {
+        if (!strncasecmp(buf + span.off + i, token, len))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * parse_start_line - Split the request line into its method, target and
+ *     version, or the status line into its version and status. A missing
+ *     part is left empty, for the caller to refuse.
+ */
+static void
+parse_start_line(HttpParser *parser, const char *buf, size_t end,
+                 size_t next)
+{
+    size_t pos = parser->line;
+    HttpSpan status;
+
+    parser->start_line.off = parser->line;
+    parser->start_line.len = next - parser->line;
+
+    if (parser->kind == HTTP_REQUEST) {
+        parser->method = next_word(buf, &pos, end);
+        parser->target = next_word(buf, &pos, end);
+        parser->version = next_word(buf, &pos, end);
+        return;
+    }
+
+    parser->version = next_word(buf, &pos, end);
+    status = next_word(buf, &pos, end);
+    parser->status = 0;
+    if (status.len != 3)
+        return;
+    for (unsigned i = 0; i < 3; i++) {
+        if (buf[status.off + i] < '0' || buf[status.off + i] > '9') {
+            parser->status = 0;
+            return;
+        }
+        parser->status = parser->status * 10 + buf[status.off + i] - '0';
+    }
+}
+
+/*
+ * parse_header - Record a header line, its name looked up among the known
+ *     ones and its value trimmed.
+ */
+static int
+parse_header(HttpParser *parser, const char *buf, size_t end, size_t next)
+{
+    size_t pos, value_end;
+    HttpHeader *header;
+
+    if (parser->nheaders == HTTP_MAX_HEADERS)
+        return -1;
+
+    /* No blank in the name, nor before it as in an obsolete folded line */
+    for (pos = parser->line; pos < end && buf[pos] != ':'; pos++) {
+        if (buf[pos] == ' ' || buf[pos] == '\t')
+            return -1;
+    }
+    if (pos == end || pos == parser->line)
+        return -1;
+
+    header = &parser->headers[parser->nheaders++];
+    header->line.off = parser->line;
+    header->line.len = next - parser->line;
+    header->name.off = parser->line;
+    header->name.len = pos - parser->line;
+    header->id = find_known(buf + parser->line, pos - parser->line);
+
+    for (pos++; pos < end && (buf[pos] == ' ' || buf[pos] == '\t'); pos++)
+        ;
+    for (value_end = end; value_end > pos && (buf[value_end - 1] == ' '
+                                              || buf[value_end - 1] == '\t');
+         value_end--)
+        ;
+    header->value.off = pos;
+    header->value.len = value_end - pos;
+
+    return 0;
+}
+
+/*
+ * next_word - The span of the word at *pos, up to end, moving *pos past it
+ *     and the blanks after it.
+ */
+static HttpSpan
+next_word(const char *buf, size_t *pos, size_t end)
+{
+    HttpSpan word;
+
+    word.off = *pos;
+    while (*pos < end && buf[*pos] != ' ')
+        (*pos)++;
+    word.len = *pos - word.off;
+    while (*pos < end && buf[*pos] == ' ')
+        (*pos)++;
+
+    return word;
+}
+
+/*
+ * find_known - Look a header name up among the known ones, whatever its
+ *     case.
+ */
+static HeaderId
+find_known(const char *name, size_t len)
+{
+    size_t i;
+    char c;
+    const KnownHeader *known;
+
+    if (len > KNOWN_MAX_LEN)
+        return HDR_OTHER;
+
+    for (known = known_headers[len];
+         known < known_headers[len] + KNOWN_PER_LEN && known->name; known++) {
+        for (i = 0; i < len; i++) {
+            c = name[i];
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            if (c != known->name[i])
+                break;
+        }
+        if (i == len)
+            return known->id;
+    }
+
+    return HDR_OTHER;
+}
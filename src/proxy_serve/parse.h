@@ -0,0 +1,77 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS 100    /* Header lines kept per head */
+
+typedef enum http_kind {
+    HTTP_REQUEST,               /* Request line, headers, empty line */
+    HTTP_RESPONSE,              /* Status line, headers, empty line */
+    HTTP_HEADERS                /* Header lines only */
+} HttpKind;
+
+/* The headers the proxy looks at, anything else is HDR_OTHER */
+typedef enum header_id {
+    HDR_OTHER,
+    HDR_ACCEPT_ENCODING,
+    HDR_AGE,
+    HDR_CACHE_CONTROL,
+    HDR_CONNECTION,
+    HDR_CONTENT_ENCODING,
+    HDR_CONTENT_LENGTH,
+    HDR_DATE,
+    HDR_ETAG,
+    HDR_EXPIRES,
+    HDR_HOST,
+    HDR_KEEP_ALIVE,
+    HDR_LAST_MODIFIED,
+    HDR_PRAGMA,
+    HDR_PROXY_CONNECTION,
+    HDR_TRANSFER_ENCODING,
+    HDR_VARY
+} HeaderId;
+
+/* Bytes of the parsed buffer, as an offset so the buffer may be moved */
+typedef struct http_span {
+    unsigned off, len;
+} HttpSpan;
+
+typedef struct http_header {
+    HttpSpan line;              /* The whole line, its line ending included */
+    HttpSpan name, value;       /* The value without surrounding blanks */
+    HeaderId id;
+} HttpHeader;
+
+/*
+ * The state of the parse of a message head, fed with a buffer that may only
+ * hold part of it yet. Nothing is copied or allocated, the parts are spans
+ * of the buffer.
+ */
+typedef struct http_parser {
+    HttpKind kind;
+    int state;
+    size_t line;                /* Start of the line being parsed */
+    size_t scan;                /* Where to look for its end next */
+    HttpSpan start_line;        /* Request or status line, with its ending */
+    HttpSpan method, target;    /* Of a request */
+    HttpSpan version;
+    int status;                 /* Of a response, 0 if not a number */
+    int nheaders;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+    size_t head_len;            /* Up to the empty line, once complete */
+} HttpParser;
+
+void
+http_parser_init(HttpParser *parser, HttpKind kind);
+
+int
+http_parse(HttpParser *parser, const char *buf, size_t len);
+
+int
+http_span_is(const char *buf, HttpSpan span, const char *s);
+
+int
+http_span_has(const char *buf, HttpSpan span, const char *token);
+
+#endif
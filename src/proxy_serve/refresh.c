@@ -0,0 +1,153 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "refresh.h"
+#include "serve.h"
+
+/* A cached response to fetch again, its flight keeps others from doing so */
+typedef struct refresh_job {
+    char *hostname, *port;
+    char *request_line, *request_headers;
+    Flight *flight;
+} RefreshJob;
+
+/*
+ * The queue of the background refreshes is shared by every serving thread,
+ * and served by a few workers of its own so that a slow server never holds
+ * up a client
+ */
+static struct {
+    Cache *proxy_cache;
+    int nworkers;                   /* 0 if refreshes are disabled */
+    RefreshJob jobs[REFRESH_QUEUE];
+    size_t head, count;
+    pthread_mutex_t mutex;
+    pthread_cond_t nonempty;
+    atomic_ullong queued, dropped, refreshed, failed;
+} refresh;
+
+static void *
+refresh_loop(void *vargp);
+
+static void
+free_job(RefreshJob *job);
+
+/*
+ * refresh_init - Start nworkers threads refreshing the cached responses of
+ *     proxy_cache in the background. With none, hits near or past their
+ *     expiry aren't refreshed ahead.
+ */
+void
+refresh_init(Cache *proxy_cache, int nworkers)
+{
+    pthread_t tid;
+
+    refresh.proxy_cache = proxy_cache;
+    refresh.nworkers = nworkers;
+    pthread_mutex_init(&refresh.mutex, NULL);
+    pthread_cond_init(&refresh.nonempty, NULL);
+
+    for (int i = 0; i < nworkers; i++) {
+        pthread_create(&tid, NULL, refresh_loop, NULL);
+        pthread_detach(tid);
+    }
+}
+
+int
+refresh_enabled(void)
+{
+    return refresh.nworkers > 0;
+}
+
+/*
+ * refresh_queue - Have the response to the request fetched again in the
+ *     background, unless it's being fetched already. Never waits: when all
+ *     the workers are busy and the queue is full, the refresh is dropped and
+ *     a later hit asks again.
+ */
+void
+refresh_queue(const char *hostname, const char *port,
+              const char *request_line, const char *request_headers)
+{
+    Flight *flight;
+    RefreshJob *job;
+
+    if (!refresh_enabled()
+        || !(flight = lead_flight(request_line, request_headers)))
+        return;
+
+    pthread_mutex_lock(&refresh.mutex);
+    if (refresh.count == REFRESH_QUEUE) {
+        pthread_mutex_unlock(&refresh.mutex);
+        flight_done(flight);
+        atomic_fetch_add(&refresh.dropped, 1);
+        return;
+    }
+
+    job = &refresh.jobs[(refresh.head + refresh.count++) % REFRESH_QUEUE];
+    job->hostname = strdup(hostname);
+    job->port = strdup(port);
+    job->request_line = strdup(request_line);
+    job->request_headers = strdup(request_headers);
+    job->flight = flight;
+    pthread_cond_signal(&refresh.nonempty);
+    pthread_mutex_unlock(&refresh.mutex);
+
+    atomic_fetch_add(&refresh.queued, 1);
+}
+
+/*
+ * refresh_stats - Take a snapshot of the counters.
+ */
+void
+refresh_stats(RefreshStats *stats)
+{
+    stats->queued = atomic_load(&refresh.queued);
+    stats->dropped = atomic_load(&refresh.dropped);
+    stats->refreshed = atomic_load(&refresh.refreshed);
+    stats->failed = atomic_load(&refresh.failed);
+}
+
+static void *
+refresh_loop(void *vargp)
+{
+    RefreshJob job;
+    Arena *arena = arena_get();
+
+    (void) vargp;
+
+    while (1) {
+        pthread_mutex_lock(&refresh.mutex);
+        while (!refresh.count)
+            pthread_cond_wait(&refresh.nonempty, &refresh.mutex);
+        job = refresh.jobs[refresh.head];
+        refresh.head = (refresh.head + 1) % REFRESH_QUEUE;
+        refresh.count--;
+        pthread_mutex_unlock(&refresh.mutex);
+
+        if (refresh_response(refresh.proxy_cache, arena, job.hostname,
+                             job.port, job.request_line,
+                             job.request_headers) < 0)
+            atomic_fetch_add(&refresh.failed, 1);
+        else
+            atomic_fetch_add(&refresh.refreshed, 1);
+
+        /* Requests that missed meanwhile look in the cache again */
+        flight_done(job.flight);
+        free_job(&job);
+        arena_reset(arena);
+    }
+
+    return NULL;
+}
+
+static void
+free_job(RefreshJob *job)
+{
+    free(job->hostname);
+    free(job->port);
+    free(job->request_line);
+    free(job->request_headers);
+}
@@ -0,0 +1,30 @@
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#include "../proxy_cache/cache.h"
+
+#define REFRESH_WORKERS 4       /* Default background refresh workers */
+#define REFRESH_QUEUE   64      /* Refreshes waiting for a worker */
+#define REFRESH_AHEAD   10      /* Refreshed in the last 1/10 of its lifetime */
+
+typedef struct refresh_stats {
+    unsigned long long queued;      /* Refreshes handed to the workers */
+    unsigned long long dropped;     /* Not queued, the queue was full */
+    unsigned long long refreshed;   /* Cached anew or revalidated */
+    unsigned long long failed;
+} RefreshStats;
+
+void
+refresh_init(Cache *proxy_cache, int nworkers);
+
+int
+refresh_enabled(void);
+
+void
+refresh_queue(const char *hostname, const char *port,
+              const char *request_line, const char *request_headers);
+
+void
+refresh_stats(RefreshStats *stats);
+
+#endif
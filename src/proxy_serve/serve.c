@@ -1,349 +1,2229 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 
+#include "gzip.h"
+#include "parse.h"
+#include "refresh.h"
 #include "serve.h"
 #include "../proxy_cache/cache.h"
+#include "../proxy_metrics/metrics.h"
 #include "../safe_input_output/sio.h"
+#include "../proxy_upstream/upstream.h"
 #include "../socket_interface/interface.h"
 
 
-#define DEFAULT_HEADERS_SIZE 130
+#define DEFAULT_HEADERS_SIZE 160     /* The proxy's own, but the hostname */
+#define HEAD_SIZE 2048                /* Head buffer, doubled as needed */
 
 
 static const char *usr_agent_header = "User_Agent: Mozilla/5.0 (X11; Linux x86_64; rv:98.0) Gecko/20100101 Firefox/98.0\r\n";
 static const char *connection_header = "Connection: close\r\n";
 static const char *proxy_connection_header = "Proxy-Connection: close\r\n";
+static const char *keep_alive_header = "Connection: keep-alive\r\n";
+static const char *keep_alive_end = "Connection: keep-alive\r\n\r\n";
+static const char *close_end = "Connection: close\r\n\r\n";
+static const char *chunked_keep_alive_end =
+    "Transfer-Encoding: chunked\r\nConnection: keep-alive\r\n\r\n";
+static const char *chunked_close_end =
+    "Transfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+
+/* Statuses a response can be cached with when it sets no lifetime */
+static const int heuristic_statuses[] = {
+    200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501, 0
+};
+
+/* Content types compressed for the cache, by prefix */
+static const char *compressible_types[] = {
+    "text/", "application/javascript", "application/x-javascript",
+    "application/json", "application/xml", "image/svg+xml", NULL
+};
+
+/* Body bytes relayed through user space and with splice(2) */
+static atomic_ullong relay_copied, relay_spliced;
 
+/* Seconds an idle client connection is kept open, 0 closes after a response */
+static int client_idle_timeout = KEEP_ALIVE_TIMEOUT;
+
+
+static int
+read_head(Sio *sio, Arena *arena, char **head, HttpParser *parser,
+          unsigned long long *start);
 
 static int
-parse_request_line(Sio *sio, char *method, char *url);
+parse_request_line(int clientfd, const char *buf, const HttpParser *parser,
+                   int *keep_alive);
 
 static int
-parse_request_headers(Sio *sio, char *request_headers, char *hostname);
+asks_for_metrics(int clientfd, const char *buf, const HttpParser *parser);
+
+static int
+is_proxy_address(int clientfd, const char *hostname, const char *port);
+
+static int
+parse_request_headers(int clientfd, const char *buf,
+                      const HttpParser *parser, Arena *arena,
+                      Request *client_request, int *keep_alive);
 
 static void
-parse_url(const char *url, char *hostname, char *port, char *uri);
+connection_option(const char *buf, const HttpHeader *header,
+                  int *keep_alive);
+
+static int
+is_zero(const char *buf, HttpSpan value);
+
+static int
+accepts_gzip(const char *buf, HttpSpan value);
+
+static int
+parse_url(const char *url, size_t len, char *hostname, char *port,
+          char *path);
+
+static int
+split_host(const char *host, size_t len, char *hostname, char *port);
+
+static char *
+build_request_line(const Request *client_request, Arena *arena);
+
+static char *
+build_request_headers(const Request *client_request, Arena *arena);
+
+static int
+parse_response(Sio *sio, Arena *arena, const char *request_headers,
+               Response *server_response);
+
+static int
+send_request(const char *hostname, const char *port,
+             const char *request_line, const char *request_headers,
+             Arena *arena, Sio *sio, Response *server_response);
+
+static int
+fetch_response(int clientfd, const Request *client_request,
+               Cache *proxy_cache, Arena *arena, const char *request_line,
+               const char *request_headers, Response *server_response,
+               Flight **flight);
+
+static int
+relay_response(Sio *sio, int clientfd, Cache *proxy_cache,
+               const char *request_line, const char *request_headers,
+               const Request *client_request, Response *server_response);
+
+static int
+relay_chunked(Sio *sio, int clientfd, Cache *proxy_cache,
+              const char *request_line, const char *request_headers,
+              const Request *client_request, Response *server_response);
+
+static int
+read_body(Sio *sio, Response *server_response);
+
+static char *
+parse_response_headers(const char *buf, const HttpParser *parser,
+                       Response *server_response);
 
 static void
-build_request_line(const Request *client_request, char *request_line);
+parse_response_line(const char *buf, const HttpParser *parser,
+                    Response *server_response);
 
 static void
-build_request_headers(const Request *client_request, char *request_headers);
+pick_header(const char *buf, const HttpHeader *header,
+            Response *server_response);
 
 static int
-parse_response(int proxyfd, Response *server_response);
+parse_length(const char *buf, HttpSpan value, size_t *length);
 
 static int
-parse_response_headers(Sio *sio, char *response_headers, size_t *content_length);
+varies_on_request(const char *buf, HttpSpan value);
+
+static void
+copy_value(const char *buf, HttpSpan value, char *valuebuf);
+
 static void
-client_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
+parse_cache_control(const char *value, CacheControl *cc);
+
+static time_t
+parse_http_date(const char *value);
+
+static void
+finish_head(const char *request_headers, Response *server_response);
+
+static time_t
+response_expiry(const char *request_headers,
+                const Response *server_response, time_t *refresh);
+
+static long
+stale_while_revalidate(const CacheObject *object);
+
+static int
+is_heuristic_status(int status);
 
 static void
-strtolwr(char *str);
+use_object(Response *server_response, CacheObject *object);
+
+static int
+request_no_cache(const char *request_headers);
+
+static const char *
+find_header(const char *headers, const char *name);
+
+static int
+header_has(const char *headers, const char *name, const char *token);
+
+static char *
+merge_headers(const char *stored, const char *update);
+
+static char *
+body_headers(const char *headers, int gzipped, size_t length);
+
+static char *
+weaken_etag(char *headers);
+
+static int
+is_compressible(const Response *server_response, size_t content_length);
+
+static int
+is_gzipped(const char *headers);
+
+static int
+is_body_header(const char *linebuf);
+
+static int
+is_hop_by_hop(HeaderId id);
+
+static void
+release_object(void *object);
+
+/*
+ * keep_alive_init - Keep client connections open between requests for at
+ *     most timeout idle seconds. A timeout of 0 closes them after the first
+ *     response, as HTTP/1.0 does.
+ */
+void
+keep_alive_init(int timeout)
+{
+    client_idle_timeout = timeout;
+}
 
 int
-parse_request(int clientfd, Request *client_request)
+keep_alive_timeout(void)
 {
-    Sio sio;
-    char method[METHOD_LEN], url[MAX_LINE], hostname[MAX_LINE],
-    port[PORT_LEN], uri[MAX_LINE], headers[MAX_BUF];
+    return client_idle_timeout;
+}
 
-    sio_initbuf(&sio, clientfd);
+/*
+ * parse_request - Read and parse the next request from the client buffered
+ *     by sio. The buffer is kept between the requests of a persistent
+ *     connection, so the pipelined ones already read are parsed in order.
+ *     Returns -1 on error or once the client closed the connection.
+ */
+int
+parse_request(Sio *sio, Arena *arena, Request *client_request)
+{
+    int rc;
+    char *head;
+    HttpParser parser;
+
+    http_parser_init(&parser, HTTP_REQUEST);
+    if ((rc = read_head(sio, arena, &head, &parser,
+                        &client_request->rq_start)) <= 0) {
+        if (rc < 0)
+            client_error(sio->sio_fd, "head", "400", "bad request",
+                         "the server can't understand this request");
+        return -1;
+    }
 
-    if (parse_request_line(&sio, method, url) < 0) 
+    return parse_request_head(sio->sio_fd, head, &parser, arena,
+                              client_request);
+}
+
+/*
+ * parse_request_head - Take client_request from the request head parsed
+ *     into buf, its strings allocated from arena. Requests the proxy can't
+ *     serve are answered with an error, and -1 returned.
+ */
+int
+parse_request_head(int clientfd, const char *buf, const HttpParser *parser,
+                   Arena *arena, Request *client_request)
+{
+    int keep_alive;
+    HttpSpan target = parser->target;
+
+    if (parse_request_line(clientfd, buf, parser, &keep_alive) < 0)
         return -1;
 
-    parse_url(url, hostname, port, uri);
+    /* Asked of the proxy itself, there's nothing to forward */
+    if (asks_for_metrics(clientfd, buf, parser)) {
+        client_request->rq_metrics = 1;
+        client_request->rq_keep_alive = keep_alive && client_idle_timeout > 0;
+        metrics_record(STAGE_REQUEST, client_request->rq_start);
+        return 0;
+    }
 
-    if (parse_request_headers(&sio, headers, hostname) < 0) 
+    /* The url is the longest the host and path can be */
+    client_request->rq_method = arena_strndup(arena, buf + parser->method.off,
+                                              parser->method.len);
+    client_request->rq_hostname = arena_alloc(arena, target.len + 1);
+    client_request->rq_port = arena_alloc(arena, PORT_LEN);
+    client_request->rq_uri = arena_alloc(arena, target.len + 2);
+    if (parse_url(buf + target.off, target.len, client_request->rq_hostname,
+                  client_request->rq_port, client_request->rq_uri) < 0) {
+        copy_value(buf, target, client_request->rq_uri);
+        client_error(clientfd, client_request->rq_uri, "400", "bad request",
+                     "the proxy can't make sense of this url");
         return -1;
+    }
 
-    client_request->rq_headers = strdup(headers);
-    client_request->rq_hostname = strdup(hostname);
-    client_request->rq_method = strdup(method);
-    client_request->rq_port = strdup(port);
-    client_request->rq_uri = strdup(uri);
+    client_request->rq_gzip = 0;
+    if (parse_request_headers(clientfd, buf, parser, arena, client_request,
+                              &keep_alive) < 0)
+        return -1;
 
+    client_request->rq_keep_alive = keep_alive && client_idle_timeout > 0;
+    client_request->rq_http11 = http_span_is(buf, parser->version,
+                                             "HTTP/1.1");
+    metrics_record(STAGE_REQUEST, client_request->rq_start);
     return 0;
 }
 
+/*
+ * forward_request - Answer client_request to clientfd, from the cache if the
+ *     response is cached, otherwise from the server with the response relayed
+ *     to the client while it arrives. Once it returns 0, the connection can
+ *     take the next request if response_keep_alive says so.
+ *
+ *     Only one of the requests missing the same response at a time fetches
+ *     it, the others wait for it to be cached, up to FLIGHT_TIMEOUT, then
+ *     fetch it on their own if it wasn't. A request for METRICS_PATH of the
+ *     proxy itself is answered with the proxy's own metrics.
+ */
 int
-forward_request(const Request *client_request, Cache *proxy_cache,
-                Response *server_response)
-{
-    int proxyfd, is_cached;
-    char request_line[MAX_LINE], request_headers[MAX_BUF];
-
-    build_request_line(client_request, request_line);
-    build_request_headers(client_request, request_headers);
-
-    is_cached = cache_fetch(proxy_cache, request_line, request_headers,
-                &server_response->rs_line, &server_response->rs_headers,
-                &server_response->rs_content, 
-                &server_response->rs_content_length);
-    if (!is_cached) {
-        if ((proxyfd = open_clientfd(client_request->rq_hostname,
-                                     client_request->rq_port)) < 0)
-            return -1;
+forward_request(int clientfd, const Request *client_request, 
+                Cache *proxy_cache, Arena *arena, Response *server_response)
+{
+    int leader, rc;
+    char *request_line, *request_headers;
+    Flight *flight;
+
+    if (client_request->rq_metrics) {
+        metrics_response(proxy_cache, server_response);
+        return forward_response(clientfd, server_response,
+                                response_keep_alive(client_request,
+                                                    server_response));
+    }
 
-        if (sio_writen(proxyfd, request_line, strlen(request_line)) < 0)
-            return -1;
+    build_request(client_request, arena, &request_line, &request_headers);
+
+    if (fetch_cached(client_request, proxy_cache, request_line,
+                     request_headers, server_response))
+        return forward_response(clientfd, server_response,
+                                response_keep_alive(client_request,
+                                                    server_response));
+
+    flight = join_flight(request_line, request_headers, &leader);
+    if (!leader) {
+        if (flight_wait(flight, FLIGHT_TIMEOUT) == 0) {
+            release_response(server_response);
+            if (fetch_cached(client_request, proxy_cache, request_line,
+                             request_headers, server_response))
+                return forward_response(clientfd, server_response,
+                                        response_keep_alive(client_request,
+                                                            server_response));
+        }
+        flight = NULL;
+    }
 
-        if (sio_writen(proxyfd, request_headers, strlen(request_headers)) < 0)
-            return -1;
+    rc = fetch_response(clientfd, client_request, proxy_cache, arena,
+                        request_line, request_headers, server_response,
+                        &flight);
+    if (flight)
+        flight_done(flight);
+    return rc;
+}
 
-        if (parse_response(proxyfd, server_response) < 0)
-            return -1;
-        cache_write(proxy_cache, request_line, request_headers,
-                    server_response->rs_line, server_response->rs_headers,
-                    server_response->rs_content, 
-                    server_response->rs_content_length);
-        close(proxyfd);
+/*
+ * join_flight - Join the flight fetching the response to the request, as
+ *     flight_join does. A response that can't be cached has no flight, the
+ *     request leads on its own.
+ */
+Flight *
+join_flight(const char *request_line, const char *request_headers,
+            int *leader)
+{
+    size_t key_len;
+    char key[MAX_KEY_LEN];
+
+    if (!(key_len = cache_key(request_line, request_headers, key))) {
+        *leader = 1;
+        return NULL;
+    }
+    return flight_join(key, key_len, leader);
+}
+
+/*
+ * lead_flight - Start a flight for the response to the request if none is
+ *     fetching it, as flight_lead does.
+ */
+Flight *
+lead_flight(const char *request_line, const char *request_headers)
+{
+    size_t key_len;
+    char key[MAX_KEY_LEN];
+
+    if (!(key_len = cache_key(request_line, request_headers, key)))
+        return NULL;
+    return flight_lead(key, key_len);
+}
+
+/*
+ * fetch_cached - Look up the response to the request in the cache. Returns 1
+ *     and fills server_response if a fresh one is there, 0 otherwise. The
+ *     response then points into the cached object, which it holds until
+ *     released with release_response.
+ *
+ *     A hit in the last part of the response's lifetime, or past it while
+ *     its stale-while-revalidate allows, is served as is and the response
+ *     fetched again in the background for the next ones.
+ *
+ *     Any other stale response, or any when the client asks for one
+ *     validated by the server, is only used once the server says it didn't
+ *     change. If it has a validator, it's held in server_response->rs_stale
+ *     for the caller to send the conditional_headers and pass the answer to
+ *     revalidated.
+ */
+int
+fetch_cached(const Request *client_request, Cache *proxy_cache,
+             const char *request_line, const char *request_headers,
+             Response *server_response)
+{
+    time_t now;
+    unsigned long long start;
+    CacheObject *object;
+
+    start = metrics_now();
+    object = cache_fetch(proxy_cache, request_line, request_headers);
+    metrics_record(STAGE_CACHE, start);
+    if (!object)
+        return 0;
+
+    now = time(NULL);
+    if (request_no_cache(request_headers)
+        || (object->expires <= now && (!refresh_enabled()
+            || object->expires + stale_while_revalidate(object) <= now))) {
+        if (find_header(object->response_headers, "etag:")
+            || find_header(object->response_headers, "last-modified:"))
+            server_response->rs_stale = object;
+        else
+            cache_release(object);
+        return 0;
+    }
+
+    if (object->refresh <= now)
+        refresh_queue(client_request->rq_hostname, client_request->rq_port,
+                      request_line, request_headers);
+
+    use_object(server_response, object);
+    if (decode_response(client_request, server_response) < 0) {
+        release_response(server_response);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * refresh_response - Fetch the response to the request from the server
+ *     again and cache it, for a background refresh, asking only for a
+ *     changed one if the cached one has a validator. Returns 0 once it's
+ *     cached anew, -1 if it couldn't be.
+ */
+int
+refresh_response(Cache *proxy_cache, Arena *arena, const char *hostname,
+                 const char *port, const char *request_line,
+                 const char *request_headers)
+{
+    int proxyfd, rc = -1;
+    CacheObject *object;
+    Response server_response;
+    Sio sio;
+
+    memset(&server_response, 0, sizeof(Response));
+    if ((object = cache_fetch(proxy_cache, request_line, request_headers))) {
+        if (find_header(object->response_headers, "etag:")
+            || find_header(object->response_headers, "last-modified:"))
+            server_response.rs_stale = object;
+        else
+            cache_release(object);
+    }
+
+    if ((proxyfd = send_request(hostname, port, request_line, request_headers,
+                                arena, &sio, &server_response)) < 0) {
+        release_response(&server_response);
+        return -1;
+    }
+
+    if (revalidated(proxy_cache, request_line, request_headers,
+                    &server_response)) {
+        rc = 0;
+    } else if (server_response.rs_expires >= 0
+               && read_body(&sio, &server_response) == 0) {
+        cache_response(proxy_cache, request_line, request_headers,
+                       &server_response, server_response.rs_content,
+                       server_response.rs_content_length);
+        rc = 0;
+    }
+
+    /* Only a response read whole leaves the connection reusable */
+    upstream_release(hostname, port, proxyfd, rc == 0
+                     && server_response.rs_keep_alive && sio.sio_cnt == 0);
+    release_response(&server_response);
+    return rc;
+}
+
+/*
+ * conditional_headers - The headers asking the server for the response only
+ *     if it's no longer the one in object, which it answers with a 304. The
+ *     string is to be freed by the caller.
+ */
+char *
+conditional_headers(const CacheObject *object)
+{
+    int n = 0;
+    const char *etag, *last_modified;
+    char *headers;
+
+    etag = find_header(object->response_headers, "etag:");
+    last_modified = find_header(object->response_headers, "last-modified:");
+
+    headers = malloc(strlen(object->response_headers) + 64);
+    headers[0] = '\0';
+    if (etag)
+        n += sprintf(headers + n, "If-None-Match: %.*s\r\n",
+                     (int) strcspn(etag, "\r\n"), etag);
+    if (last_modified)
+        sprintf(headers + n, "If-Modified-Since: %.*s\r\n",
+                (int) strcspn(last_modified, "\r\n"), last_modified);
+
+    return headers;
+}
+
+/*
+ * revalidated - Take the server's answer to the conditional request for the
+ *     stale response held by server_response. On a 304 the stale response is
+ *     still good: its headers are updated with those of the 304, it's cached
+ *     again with its new lifetime, and server_response becomes it, to be
+ *     written to the client with forward_response. Returns 1 if so, else 0
+ *     with the stale response dropped, the server sent one to relay.
+ */
+int
+revalidated(Cache *proxy_cache, const char *request_line,
+            const char *request_headers, Response *server_response)
+{
+    char *p;
+    const char *etag;
+    HttpParser parser;
+    CacheObject *stale = server_response->rs_stale;
+
+    if (!stale)
+        return 0;
+    server_response->rs_stale = NULL;
+    if (server_response->rs_status != 304) {
+        cache_release(stale);
+        return 0;
     }
 
+    p = merge_headers(stale->response_headers, server_response->rs_headers);
+    etag = find_header(stale->response_headers, "etag:");
+    if (etag && !strncmp(etag, "W/", 2))  /* Maybe weakened when recoded */
+        p = weaken_etag(p);
+    free(server_response->rs_line);
+    free(server_response->rs_headers);
+    server_response->rs_line = strdup(stale->response_line);
+    server_response->rs_headers = p;
+    server_response->rs_content = malloc(stale->content_length + 1);
+    memcpy(server_response->rs_content, stale->content,
+           stale->content_length);
+    server_response->rs_content_length = stale->content_length;
+    sscanf(stale->response_line, "%*s %d", &server_response->rs_status);
+
+    /* Work the lifetime out again from the updated headers */
+    memset(&server_response->rs_cc, 0, sizeof(CacheControl));
+    http_parser_init(&parser, HTTP_HEADERS);
+    http_parse(&parser, p, strlen(p));
+    for (int i = 0; i < parser.nheaders; i++)
+        pick_header(p, &parser.headers[i], server_response);
+    server_response->rs_has_length = 1;
+    server_response->rs_expires =
+        response_expiry(request_headers, server_response,
+                        &server_response->rs_refresh);
+
+    cache_response(proxy_cache, request_line, request_headers,
+                   server_response, server_response->rs_content,
+                   server_response->rs_content_length);
+    cache_release(stale);
+    return 1;
+}
+
+/*
+ * cache_response - Cache the response to the request with its content,
+ *     unless it can't be cached. A chunked response is cached decoded, with
+ *     the Content-Length it's served with from the cache.
+ *
+ *     A text body is cached gzipped, once, when it comes out shorter: the
+ *     clients that accept gzip are served that, the others get it inflated
+ *     by decode_response. Its ETag is made weak, the bytes are no longer
+ *     those the server tagged.
+ */
+void
+cache_response(Cache *proxy_cache, const char *request_line,
+               const char *request_headers, const Response *server_response,
+               const void *content, size_t content_length)
+{
+    size_t gzip_len;
+    char *headers = server_response->rs_headers;
+    void *gzip = NULL;
+
+    if (server_response->rs_expires < 0)
+        return;
+
+    if (is_compressible(server_response, content_length)
+        && (gzip = gzip_compress(content, content_length, &gzip_len))) {
+        headers = body_headers(server_response->rs_headers, 1, gzip_len);
+        headers = weaken_etag(headers);
+        content = gzip;
+        content_length = gzip_len;
+    } else if (!server_response->rs_has_length) {
+        headers = body_headers(server_response->rs_headers, 0,
+                               content_length);
+    }
+
+    cache_write(proxy_cache, request_line, request_headers,
+                server_response->rs_line, headers, content, content_length,
+                server_response->rs_refresh, server_response->rs_expires);
+
+    if (headers != server_response->rs_headers)
+        free(headers);
+    free(gzip);
+}
+
+/*
+ * release_response - Free what server_response holds, or give back the
+ *     cached object it points into.
+ */
+void
+release_response(Response *server_response)
+{
+    if (server_response->rs_stale)
+        cache_release(server_response->rs_stale);
+    if (server_response->rs_object) {
+        cache_release(server_response->rs_object);
+    } else {
+        free(server_response->rs_content);
+        free(server_response->rs_headers);
+        free(server_response->rs_line);
+    }
+
+    server_response->rs_object = server_response->rs_stale = NULL;
+    server_response->rs_content = NULL;
+    server_response->rs_headers = server_response->rs_line = NULL;
+}
+
+/*
+ * decode_response - Inflate the cached response held by server_response if
+ *     it's gzipped and the client doesn't accept gzip. The response then
+ *     holds its own copy, with the plain body, its length and a weak ETag.
+ *     A cached body may inflate to as much as deflate can shrink, so only a
+ *     corrupt one fails to, and -1 is returned.
+ */
+int
+decode_response(const Request *client_request, Response *server_response)
+{
+    size_t len;
+    char *content, *headers, *line;
+
+    if (client_request->rq_gzip || !is_gzipped(server_response->rs_headers))
+        return 0;
+
+    if (!(content = gzip_inflate(server_response->rs_content,
+                                 server_response->rs_content_length,
+                                 server_response->rs_content_length
+                                 * GZIP_MAX_RATIO, &len)))
+        return -1;
+    headers = body_headers(server_response->rs_headers, 0, len);
+    headers = weaken_etag(headers);
+    line = strdup(server_response->rs_line);
+
+    release_response(server_response);
+    server_response->rs_line = line;
+    server_response->rs_headers = headers;
+    server_response->rs_content = content;
+    server_response->rs_content_length = len;
+    server_response->rs_has_length = 1;
     return 0;
 }
 
+/*
+ * metrics_response - Fill server_response with the proxy's metrics, for a
+ *     request of METRICS_PATH.
+ */
+void
+metrics_response(Cache *proxy_cache, Response *server_response)
+{
+    size_t len = 0;
+    char *headers;
+
+    server_response->rs_content = metrics_render(proxy_cache, &len);
+    server_response->rs_content_length = server_response->rs_content ?
+                                         len : 0;
+    server_response->rs_line = strdup("HTTP/1.1 200 OK\r\n");
+    headers = malloc(128);
+    sprintf(headers, "Content-Type: text/plain; version=0.0.4\r\n"
+                     "Cache-Control: no-store\r\n"
+                     "Content-Length: %zu\r\n",
+            server_response->rs_content_length);
+    server_response->rs_headers = headers;
+    server_response->rs_has_length = 1;
+    server_response->rs_status = 200;
+}
+
+/*
+ * forward_response - Send the whole response to the client in one write, a
+ *     large cached body straight from the cache: the object is held by the
+ *     write until the kernel is done with it.
+ */
 int
-forward_response(int clientfd, const Response *server_response)
+forward_response(int clientfd, const Response *server_response,
+                 int keep_alive)
 {
-    if (sio_writen(clientfd, server_response->rs_line,
-                strlen(server_response->rs_line)) < 0)
+    ssize_t rc;
+    unsigned long long start = metrics_now();
+    struct iovec iov[HEAD_IOVCNT + 1];
+    int iovcnt = response_head(iov, server_response, keep_alive, 0);
+
+    iov[iovcnt].iov_base = server_response->rs_content;
+    iov[iovcnt++].iov_len = server_response->rs_content_length;
+    if (server_response->rs_object) {
+        cache_retain(server_response->rs_object);
+        rc = sio_writev_held(clientfd, iov, iovcnt, release_object,
+                             server_response->rs_object);
+    } else {
+        rc = sio_writev(clientfd, iov, iovcnt);
+    }
+    if (rc < 0)
         return -1;
-    if (sio_writen(clientfd, server_response->rs_headers,
-                strlen(server_response->rs_headers)) < 0)
+
+    metrics_record(STAGE_RESPONSE, start);
+    return 0;
+}
+
+/*
+ * response_keep_alive - The client connection stays open after the response
+ *     if the client asked for it and the end of the body is known to it,
+ *     from its length or its last chunk.
+ */
+int
+response_keep_alive(const Request *client_request,
+                    const Response *server_response)
+{
+    return client_request->rq_keep_alive
+           && (server_response->rs_has_length
+               || response_chunked(client_request, server_response));
+}
+
+/*
+ * response_chunked - The body is sent to the client in chunks: its length
+ *     isn't known before it's all there, and the client takes them. An
+ *     HTTP/1.0 client gets it up to the connection close instead.
+ */
+int
+response_chunked(const Request *client_request,
+                 const Response *server_response)
+{
+    return !server_response->rs_has_length && client_request->rq_http11;
+}
+
+/*
+ * response_head - Point iov to the response line and headers to send to the
+ *     client, ending with the proxy's own Transfer-Encoding if the body is
+ *     chunked, Connection header and the empty line. Returns the number of
+ *     buffers, HEAD_IOVCNT.
+ */
+int
+response_head(struct iovec *iov, const Response *server_response,
+              int keep_alive, int chunked)
+{
+    const char *end;
+
+    if (chunked)
+        end = keep_alive ? chunked_keep_alive_end : chunked_close_end;
+    else
+        end = keep_alive ? keep_alive_end : close_end;
+
+    iov[0].iov_base = server_response->rs_line;
+    iov[0].iov_len = strlen(server_response->rs_line);
+    iov[1].iov_base = server_response->rs_headers;
+    iov[1].iov_len = strlen(server_response->rs_headers);
+    iov[2].iov_base = (char *) end;
+    iov[2].iov_len = strlen(end);
+
+    return HEAD_IOVCNT;
+}
+
+/*
+ * parse_response_head - Take server_response from the response head parsed
+ *     into buf, the answer to a request with request_headers. Returns -1 if
+ *     it isn't an HTTP response.
+ */
+int
+parse_response_head(const char *buf, const HttpParser *parser,
+                    const char *request_headers, Response *server_response)
+{
+    if (parser->version.len < 5
+        || memcmp(buf + parser->version.off, "HTTP/", 5))
         return -1;
-    if (sio_writen(clientfd, server_response->rs_content,
-                server_response->rs_content_length) < 0)
+
+    parse_response_line(buf, parser, server_response);
+    server_response->rs_headers = parse_response_headers(buf, parser,
+                                                         server_response);
+    finish_head(request_headers, server_response);
+    server_response->rs_line = strndup(buf + parser->start_line.off,
+                                       parser->start_line.len);
+
+    return 0;
+}
+
+/*
+ * stage_init - Start staging the body of server_response for the cache. The
+ *     staged object may take at most MAX_OBJECT_SIZE bytes, its line and
+ *     headers included, and nothing is staged for a response that can't be
+ *     cached.
+ */
+void
+stage_init(Stage *stage, const Response *server_response)
+{
+    size_t head_size;
+
+    head_size = strlen(server_response->rs_line)
+                + strlen(server_response->rs_headers);
+
+    stage->buf = NULL;
+    stage->len = stage->size = 0;
+    stage->max = head_size < MAX_OBJECT_SIZE ? MAX_OBJECT_SIZE - head_size : 0;
+    stage->abandoned = server_response->rs_content_length > stage->max
+                       || server_response->rs_expires < 0;
+}
+
+/*
+ * stage_append - Append n body bytes to the staging buffer, growing it as
+ *     needed. Once the body goes over the limit the buffer is released and
+ *     staging abandoned, returns -1 from then on.
+ */
+int
+stage_append(Stage *stage, const void *buf, size_t n)
+{
+    size_t size;
+
+    if (stage->abandoned)
+        return -1;
+    if (n == 0)
+        return 0;
+
+    if (stage->len + n > stage->max) {
+        stage_free(stage);
+        stage->abandoned = 1;
         return -1;
-    
+    }
+
+    if (stage->len + n > stage->size) {
+        for (size = stage->size ? stage->size : RELAY_BUFSIZE;
+             size < stage->len + n; size *= 2)
+            ;
+        if (size > stage->max)
+            size = stage->max;
+        stage->buf = realloc(stage->buf, size);
+        stage->size = size;
+    }
+
+    memcpy(stage->buf + stage->len, buf, n);
+    stage->len += n;
     return 0;
 }
 
+void
+stage_free(Stage *stage)
+{
+    free(stage->buf);
+    stage->buf = NULL;
+    stage->len = stage->size = 0;
+}
+
+/*
+ * relay_account, relay_stats - Count the response body bytes relayed to the
+ *     clients, copied through user space or spliced, and take a snapshot of
+ *     the counters.
+ */
+void
+relay_account(size_t n, int spliced)
+{
+    atomic_fetch_add_explicit(spliced ? &relay_spliced : &relay_copied, n,
+                              memory_order_relaxed);
+}
+
+void
+relay_stats(RelayStats *stats)
+{
+    stats->copied = atomic_load(&relay_copied);
+    stats->spliced = atomic_load(&relay_spliced);
+}
+
+/*
+ * build_request - Build the request line and headers sent to the server for
+ *     client_request, in arena. They also form the cache key of the
+ *     response.
+ */
+void
+build_request(const Request *client_request, Arena *arena,
+              char **request_line, char **request_headers)
+{
+    *request_line = build_request_line(client_request, arena);
+    *request_headers = build_request_headers(client_request, arena);
+}
+
+/*
+ * read_head - Read the head of a message from sio into *head, a line at a
+ *     time so that nothing past it is taken from sio, and parse it as it
+ *     comes. The head is allocated from arena, and grown as it comes too.
+ *     Returns 1 once it's complete, 0 if the connection was closed before,
+ *     or -1 if it's malformed or larger than MAX_BUF.
+ */
 static int
-parse_request_line(Sio *sio, char *method, char *url)
+read_head(Sio *sio, Arena *arena, char **head, HttpParser *parser,
+          unsigned long long *start)
 {
-    char request_line[MAX_LINE], version[VERSION_LEN];
+    int rc;
+    ssize_t n;
+    size_t len = 0, size = HEAD_SIZE;
+    const char *line;
 
-    if (sio_read_line(sio, request_line, MAX_LINE) < 0)
-        return -1;
+    *head = arena_alloc(arena, size);
+    do {
+        if ((n = sio_read_span(sio, &line)) <= 0)
+            return 0;
+        if (start && !len)
+            *start = metrics_now();
+        if (len + n > size) {
+            if (len + n > MAX_BUF)
+                return -1;
+            while (size < len + n)
+                size *= 2;
+            *head = arena_grow(arena, *head, len, size);
+        }
+        memcpy(*head + len, line, n);
+        len += n;
+    } while ((rc = http_parse(parser, *head, len)) == 0);
 
+    return rc;
+}
 
-    if (sscanf(request_line, "%s %s %s", method, url, version) != 3) {
-        client_error(sio->sio_fd, request_line, "400", "bad request",
+/*
+ * parse_request_line - Check the method and version of the request. An
+ *     HTTP/1.1 client keeps the connection open unless told otherwise by its
+ *     headers, an HTTP/1.0 one only when asking for it.
+ */
+static int
+parse_request_line(int clientfd, const char *buf, const HttpParser *parser,
+                   int *keep_alive)
+{
+    char cause[MAX_LINE];
+
+    if (!parser->method.len || !parser->target.len || !parser->version.len) {
+        copy_value(buf, parser->start_line, cause);
+        client_error(clientfd, cause, "400", "bad request",
         "the server can't understand this request");
         return -1;
     }
 
-    if (strcmp(method, "GET")) {
-        client_error(sio->sio_fd, method, "501", "not implemented", 
+    if (!http_span_is(buf, parser->method, "GET")) {
+        copy_value(buf, parser->method, cause);
+        client_error(clientfd, cause, "501", "not implemented", 
         "the server doesn't implement this method");
         return -1;
     }
 
-    if (strcmp(version, "HTTP/1.0") && strcmp(version, "HTTP/1.1")) {
-        client_error(sio->sio_fd, version, "505", "not supported", 
+    if (!http_span_is(buf, parser->version, "HTTP/1.0")
+        && !http_span_is(buf, parser->version, "HTTP/1.1")) {
+        copy_value(buf, parser->version, cause);
+        client_error(clientfd, cause, "505", "not supported", 
         "the server doesn't support this HTTP version");
         return -1;
     }
-    
+
+    *keep_alive = http_span_is(buf, parser->version, "HTTP/1.1");
     return 0;
 }
 
+/*
+ * asks_for_metrics - The request is for METRICS_PATH on the proxy itself:
+ *     in origin form with no Host header, or with the url or the Host
+ *     header naming the proxy. The same path of any other host is forwarded.
+ */
 static int
-parse_request_headers(Sio *sio, char *request_headers, char *hostname)
+asks_for_metrics(int clientfd, const char *buf, const HttpParser *parser)
 {
-    ssize_t nread = MAX_BUF - DEFAULT_HEADERS_SIZE;
-    char linebuf[MAX_LINE], hostnamebuf[MAX_LINE];
+    char hostname[MAX_LINE], port[PORT_LEN], path[MAX_LINE];
+    const HttpHeader *header;
+
+    if (parse_url(buf + parser->target.off, parser->target.len, hostname,
+                  port, path) < 0
+        || strcmp(path, METRICS_PATH))
+        return 0;
+
+    if (!hostname[0]) {
+        for (int i = 0; i < parser->nheaders; i++) {
+            header = &parser->headers[i];
+            if (header->id != HDR_HOST)
+                continue;
+            if (split_host(buf + header->value.off, header->value.len,
+                           hostname, port) < 0)
+                return 0;
+            break;
+        }
+        if (!hostname[0])           /* Only the proxy can be meant */
+            return 1;
+    }
 
-    /* Initialize request_headers to be ready for appending (concatination) */
-    request_headers[0] = '\0';
-    do {
-        if (sio_read_line(sio, linebuf, MAX_LINE) < 0)
-            return -1;
+    return is_proxy_address(clientfd, hostname, port);
+}
+
+/*
+ * is_proxy_address - hostname and port name the proxy as the client reached
+ *     it: the port it connected to, on the address it connected to, on
+ *     localhost or on the machine's name.
+ */
+static int
+is_proxy_address(int clientfd, const char *hostname, const char *port)
+{
+    char local_host[NI_MAXHOST], local_port[NI_MAXSERV];
+    char name[HOST_NAME_MAX + 1];
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(clientfd, (struct sockaddr *) &addr, &len) < 0
+        || getnameinfo((struct sockaddr *) &addr, len, local_host,
+                       sizeof(local_host), local_port, sizeof(local_port),
+                       NI_NUMERICHOST | NI_NUMERICSERV) != 0
+        || strcmp(port, local_port))
+        return 0;
+
+    return !strcasecmp(hostname, "localhost")
+           || !strcasecmp(hostname, local_host)
+           || (gethostname(name, sizeof(name)) == 0
+               && !strcasecmp(hostname, name));
+}
 
-        if (sscanf(linebuf, "Host: %s", hostnamebuf) == 1)
-            strcpy(hostname, hostnamebuf);
+/*
+ * parse_request_headers - Set the client's header lines passed on to the
+ *     server, ending with the empty line. The Host header only gives the
+ *     host of a url that has none, the proxy sends its own, and the
+ *     hop-by-hop headers are left out, their connection option noted in
+ *     keep_alive. Returns -1, with the client answered, if the host is
+ *     unknown, the headers too large to forward or the request has a body:
+ *     the proxy never reads one, it would be taken for the next request.
+ */
+static int
+parse_request_headers(int clientfd, const char *buf,
+                      const HttpParser *parser, Arena *arena,
+                      Request *client_request, int *keep_alive)
+{
+    char *headers, *p;
+    const HttpHeader *header;
+
+    headers = p = arena_alloc(arena, parser->head_len + 3);
+    for (int i = 0; i < parser->nheaders; i++) {
+        header = &parser->headers[i];
+        if (header->id == HDR_HOST) {
+            if (!client_request->rq_hostname[0]) {
+                client_request->rq_hostname =
+                    arena_alloc(arena, header->value.len + 1);
+                split_host(buf + header->value.off, header->value.len,
+                           client_request->rq_hostname,
+                           client_request->rq_port);
+            }
+            continue;
+        }
+        if (header->id == HDR_TRANSFER_ENCODING
+            || (header->id == HDR_CONTENT_LENGTH
+                && !is_zero(buf, header->value))) {
+            client_error(clientfd, "body", "400", "bad request",
+                         "the proxy doesn't take a body with a GET");
+            return -1;
+        }
+        if (header->id == HDR_CONTENT_LENGTH)   /* Of no body, none is sent */
+            continue;
+        if (header->id == HDR_ACCEPT_ENCODING)
+            client_request->rq_gzip = accepts_gzip(buf, header->value);
+        if (is_hop_by_hop(header->id)) {
+            connection_option(buf, header, keep_alive);
+            continue;
+        }
+        memcpy(p, buf + header->line.off, header->line.len);
+        p += header->line.len;
+    }
+    p = stpcpy(p, "\r\n");
 
-        strncat(request_headers, linebuf, nread);
-        nread -= strlen(linebuf);
-    } while (strcmp(linebuf, "\r\n") && nread > 0);
+    if (!client_request->rq_hostname[0]) {
+        client_error(clientfd, "Host", "400", "bad request",
+                     "the request names no host");
+        return -1;
+    }
 
+    if (p - headers + strlen(client_request->rq_hostname)
+        + DEFAULT_HEADERS_SIZE > MAX_BUF) {
+        client_error(clientfd, "headers", "431",
+                     "request header fields too large",
+                     "the request headers are too large to forward");
+        return -1;
+    }
 
+    client_request->rq_headers = headers;
     return 0;
 }
 
+/*
+ * connection_option - Pick up a close or keep-alive option from a Connection
+ *     or Proxy-Connection header.
+ */
 static void
-parse_url(const char *url, char *hostname, char *port, char *path)
-{
-    char *url_copy, *url_token;
-
-    url_copy = strdup(url);
-    url_token = url_copy;
-
-    /* Skip the "http://" part of the url */
-    url_token = strstr(url, "://");
-    url_token += 3;
-
-    if (strstr(url_token, ":")) {     /* Port is contained in the url */
-        /* Url token points to the hostname */
-        url_token = strtok(url_token, ":");
-        strcpy(hostname, url_token);
-        
-        /* Move url token to the port and path token */
-        url_token = strtok(NULL, ":");
-
-        if (strstr(url_token, "/")) {   /* Path is contained in the url */
-            /* Parse the port from url_token */
-            url_token = strtok(url_token, "/");  
-            strcpy(port, url_token);
-
-            /* Parse the path from url_token */
-            url_token = strtok(NULL, "/");
-            strcpy(path, url_token);
-        } else {                        /* Path is not contained in the url */
-            strcpy(port, url_token);
-            strcpy(path, "/");  /* Set path to default */
-        }
+connection_option(const char *buf, const HttpHeader *header,
+                  int *keep_alive)
+{
+    if (header->id == HDR_KEEP_ALIVE)
+        return;
 
-    } else {    /* Port is not contained in the url */
-        strcpy(port, "80");     /* Set port to default */
+    if (http_span_has(buf, header->value, "close"))
+        *keep_alive = 0;
+    else if (http_span_has(buf, header->value, "keep-alive"))
+        *keep_alive = 1;
+}
 
-        url_token = strtok(url_token, "/");
-        strcpy(hostname, url_token);
+/*
+ * is_zero - The value is a number that's 0, such as a Content-Length.
+ */
+static int
+is_zero(const char *buf, HttpSpan value)
+{
+    if (!value.len)
+        return 0;
 
-        url_token = strtok(NULL, "/");
+    for (unsigned i = 0; i < value.len; i++) {
+        if (buf[value.off + i] != '0')
+            return 0;
+    }
+    return 1;
+}
 
-        if (url_token)          /* Path is contained in the url */
-            strcpy(path, url_token);
-        else                    /* Path is not contained in the url */
-         strcpy(path, "/");     /* Path is set to default */
+/*
+ * accepts_gzip - The Accept-Encoding value lists gzip, or any coding, with
+ *     a weight that isn't 0.
+ */
+static int
+accepts_gzip(const char *buf, HttpSpan value)
+{
+    size_t n;
+    double weight;
+    const char *q;
+    char *coding, *save, valuebuf[MAX_LINE];
+
+    copy_value(buf, value, valuebuf);
+    for (coding = strtok_r(valuebuf, ",", &save); coding;
+         coding = strtok_r(NULL, ",", &save)) {
+        coding += strspn(coding, " \t");
+        n = strcspn(coding, " \t;");
+        if (!(n == 4 && !strncasecmp(coding, "gzip", 4))
+            && !(n == 6 && !strncasecmp(coding, "x-gzip", 6))
+            && !(n == 1 && *coding == '*'))
+            continue;
+
+        if ((q = strcasestr(coding + n, "q="))
+            && sscanf(q + 2, "%lf", &weight) == 1)
+            return weight > 0;
+        return 1;
     }
-    free(url_copy);
+
+    return 0;
 }
 
-static void
-build_request_line(const Request *client_request, char *request_line)
+/*
+ * parse_url - Split an absolute url into its host, port and path, the whole
+ *     path with its query. A url of the origin form, a path only, leaves the
+ *     hostname empty for the Host header to give. Returns -1 if it's neither,
+ *     or too long for the request line sent to the server.
+ */
+static int
+parse_url(const char *url, size_t len, char *hostname, char *port,
+          char *path)
 {
-    request_line[0] = '\0';
+    const char *host, *end = url + len;
 
-    strcat(request_line, client_request->rq_method);
-    strcat(request_line, " ");
+    hostname[0] = '\0';
+    strcpy(port, "80");
 
-    strcat(request_line, client_request->rq_uri);
-    strcat(request_line, " ");
+    if (len > 7 && !strncasecmp(url, "http://", 7)) {
+        for (host = url += 7; url < end && *url != '/' && *url != '?'; url++)
+            ;
+        if (split_host(host, url - host, hostname, port) < 0)
+            return -1;
+    } else if (!len || url[0] != '/') {
+        return -1;
+    }
 
-    strcat(request_line, "HTTP/1.0\r\n");
+    /* Room is left for the method and version around it */
+    if (end - url > MAX_LINE - METHOD_LEN - VERSION_LEN - 4)
+        return -1;
+
+    if (url == end || *url == '?')
+        *path++ = '/';
+    memcpy(path, url, end - url);
+    path[end - url] = '\0';
+
+    return 0;
 }
 
-static void
-build_request_headers(const Request *client_request, char *request_headers)
+/*
+ * split_host - Split a host as in a url or a Host header into its name and
+ *     port, if it has one. An IPv6 address is in brackets, left out of
+ *     hostname. Returns -1 if the name is empty or the port not a number.
+ */
+static int
+split_host(const char *host, size_t len, char *hostname, char *port)
+{
+    const char *end = host + len, *name_end, *colon;
+
+    if (len && host[0] == '[') {
+        if (!(name_end = memchr(host, ']', len)))
+            return -1;
+        colon = name_end + 1 < end ? name_end + 1 : NULL;
+        if (colon && *colon != ':')
+            return -1;
+        host++;
+    } else {
+        colon = memrchr(host, ':', len);
+        name_end = colon ? colon : end;
+    }
+
+    if (name_end == host || name_end - host >= MAX_LINE)
+        return -1;
+
+    /* An empty port is the default one */
+    if (colon && ++colon < end) {
+        if (end - colon >= PORT_LEN)
+            return -1;
+        for (const char *p = colon; p < end; p++) {
+            if (!isdigit((unsigned char) *p))
+                return -1;
+        }
+        memcpy(port, colon, end - colon);
+        port[end - colon] = '\0';
+    }
+
+    memcpy(hostname, host, name_end - host);
+    hostname[name_end - host] = '\0';
+    return 0;
+}
+
+static char *
+build_request_line(const Request *client_request, Arena *arena)
 {
-    char linebuf[MAX_LINE];
+    char *request_line;
 
-    request_headers[0] = '\0';
+    request_line = arena_alloc(arena, strlen(client_request->rq_method)
+                                      + strlen(client_request->rq_uri) + 12);
+    sprintf(request_line, "%s %s HTTP/1.1\r\n", client_request->rq_method,
+            client_request->rq_uri);
+    return request_line;
+}
 
-    /* append host request header if not appended */
-    if (!strstr(client_request->rq_headers, "Host")) {
-        sprintf(linebuf, "Host: %s\r\n", client_request->rq_hostname);
-        strcat(request_headers, linebuf);
+/*
+ * build_request_headers - The proxy's own Host and connection headers, then
+ *     the client's. The port is only given when it isn't the default one.
+ */
+static char *
+build_request_headers(const Request *client_request, Arena *arena)
+{
+    char *request_headers, *p;
+    const char *hostname = client_request->rq_hostname;
+
+    request_headers = p = arena_alloc(arena, strlen(hostname)
+                                      + strlen(client_request->rq_headers)
+                                      + DEFAULT_HEADERS_SIZE);
+
+    /* An IPv6 address is put back in its brackets */
+    p += sprintf(p, strchr(hostname, ':') ? "Host: [%s]" : "Host: %s",
+                 hostname);
+    if (strcmp(client_request->rq_port, "80"))
+        p += sprintf(p, ":%s", client_request->rq_port);
+    p = stpcpy(p, "\r\n");
+
+    p = stpcpy(p, usr_agent_header);
+    if (upstream_enabled()) {
+        p = stpcpy(p, keep_alive_header);
+    } else {
+        p = stpcpy(p, connection_header);
+        p = stpcpy(p, proxy_connection_header);
     }
+    strcpy(p, client_request->rq_headers);
+    return request_headers;
+}
 
-    strcat(request_headers, usr_agent_header);
-    strcat(request_headers, connection_header);
-    strcat(request_headers, proxy_connection_header);
-    strcat(request_headers, client_request->rq_headers);
-    
+/*
+ * parse_response - Read and parse the head of the server's response. The
+ *     interim 1xx responses an HTTP/1.1 server may send first are skipped.
+ */
+static int
+parse_response(Sio *sio, Arena *arena, const char *request_headers,
+               Response *server_response)
+{
+    char *head;
+    HttpParser parser;
+
+    do {
+        http_parser_init(&parser, HTTP_RESPONSE);
+        if (read_head(sio, arena, &head, &parser, NULL) <= 0)
+            return -1;
+    } while (parser.status >= 100 && parser.status < 200);
+
+    return parse_response_head(head, &parser, request_headers,
+                               server_response);
 }
 
+/*
+ * send_request - Send the request to the server, on a pooled connection if
+ *     there's one, and parse the response head. A stale response held by
+ *     server_response is asked for only if it changed. Returns the
+ *     connection to the server, or -1 on error.
+ */
 static int
-parse_response(int proxyfd, Response *server_response)
+send_request(const char *hostname, const char *port,
+             const char *request_line, const char *request_headers,
+             Arena *arena, Sio *sio, Response *server_response)
 {
-    Sio sio;
-    char response_line[MAX_LINE], response_headers[MAX_BUF];
+    int proxyfd, reused;
+    unsigned long long start;
+    char *conditional;
+    struct iovec iov[3];
+
+    conditional = server_response->rs_stale ?
+                  conditional_headers(server_response->rs_stale) : strdup("");
+
+    while (1) {
+        proxyfd = upstream_take(hostname, port);
+        start = metrics_now();
+        if (!(reused = proxyfd >= 0)
+            && (proxyfd = open_clientfd((char *) hostname,
+                                        (char *) port)) < 0) {
+            free(conditional);
+            return -1;
+        }
+        if (!reused)
+            metrics_record(STAGE_CONNECT, start);
+
+        sio_initbuf(sio, proxyfd);
+        iov[0].iov_base = (char *) request_line;
+        iov[0].iov_len = strlen(request_line);
+        iov[1].iov_base = conditional;
+        iov[1].iov_len = strlen(conditional);
+        iov[2].iov_base = (char *) request_headers;
+        iov[2].iov_len = strlen(request_headers);
+        if (sio_writev(proxyfd, iov, 3) >= 0) {
+            start = metrics_now();
+            if (parse_response(sio, arena, request_headers,
+                               server_response) >= 0) {
+                metrics_record(STAGE_ORIGIN, start);
+                break;
+            }
+        }
+
+        close(proxyfd);
+        /* 
+         * A pooled connection may have been closed by the server just before
+         * being used, try again on another one
+         */
+        if (!reused) {
+            free(conditional);
+            return -1;
+        }
+    }
+    free(conditional);
 
-    sio_initbuf(&sio, proxyfd);
+    return proxyfd;
+}
 
-    /* parse response line */
-    if (sio_read_line(&sio, response_line, MAX_LINE) < 0)
+/*
+ * fetch_response - Get the response from the server and relay it to the
+ *     client. The flight led, if any, is ended as soon as the response is
+ *     known not to be cached.
+ */
+static int
+fetch_response(int clientfd, const Request *client_request,
+               Cache *proxy_cache, Arena *arena, const char *request_line,
+               const char *request_headers, Response *server_response,
+               Flight **flight)
+{
+    int proxyfd, rc;
+    unsigned long long start;
+    Sio sio;
+
+    if ((proxyfd = send_request(client_request->rq_hostname,
+                                client_request->rq_port, request_line,
+                                request_headers, arena, &sio,
+                                server_response)) < 0)
         return -1;
 
-    /*parse response headers */
-    if (parse_response_headers(&sio, response_headers,
-                &server_response->rs_content_length) < 0)
+    if (revalidated(proxy_cache, request_line, request_headers,
+                    server_response)) {
+        /* A 304 has no body, the connection is at a response boundary */
+        upstream_release(client_request->rq_hostname, client_request->rq_port,
+                         proxyfd, server_response->rs_keep_alive
+                         && sio.sio_cnt == 0);
+        if (decode_response(client_request, server_response) < 0)
+            return -1;
+        return forward_response(clientfd, server_response,
+                                response_keep_alive(client_request,
+                                                    server_response));
+    }
+
+    /* The followers needn't wait for a response that won't be cached */
+    if (*flight && (server_response->rs_expires < 0
+                    || server_response->rs_content_length > MAX_OBJECT_SIZE)) {
+        flight_done(*flight);
+        *flight = NULL;
+    }
+
+    start = metrics_now();
+    rc = relay_response(&sio, clientfd, proxy_cache, request_line,
+                        request_headers, client_request, server_response);
+    if (rc == 0)
+        metrics_record(STAGE_RESPONSE, start);
+
+    /* Only a connection left at a response boundary can be reused */
+    upstream_release(client_request->rq_hostname, client_request->rq_port,
+                     proxyfd, rc == 0 && server_response->rs_keep_alive
+                     && (server_response->rs_has_length
+                         || server_response->rs_chunked)
+                     && sio.sio_cnt == 0);
+    return rc;
+}
+
+/*
+ * relay_response - Send the response line and headers to the client along
+ *     with the part of the body that came with them, then relay the rest in
+ *     RELAY_BUFSIZE chunks as they come from the server.
+ *     The body is teed into a staging buffer while the object still fits in
+ *     a cache line, and cached once it's complete.
+ */
+static int
+relay_response(Sio *sio, int clientfd, Cache *proxy_cache,
+               const char *request_line, const char *request_headers,
+               const Request *client_request, Response *server_response)
+{
+    int pipefd[2];
+    ssize_t n;
+    size_t nleft;
+    char chunk[RELAY_BUFSIZE];
+    const char *body;
+    struct iovec iov[HEAD_IOVCNT + 1];
+    int iovcnt;
+    Stage stage;
+
+    if (!server_response->rs_has_length)
+        return relay_chunked(sio, clientfd, proxy_cache, request_line,
+                             request_headers, client_request,
+                             server_response);
+
+    iovcnt = response_head(iov, server_response,
+                           response_keep_alive(client_request,
+                                               server_response), 0);
+
+    nleft = server_response->rs_content_length;
+    n = sio_take(sio, &body, nleft);
+    iov[iovcnt].iov_base = (char *) body;
+    iov[iovcnt++].iov_len = n;
+    if (sio_writev(clientfd, iov, iovcnt) < 0)
         return -1;
-    
-    /* parse response content */
-    server_response->rs_content = malloc(server_response->rs_content_length);
-    if (sio_readn(&sio, server_response->rs_content,
-                server_response->rs_content_length) < 0)
+
+    stage_init(&stage, server_response);
+    relay_account(n, 0);
+    server_response->rs_body_sent += n;
+    stage_append(&stage, body, n);
+    nleft -= n;
+    while (nleft > 0) {
+        /* 
+         * The object won't be cached: once the bytes buffered by sio are out,
+         * move the rest of the body from socket to socket without copying it
+         */
+        if (stage.abandoned && sio->sio_cnt <= 0 && pipe(pipefd) == 0) {
+            n = sio_splice(sio->sio_fd, clientfd, pipefd, nleft);
+            close(pipefd[0]);
+            close(pipefd[1]);
+            if (n > 0) {
+                relay_account(n, 1);
+                server_response->rs_body_sent += n;
+            }
+            if (n < 0 || (size_t) n < nleft)
+                return -1;
+            break;
+        }
+
+        n = sio_read_some(sio, chunk, 
+                          nleft < RELAY_BUFSIZE ? nleft : RELAY_BUFSIZE);
+        if (n <= 0 || sio_writen(clientfd, chunk, n) < 0) {
+            stage_free(&stage);
+            return -1;
+        }
+        relay_account(n, 0);
+        server_response->rs_body_sent += n;
+        stage_append(&stage, chunk, n);
+        nleft -= n;
+    }
+
+    if (!stage.abandoned)
+        cache_response(proxy_cache, request_line, request_headers,
+                       server_response, stage.buf, stage.len);
+    stage_free(&stage);
+
+    return 0;
+}
+
+/*
+ * relay_chunked - Relay a body of unknown length, chunked by the server or
+ *     ended by it closing the connection. A chunked body is decoded as it
+ *     comes, a RELAY_BUFSIZE read at a time, and each read passed on as a
+ *     chunk of its own to a client that takes them, or as is otherwise.
+ *     Only a chunked body is staged for the cache, response_expiry leaves
+ *     the other out as its end isn't known for sure.
+ */
+static int
+relay_chunked(Sio *sio, int clientfd, Cache *proxy_cache,
+              const char *request_line, const char *request_headers,
+              const Request *client_request, Response *server_response)
+{
+    ssize_t n, nread;
+    size_t used;
+    int iovcnt, done = 0;
+    int chunked = response_chunked(client_request, server_response);
+    char chunk[RELAY_BUFSIZE], size_line[CHUNK_LINE_SIZE];
+    struct iovec iov[HEAD_IOVCNT + CHUNK_IOVCNT + 1];
+    ChunkDecoder decoder;
+    Stage stage;
+
+    iovcnt = response_head(iov, server_response,
+                           response_keep_alive(client_request,
+                                               server_response), chunked);
+
+    /* The head goes along with the first bytes only if they're there */
+    if (sio->sio_cnt <= 0) {
+        if (sio_writev(clientfd, iov, iovcnt) < 0)
+            return -1;
+        iovcnt = 0;
+    }
+
+    chunk_decoder_init(&decoder);
+    stage_init(&stage, server_response);
+    while (!done) {
+        if ((n = nread = sio_read_some(sio, chunk, RELAY_BUFSIZE)) < 0)
+            goto fail;
+        if (n == 0) {
+            /* The server closed the connection, that's the end unless chunked */
+            if (server_response->rs_chunked)
+                goto fail;
+            done = 1;
+        } else if (server_response->rs_chunked) {
+            if ((n = chunk_decode(&decoder, chunk, nread, &used)) < 0)
+                goto fail;
+            /* What the server sent past the body leaves it mid-response */
+            if ((done = chunk_done(&decoder))
+                && (used < (size_t) nread || sio->sio_cnt > 0))
+                server_response->rs_keep_alive = 0;
+        }
+
+        if (chunked) {
+            iovcnt += chunk_encode(iov + iovcnt, size_line, chunk, n);
+        } else {
+            iov[iovcnt].iov_base = chunk;
+            iov[iovcnt++].iov_len = n;
+        }
+        if (done && chunked) {
+            iov[iovcnt].iov_base = CHUNK_LAST;
+            iov[iovcnt++].iov_len = strlen(CHUNK_LAST);
+        }
+        if (sio_writev(clientfd, iov, iovcnt) < 0)
+            goto fail;
+        iovcnt = 0;
+
+        relay_account(n, 0);
+        server_response->rs_body_sent += n;
+        stage_append(&stage, chunk, n);
+    }
+
+    if (!stage.abandoned)
+        cache_response(proxy_cache, request_line, request_headers,
+                       server_response, stage.buf, stage.len);
+    stage_free(&stage);
+    return 0;
+
+fail:
+    stage_free(&stage);
+    return -1;
+}
+
+/*
+ * read_body - Read the whole body of the response into its content, for a
+ *     background refresh, decoded if chunked. Returns -1 if it's too large
+ *     for a cache object, of unknown length, or not all there.
+ */
+static int
+read_body(Sio *sio, Response *server_response)
+{
+    ssize_t n, nread;
+    size_t used, length = server_response->rs_content_length;
+    char chunk[RELAY_BUFSIZE];
+    ChunkDecoder decoder;
+    Stage stage;
+
+    if (server_response->rs_has_length) {
+        if (length > MAX_OBJECT_SIZE)
+            return -1;
+        server_response->rs_content = malloc(length + 1);
+        return sio_readn(sio, server_response->rs_content, length)
+               == (ssize_t) length ? 0 : -1;
+    }
+    if (!server_response->rs_chunked)
         return -1;
-        
-    /* allocate for the data */
-    server_response->rs_line = strdup(response_line);
-    server_response->rs_headers = strdup(response_headers);
 
+    chunk_decoder_init(&decoder);
+    stage_init(&stage, server_response);
+    while (!chunk_done(&decoder)) {
+        if ((nread = sio_read_some(sio, chunk, RELAY_BUFSIZE)) <= 0
+            || (n = chunk_decode(&decoder, chunk, nread, &used)) < 0
+            || stage_append(&stage, chunk, n) < 0) {
+            stage_free(&stage);
+            return -1;
+        }
+        if (used < (size_t) nread)
+            server_response->rs_keep_alive = 0;
+    }
+
+    server_response->rs_content = stage.buf;
+    server_response->rs_content_length = stage.len;
     return 0;
 }
 
+/*
+ * parse_response_headers - The server's header lines kept with the response,
+ *     in a string to be freed by the caller, picking up what the proxy needs
+ *     on the way. The hop-by-hop headers and the empty line are left out,
+ *     the proxy ends the head with its own Transfer-Encoding and Connection
+ *     headers.
+ */
+static char *
+parse_response_headers(const char *buf, const HttpParser *parser,
+                       Response *server_response)
+{
+    char *headers, *p;
+    const HttpHeader *header;
+
+    for (int i = 0; i < parser->nheaders; i++)
+        pick_header(buf, &parser->headers[i], server_response);
+
+    /* The length of a chunked body is only known once it's decoded */
+    headers = p = malloc(parser->head_len + 1);
+    for (int i = 0; i < parser->nheaders; i++) {
+        header = &parser->headers[i];
+        if (is_hop_by_hop(header->id)
+            || (header->id == HDR_CONTENT_LENGTH
+                && server_response->rs_chunked))
+            continue;
+        memcpy(p, buf + header->line.off, header->line.len);
+        p += header->line.len;
+    }
+    *p = '\0';
+
+    return headers;
+}
+
+/*
+ * parse_response_line - Pick up the status. An HTTP/1.1 server keeps the
+ *     connection open unless told otherwise by its headers, an HTTP/1.0 one
+ *     only when asked to.
+ */
+static void
+parse_response_line(const char *buf, const HttpParser *parser,
+                    Response *server_response)
+{
+    server_response->rs_keep_alive = http_span_is(buf, parser->version,
+                                                  "HTTP/1.1");
+    server_response->rs_status = parser->status;
+}
+
+/*
+ * pick_header - Pick up the body length or chunking, the Connection option
+ *     and the caching headers, Vary and Content-Encoding included, from a
+ *     response header parsed into buf.
+ */
+static void
+pick_header(const char *buf, const HttpHeader *header,
+            Response *server_response)
+{
+    char value[MAX_LINE];
+    CacheControl *cc = &server_response->rs_cc;
+
+    switch (header->id) {
+    case HDR_CONTENT_LENGTH:
+        if (parse_length(buf, header->value,
+                         &server_response->rs_content_length) == 0)
+            server_response->rs_has_length = 1;
+        break;
+    case HDR_TRANSFER_ENCODING:
+        server_response->rs_chunked = http_span_has(buf, header->value,
+                                                    "chunked");
+        break;
+    case HDR_CONNECTION:
+        server_response->rs_keep_alive = http_span_has(buf, header->value,
+                                                       "keep-alive");
+        break;
+    case HDR_CACHE_CONTROL:
+        copy_value(buf, header->value, value);
+        parse_cache_control(value, cc);
+        break;
+    case HDR_AGE:
+        copy_value(buf, header->value, value);
+        sscanf(value, "%ld", &cc->age);
+        break;
+    case HDR_DATE:
+        copy_value(buf, header->value, value);
+        cc->date = parse_http_date(value);
+        break;
+    case HDR_EXPIRES:
+        copy_value(buf, header->value, value);
+        cc->expires = parse_http_date(value);
+        cc->flags |= CC_EXPIRES;
+        break;
+    case HDR_LAST_MODIFIED:
+        copy_value(buf, header->value, value);
+        cc->last_modified = parse_http_date(value);
+        cc->flags |= CC_VALIDATOR;
+        break;
+    case HDR_ETAG:
+        cc->flags |= CC_VALIDATOR;
+        break;
+    case HDR_VARY:
+        if (varies_on_request(buf, header->value))
+            cc->flags |= CC_VARY;
+        break;
+    case HDR_CONTENT_ENCODING:
+        copy_value(buf, header->value, value);
+        if (strcasecmp(value, "gzip") && strcasecmp(value, "identity"))
+            cc->flags |= CC_ENCODED;
+        break;
+    default:
+        break;
+    }
+}
 
+/*
+ * parse_length - Parse a Content-Length value. Returns -1 if it isn't a
+ *     number, or too large for one.
+ */
 static int
-parse_response_headers(Sio *sio, char *response_headers, size_t *content_length)
+parse_length(const char *buf, HttpSpan value, size_t *length)
 {
-    char linebuf[MAX_LINE];
+    size_t n = 0;
+    const char *p = buf + value.off;
 
-    /* Initialize response_headers to be ready for appending (concatination) */
-    response_headers[0] = '\0';
-    do {
-        if (sio_read_line(sio, linebuf, MAX_LINE) < 0)
+    if (!value.len)
+        return -1;
+
+    for (unsigned i = 0; i < value.len; i++) {
+        if (p[i] < '0' || p[i] > '9' || n > (SIZE_MAX - 9) / 10)
             return -1;
+        n = n * 10 + p[i] - '0';
+    }
 
-        strtolwr(linebuf);
-        sscanf(linebuf, "content-length: %zu", content_length);
-        strcat(response_headers, linebuf);
-    } while (strcmp(linebuf, "\r\n"));
+    *length = n;
+    return 0;
+}
+
+/*
+ * varies_on_request - The Vary value names a request header other than
+ *     Accept-Encoding, or is "*". The cache copes with that one alone, a
+ *     gzipped response is inflated for the clients that don't accept it.
+ */
+static int
+varies_on_request(const char *buf, HttpSpan value)
+{
+    size_t n;
+    char *field, *save, valuebuf[MAX_LINE];
+
+    copy_value(buf, value, valuebuf);
+    for (field = strtok_r(valuebuf, ",", &save); field;
+         field = strtok_r(NULL, ",", &save)) {
+        field += strspn(field, " \t");
+        n = strcspn(field, " \t");
+        if (n && !(n == 15 && !strncasecmp(field, "accept-encoding", 15)))
+            return 1;
+    }
 
     return 0;
 }
 
+/*
+ * copy_value - Copy a span of buf into valuebuf as a string, truncated to
+ *     MAX_LINE.
+ */
 static void
-client_error(int clientfd, char *cause, char *errnum, 
-        char *short_msg, char *long_msg)
+copy_value(const char *buf, HttpSpan value, char *valuebuf)
 {
-    char linebuf[MAX_LINE], body[MAX_BUF];
+    size_t len = value.len < MAX_LINE ? value.len : MAX_LINE - 1;
 
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    strcat(body, "<body bgcolor=""ffffff"">\r\n");
-    sprintf(linebuf, "%s: %s\r\n", errnum, short_msg);
-    strcat(body, linebuf);
-    sprintf(linebuf, "%s: %s\r\n", long_msg, cause);
-    strcat(body, linebuf);
+    memcpy(valuebuf, buf + value.off, len);
+    valuebuf[len] = '\0';
+}
 
-    /* Send the HTTP response */
-    sprintf(linebuf, "HTTP/1.0 %s %s\r\n", errnum, short_msg);
-    if (sio_writen(clientfd, linebuf, strlen(linebuf)) < 0)
-        return;
-    sprintf(linebuf, "Content-Type: text/html\r\n");
-    if (sio_writen(clientfd, linebuf, strlen(linebuf)) < 0)
-        return;
-    sprintf(linebuf, "Content-Length: %zu\r\n\r\n", strlen(body));
-    if (sio_writen(clientfd, linebuf, strlen(linebuf)) < 0)
-        return;
-    if (sio_writen(clientfd, body, strlen(body)) < 0)
-        return;
+/*
+ * parse_cache_control - Add the directives of a Cache-Control value to cc.
+ *     A no-cache naming fields is taken for a plain one.
+ */
+static void
+parse_cache_control(const char *value, CacheControl *cc)
+{
+    const char *p;
+
+    if ((p = strcasestr(value, "stale-while-revalidate=")))
+        sscanf(p + 23, "%ld", &cc->stale_while_revalidate);
+
+    if (strcasestr(value, "no-store"))
+        cc->flags |= CC_NO_STORE;
+    if (strcasestr(value, "no-cache"))
+        cc->flags |= CC_NO_CACHE;
+    if (strcasestr(value, "private"))
+        cc->flags |= CC_PRIVATE;
+    if (strcasestr(value, "public"))
+        cc->flags |= CC_PUBLIC;
+    if (strcasestr(value, "must-revalidate"))
+        cc->flags |= CC_MUST_REVALIDATE;
+    if ((p = strcasestr(value, "s-maxage="))
+        && sscanf(p + 9, "%ld", &cc->s_maxage) == 1)
+        cc->flags |= CC_S_MAXAGE;
+    if ((p = strcasestr(value, "max-age="))
+        && sscanf(p + 8, "%ld", &cc->max_age) == 1)
+        cc->flags |= CC_MAX_AGE;
+}
+
+/*
+ * parse_http_date - Parse a date in the format servers send, such as
+ *     "Sun, 06 Nov 1994 08:49:37 GMT". Returns 0, a date long past, if it
+ *     isn't one.
+ */
+static time_t
+parse_http_date(const char *value)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(struct tm));
+    value += strspn(value, " \t");
+    if (!strptime(value, "%a, %d %b %Y %H:%M:%S", &tm))
+        return 0;
+
+    return timegm(&tm);
+}
+
+/*
+ * finish_head - Once the response head is parsed: a 204 or 304 ends with
+ *     its head, a chunked body has no length whatever Content-Length says,
+ *     and the response's lifetime is worked out.
+ */
+static void
+finish_head(const char *request_headers, Response *server_response)
+{
+    if (server_response->rs_status == 204
+        || server_response->rs_status == 304) {
+        server_response->rs_content_length = 0;
+        server_response->rs_has_length = 1;
+        server_response->rs_chunked = 0;
+    } else if (server_response->rs_chunked) {
+        server_response->rs_content_length = 0;
+        server_response->rs_has_length = 0;
+    }
+
+    server_response->rs_expires =
+        response_expiry(request_headers, server_response,
+                        &server_response->rs_refresh);
 }
 
+/*
+ * response_expiry - When the response stops being fresh, as a shared cache
+ *     sees it: its s-maxage, else its max-age, else its Expires date, else a
+ *     tenth of the time since it was last modified for the statuses cacheable
+ *     by default. The age it already had when it arrived is taken off.
+ *
+ *     Returns -1 if it can't be cached: no-store, private, partial or of a
+ *     status only cached with a lifetime and not given one, with a body only
+ *     ended by the connection closing, or stale already with no validator to
+ *     revalidate it nor stale-while-revalidate to serve it. refresh is set to
+ *     the start of the last REFRESH_AHEAD-th of its lifetime.
+ *
+ *     The cache only tells responses apart by the request headers in their
+ *     key, so one that varies on others, or on anything with Vary: *, can't
+ *     be cached; nor can one encoded otherwise than with gzip, which some
+ *     clients couldn't decode.
+ *
+ *     A response to a request with Authorization is only cached if it says
+ *     it may be shared, with public, s-maxage or must-revalidate (RFC 9111,
+ *     3.5).
+ */
+static time_t
+response_expiry(const char *request_headers,
+                const Response *server_response, time_t *refresh)
+{
+    long lifetime, age;
+    time_t now, date;
+    const CacheControl *cc = &server_response->rs_cc;
+    int status = server_response->rs_status;
+
+    if (cc->flags & (CC_NO_STORE | CC_PRIVATE | CC_VARY | CC_ENCODED)
+        || !(server_response->rs_has_length || server_response->rs_chunked)
+        || status < 200 || status == 206
+        || status == 304 || (!is_heuristic_status(status)
+                             && !(cc->flags & (CC_S_MAXAGE | CC_MAX_AGE
+                                               | CC_EXPIRES))))
+        return -1;
+    if (find_header(request_headers, "authorization:")
+        && !(cc->flags & (CC_PUBLIC | CC_S_MAXAGE | CC_MUST_REVALIDATE)))
+        return -1;
+
+    now = time(NULL);
+    date = cc->date ? cc->date : now;
+    if (cc->flags & CC_NO_CACHE)
+        lifetime = 0;
+    else if (cc->flags & CC_S_MAXAGE)
+        lifetime = cc->s_maxage;
+    else if (cc->flags & CC_MAX_AGE)
+        lifetime = cc->max_age;
+    else if (cc->flags & CC_EXPIRES)
+        lifetime = cc->expires - date;
+    else if (cc->last_modified && cc->last_modified < date)
+        lifetime = (date - cc->last_modified) / 10 < HEURISTIC_MAX_AGE ?
+                   (date - cc->last_modified) / 10 : HEURISTIC_MAX_AGE;
+    else
+        lifetime = 0;
+
+    /* The Age header, or the time since the Date if the clocks say more */
+    age = now - date > cc->age ? now - date : cc->age;
+
+    if (lifetime <= age && !(cc->flags & CC_VALIDATOR)
+        && lifetime + cc->stale_while_revalidate <= age)
+        return -1;
+    *refresh = now + lifetime - age - lifetime / REFRESH_AHEAD;
+    return now + lifetime - age;
+}
+
+/*
+ * stale_while_revalidate - How long past its expiry the cached response may
+ *     still be served while it's fetched again.
+ */
+static long
+stale_while_revalidate(const CacheObject *object)
+{
+    char value[MAX_LINE];
+    const char *p;
+    CacheControl cc;
+
+    if (!(p = find_header(object->response_headers, "cache-control:")))
+        return 0;
+
+    snprintf(value, sizeof(value), "%.*s", (int) strcspn(p, "\r\n"), p);
+    memset(&cc, 0, sizeof(CacheControl));
+    parse_cache_control(value, &cc);
+    return cc.stale_while_revalidate;
+}
+
+static int
+is_heuristic_status(int status)
+{
+    for (int i = 0; heuristic_statuses[i]; i++) {
+        if (heuristic_statuses[i] == status)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * use_object - Point server_response into the cached object it now holds.
+ */
 static void
-strtolwr(char *str)
+use_object(Response *server_response, CacheObject *object)
+{
+    server_response->rs_object = object;
+    server_response->rs_line = object->response_line;
+    server_response->rs_headers = object->response_headers;
+    server_response->rs_content = object->content;
+    server_response->rs_content_length = object->content_length;
+    server_response->rs_has_length =
+        find_header(object->response_headers, "content-length:") != NULL;
+}
+
+/*
+ * request_no_cache - The client asks for a response validated by the server
+ *     rather than one from the cache, as browsers do on a reload.
+ */
+static int
+request_no_cache(const char *request_headers)
 {
-    for (int i = 0; str[i] != '\0'; i++) {
-        if (isalpha(str[i]))
-            str[i] = tolower(str[i]);
+    return header_has(request_headers, "cache-control:", "no-cache")
+           || header_has(request_headers, "cache-control:", "max-age=0")
+           || header_has(request_headers, "pragma:", "no-cache");
+}
+
+/*
+ * find_header - The value of the first header called name, a lowercase name
+ *     with its colon, in a block of header lines. Returns NULL if there's
+ *     none.
+ */
+static const char *
+find_header(const char *headers, const char *name)
+{
+    size_t len = strlen(name);
+    const char *line;
+
+    for (line = headers; line; line = (line = strchr(line, '\n')) ?
+                                      line + 1 : NULL) {
+        if (!strncasecmp(line, name, len))
+            return line + len + strspn(line + len, " \t");
     }
+
+    return NULL;
+}
+
+/*
+ * header_has - The first header called name has token in its value.
+ */
+static int
+header_has(const char *headers, const char *name, const char *token)
+{
+    size_t len;
+    const char *value;
+    char valuebuf[MAX_LINE];
+
+    if (!(value = find_header(headers, name)))
+        return 0;
+
+    len = strcspn(value, "\r\n");
+    if (len > MAX_LINE - 1)
+        len = MAX_LINE - 1;
+    memcpy(valuebuf, value, len);
+    valuebuf[len] = '\0';
+    return strcasestr(valuebuf, token) != NULL;
+}
+
+/*
+ * merge_headers - The stored headers of a response updated with those of a
+ *     304 for it: a header the 304 has replaces the stored ones of the same
+ *     name, the others are kept. The headers about the body are the stored
+ *     ones, a 304 has none. Returns a string to be freed by the caller.
+ */
+static char *
+merge_headers(const char *stored, const char *update)
+{
+    size_t len;
+    const char *line, *next, *colon;
+    char *merged, *p, name[MAX_LINE];
+
+    merged = p = malloc(strlen(stored) + strlen(update) + 1);
+
+    for (line = stored; *line; line = next) {
+        next = line + strcspn(line, "\n");
+        next += *next == '\n';
+
+        if ((colon = memchr(line, ':', next - line)) && !is_body_header(line)
+            && (len = colon + 1 - line) < MAX_LINE) {
+            memcpy(name, line, len);
+            name[len] = '\0';
+            if (find_header(update, name))
+                continue;
+        }
+        memcpy(p, line, next - line);
+        p += next - line;
+    }
+
+    for (line = update; *line; line = next) {
+        next = line + strcspn(line, "\n");
+        next += *next == '\n';
+
+        if (!is_body_header(line)) {
+            memcpy(p, line, next - line);
+            p += next - line;
+        }
+    }
+
+    *p = '\0';
+    return merged;
+}
+
+/*
+ * body_headers - The headers of a response with those about its body set
+ *     anew, for a body of length bytes, gzipped or not. The gzipped one
+ *     varies with Accept-Encoding. Returns a string to be freed by the
+ *     caller.
+ */
+static char *
+body_headers(const char *headers, int gzipped, size_t length)
+{
+    const char *line, *next;
+    char *p, *result;
+
+    result = p = malloc(strlen(headers) + 96);
+
+    for (line = headers; *line; line = next) {
+        next = line + strcspn(line, "\n");
+        next += *next == '\n';
+
+        if (!is_body_header(line)) {
+            memcpy(p, line, next - line);
+            p += next - line;
+        }
+    }
+
+    if (gzipped) {
+        p = stpcpy(p, "Content-Encoding: gzip\r\n");
+        if (!header_has(headers, "vary:", "accept-encoding"))
+            p = stpcpy(p, "Vary: Accept-Encoding\r\n");
+    }
+    sprintf(p, "Content-Length: %zu\r\n", length);
+    return result;
+}
+
+/*
+ * weaken_etag - Make the ETag in headers, a string from malloc, a weak one,
+ *     for a body the proxy recoded. Returns the headers, moved if need be.
+ */
+static char *
+weaken_etag(char *headers)
+{
+    size_t off, len;
+    const char *value = find_header(headers, "etag:");
+
+    if (!value || !strncmp(value, "W/", 2))
+        return headers;
+
+    off = value - headers;
+    len = strlen(headers);
+    headers = realloc(headers, len + 3);
+    memmove(headers + off + 2, headers + off, len - off + 1);
+    memcpy(headers + off, "W/", 2);
+    return headers;
+}
+
+/*
+ * is_compressible - The body of the response is worth caching gzipped: it's
+ *     text long enough, and neither encoded already, a range, nor to be
+ *     kept as is by the proxies.
+ */
+static int
+is_compressible(const Response *server_response, size_t content_length)
+{
+    const char *type, *headers = server_response->rs_headers;
+
+    if (content_length < GZIP_MIN_LENGTH || server_response->rs_status == 206
+        || find_header(headers, "content-encoding:")
+        || header_has(headers, "cache-control:", "no-transform")
+        || !(type = find_header(headers, "content-type:")))
+        return 0;
+
+    for (int i = 0; compressible_types[i]; i++) {
+        if (!strncasecmp(type, compressible_types[i],
+                         strlen(compressible_types[i])))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * is_gzipped - The body is gzip encoded, and with nothing else.
+ */
+static int
+is_gzipped(const char *headers)
+{
+    const char *value = find_header(headers, "content-encoding:");
+
+    return value && strcspn(value, " \t\r\n") == 4
+           && !strncasecmp(value, "gzip", 4)
+           && value[4 + strspn(value + 4, " \t")] != ',';
+}
+
+/*
+ * is_body_header - The header is about the body as it's sent, which the
+ *     cached one keeps.
+ */
+static int
+is_body_header(const char *linebuf)
+{
+    return !strncasecmp(linebuf, "content-length:", 15)
+           || !strncasecmp(linebuf, "transfer-encoding:", 18)
+           || !strncasecmp(linebuf, "content-encoding:", 17);
+}
+
+void
+client_error(int clientfd, char *cause, char *errnum, 
+        char *short_msg, char *long_msg)
+{
+    char head[MAX_LINE], body[2 * MAX_LINE];
+    struct iovec iov[2];
+
+    /* Build the HTTP response body, a long cause is cut short */
+    snprintf(body, sizeof(body), "<html><title>Proxy Error</title>"
+             "<body bgcolor=""ffffff"">\r\n%s: %s\r\n%s: %s\r\n",
+             errnum, short_msg, long_msg, cause);
+
+    /* Send the HTTP response, head and body in one write */
+    snprintf(head, sizeof(head), "HTTP/1.0 %s %s\r\n"
+             "Content-Type: text/html\r\n"
+             "Content-Length: %zu\r\n\r\n", errnum, short_msg, strlen(body));
+    iov[0].iov_base = head;
+    iov[0].iov_len = strlen(head);
+    iov[1].iov_base = body;
+    iov[1].iov_len = strlen(body);
+    sio_writev(clientfd, iov, 2);
+}
+
+/*
+ * is_hop_by_hop - The header only concerns one connection, the proxy sets
+ *     its own. The body is decoded from the server's Transfer-Encoding and
+ *     chunked again for the client if needed.
+ */
+static int
+is_hop_by_hop(HeaderId id)
+{
+    return id == HDR_CONNECTION || id == HDR_PROXY_CONNECTION
+           || id == HDR_KEEP_ALIVE || id == HDR_TRANSFER_ENCODING;
+}
+
+/*
+ * release_object - Give back a cached object held by a write.
+ */
+static void
+release_object(void *object)
+{
+    cache_release(object);
 }
@@ -2,20 +2,63 @@
 #define SERVE_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
+#include "arena.h"
+#include "chunk.h"
+#include "parse.h"
 #include "../proxy_cache/cache.h"
+#include "../proxy_upstream/flight.h"
+#include "../safe_input_output/sio.h"
 
 #define MAX_LINE    8192        /* 8KB line buffer */
 #define MAX_BUF     1048576     /* 1MB buffer size */
 #define PORT_LEN    10          /* 10B port length */
 #define VERSION_LEN 10          /* 10B http version length */
 #define METHOD_LEN  10          /* 10B method length */
+#define RELAY_BUFSIZE 16384     /* 16KB response relay chunk */
+#define HEAD_IOVCNT 3           /* Buffers of a response head */
+#define KEEP_ALIVE_TIMEOUT 15   /* Default client idle timeout in seconds */
+#define HEURISTIC_MAX_AGE 86400 /* Longest lifetime guessed from Last-Modified */
+
+/* Caching directives and validators of a response */
+#define CC_NO_STORE     0x01
+#define CC_NO_CACHE     0x02
+#define CC_PRIVATE      0x04
+#define CC_MAX_AGE      0x08
+#define CC_S_MAXAGE     0x10
+#define CC_EXPIRES      0x20
+#define CC_VALIDATOR    0x40    /* ETag or Last-Modified */
+#define CC_PUBLIC       0x80
+#define CC_MUST_REVALIDATE 0x100
+#define CC_VARY         0x200   /* Varies on more than Accept-Encoding */
+#define CC_ENCODED      0x400   /* Encoded otherwise than with gzip */
+
+/* The caching headers of a response, the dates are 0 when not given */
+typedef struct cache_control {
+    unsigned flags;
+    long max_age, s_maxage;
+    long age;                   /* Age header */
+    long stale_while_revalidate; /* Seconds it may be served stale, or 0 */
+    time_t date, expires, last_modified;
+} CacheControl;
 
 typedef struct response {
     char *rs_line;
-    char *rs_headers;
+    char *rs_headers;           /* Without the final empty line */
     void *rs_content;
     size_t  rs_content_length;
+    size_t  rs_body_sent;       /* Body bytes relayed to the client */
+    int rs_has_length;          /* Content-Length was given */
+    int rs_chunked;             /* The body comes in chunks instead */
+    int rs_keep_alive;          /* The server keeps the connection open */
+    int rs_status;
+    CacheControl rs_cc;
+    time_t rs_expires;          /* Fresh until then, -1 if not cacheable */
+    time_t rs_refresh;          /* Refreshed in the background from then */
+    CacheObject *rs_object;     /* Cached object the fields point into */
+    CacheObject *rs_stale;      /* Cached object being revalidated */
 } Response;
 
 typedef struct request {
@@ -24,16 +67,120 @@ typedef struct request {
     char *rq_port;
     char *rq_uri;
     char *rq_headers;
+    int rq_keep_alive;          /* The client keeps the connection open */
+    int rq_http11;              /* The client takes chunked bodies */
+    int rq_gzip;                /* The client takes gzipped bodies */
+    int rq_metrics;             /* Asks for the proxy's own metrics */
+    unsigned long long rq_start; /* Its head began to come, in ns */
 } Request;
 
+typedef struct stage {
+    char *buf;                  /* Body bytes staged for the cache */
+    size_t len, size, max;
+    int abandoned;              /* Object too large to be cached */
+} Stage;
+
+typedef struct relay_stats {
+    unsigned long long copied;  /* Body bytes relayed through user space */
+    unsigned long long spliced; /* Body bytes relayed with splice(2) */
+} RelayStats;
+
+void
+keep_alive_init(int timeout);
+
+int
+keep_alive_timeout(void);
+
+int
+parse_request(Sio *sio, Arena *arena, Request *client_request);
+
+int
+parse_request_head(int clientfd, const char *buf, const HttpParser *parser,
+                   Arena *arena, Request *client_request);
+
+int
+parse_response_head(const char *buf, const HttpParser *parser,
+                    const char *request_headers, Response *server_response);
+
+void
+stage_init(Stage *stage, const Response *server_response);
+
+int
+stage_append(Stage *stage, const void *buf, size_t n);
+
+void
+stage_free(Stage *stage);
+
+void
+relay_account(size_t n, int spliced);
+
+void
+relay_stats(RelayStats *stats);
+
+void
+build_request(const Request *client_request, Arena *arena,
+              char **request_line, char **request_headers);
+
 int
-parse_request(int clientfd, Request *client_request);
+forward_request(int clientfd, const Request *client_request, 
+                Cache *proxy_cache, Arena *arena, Response *server_response);
 
 int
-forward_request(const Request *client_request, Cache *proxy_cache,
-                Response *server_response);
+fetch_cached(const Request *client_request, Cache *proxy_cache,
+             const char *request_line, const char *request_headers,
+             Response *server_response);
 
 int
-forward_response(int clientfd, const Response *server_response);
+refresh_response(Cache *proxy_cache, Arena *arena, const char *hostname,
+                 const char *port, const char *request_line,
+                 const char *request_headers);
+
+Flight *
+join_flight(const char *request_line, const char *request_headers,
+            int *leader);
+
+Flight *
+lead_flight(const char *request_line, const char *request_headers);
+
+char *
+conditional_headers(const CacheObject *object);
+
+int
+revalidated(Cache *proxy_cache, const char *request_line,
+            const char *request_headers, Response *server_response);
+
+void
+cache_response(Cache *proxy_cache, const char *request_line,
+               const char *request_headers, const Response *server_response,
+               const void *content, size_t content_length);
+
+void
+release_response(Response *server_response);
+
+int
+decode_response(const Request *client_request, Response *server_response);
+
+void
+metrics_response(Cache *proxy_cache, Response *server_response);
+
+int
+forward_response(int clientfd, const Response *server_response,
+                 int keep_alive);
+
+int
+response_keep_alive(const Request *client_request,
+                    const Response *server_response);
+
+int
+response_chunked(const Request *client_request,
+                 const Response *server_response);
+
+int
+response_head(struct iovec *iov, const Response *server_response,
+              int keep_alive, int chunked);
+
+void
+client_error(int clientfd, char *cause, char *errnum, char *short_msg,
+             char *long_msg);
 
 #endif
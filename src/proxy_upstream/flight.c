@@ -0,0 +1,308 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flight.h"
+
+typedef struct flight_bucket {
+    pthread_mutex_t mutex;
+    Flight *flights;
+} FlightBucket;
+
+/*
+ * The table of the responses being fetched is shared by every serving
+ * thread, like the upstream pool
+ */
+static struct {
+    FlightBucket buckets[FLIGHT_BUCKETS];
+    pthread_condattr_t condattr;
+    atomic_ullong leaders, followers, timeouts;
+} flights;
+
+static FlightBucket *
+find_bucket(unsigned long hash);
+
+static Flight *
+find_flight(FlightBucket *bucket, unsigned long hash, const char *key,
+            size_t key_len);
+
+static Flight *
+new_flight(FlightBucket *bucket, unsigned long hash, const char *key,
+           size_t key_len);
+
+static void
+unref(Flight *flight);
+
+static unsigned long
+hash_key(const char *key, size_t key_len);
+
+void
+flight_init(void)
+{
+    for (int i = 0; i < FLIGHT_BUCKETS; i++) {
+        pthread_mutex_init(&flights.buckets[i].mutex, NULL);
+        flights.buckets[i].flights = NULL;
+    }
+
+    /* Waits are timed on the monotonic clock */
+    pthread_condattr_init(&flights.condattr);
+    pthread_condattr_setclock(&flights.condattr, CLOCK_MONOTONIC);
+}
+
+/*
+ * flight_join - Join the flight fetching the response cached under key, or
+ *     start one if there's none. leader is set for the request that starts
+ *     it: it fetches the response and ends the flight with flight_done once
+ *     the response is cached, or known not to be. The others follow, with
+ *     flight_wait or flight_watch, then look in the cache again.
+ */
+Flight *
+flight_join(const char *key, size_t key_len, int *leader)
+{
+    unsigned long hash;
+    FlightBucket *bucket;
+    Flight *flight;
+
+    hash = hash_key(key, key_len);
+    bucket = find_bucket(hash);
+
+    pthread_mutex_lock(&bucket->mutex);
+
+    if ((flight = find_flight(bucket, hash, key, key_len))) {
+        flight->refcnt++;
+        pthread_mutex_unlock(&bucket->mutex);
+        atomic_fetch_add(&flights.followers, 1);
+        *leader = 0;
+        return flight;
+    }
+    flight = new_flight(bucket, hash, key, key_len);
+
+    pthread_mutex_unlock(&bucket->mutex);
+
+    atomic_fetch_add(&flights.leaders, 1);
+    *leader = 1;
+    return flight;
+}
+
+/*
+ * flight_lead - Start a flight for key, only if there's none yet: for a
+ *     fetch that's pointless when another one is going. Returns the flight,
+ *     to end with flight_done, or NULL.
+ */
+Flight *
+flight_lead(const char *key, size_t key_len)
+{
+    unsigned long hash;
+    FlightBucket *bucket;
+    Flight *flight = NULL;
+
+    hash = hash_key(key, key_len);
+    bucket = find_bucket(hash);
+
+    pthread_mutex_lock(&bucket->mutex);
+    if (!find_flight(bucket, hash, key, key_len))
+        flight = new_flight(bucket, hash, key, key_len);
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (flight)
+        atomic_fetch_add(&flights.leaders, 1);
+    return flight;
+}
+
+/*
+ * flight_done - End the flight of a leader and let its followers go. The
+ *     next request for the key starts a new flight.
+ */
+void
+flight_done(Flight *flight)
+{
+    Flight **link;
+    FlightWaiter *waiter;
+    FlightBucket *bucket = find_bucket(flight->hash);
+
+    pthread_mutex_lock(&bucket->mutex);
+
+    flight->done = 1;
+    for (link = &bucket->flights; *link != flight; link = &(*link)->next)
+        ;
+    *link = flight->next;
+
+    while ((waiter = flight->waiters)) {
+        flight->waiters = waiter->next;
+        waiter->wake(waiter->arg);
+    }
+    pthread_cond_broadcast(&flight->cond);
+
+    unref(flight);
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+/*
+ * flight_wait - Wait for the leader of the flight for at most timeout
+ *     seconds, then leave it. Returns 0 once the leader is done, -1 if it
+ *     took too long.
+ */
+int
+flight_wait(Flight *flight, int timeout)
+{
+    int rc = 0;
+    struct timespec deadline;
+    FlightBucket *bucket = find_bucket(flight->hash);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&bucket->mutex);
+    while (!flight->done && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&flight->cond, &bucket->mutex, &deadline);
+    rc = flight->done ? 0 : -1;
+    unref(flight);
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (rc < 0)
+        atomic_fetch_add(&flights.timeouts, 1);
+    return rc;
+}
+
+/*
+ * flight_watch - Have waiter woken once the leader is done, for a follower
+ *     that can't block. Returns 0, or 1 if the leader is done already.
+ *     Either way the follower leaves the flight with flight_leave once woken.
+ */
+int
+flight_watch(Flight *flight, FlightWaiter *waiter)
+{
+    int done;
+    FlightBucket *bucket = find_bucket(flight->hash);
+
+    pthread_mutex_lock(&bucket->mutex);
+    if (!(done = flight->done)) {
+        waiter->next = flight->waiters;
+        flight->waiters = waiter;
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+
+    return done;
+}
+
+/*
+ * flight_unwatch - Stop waiting for a leader taking too long. Returns 0, or
+ *     -1 if it's done and the waiter woken already.
+ */
+int
+flight_unwatch(Flight *flight, FlightWaiter *waiter)
+{
+    int rc = -1;
+    FlightWaiter **link;
+    FlightBucket *bucket = find_bucket(flight->hash);
+
+    pthread_mutex_lock(&bucket->mutex);
+    for (link = &flight->waiters; *link; link = &(*link)->next) {
+        if (*link == waiter) {
+            *link = waiter->next;
+            rc = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (rc == 0)
+        atomic_fetch_add(&flights.timeouts, 1);
+    return rc;
+}
+
+void
+flight_leave(Flight *flight)
+{
+    FlightBucket *bucket = find_bucket(flight->hash);
+
+    pthread_mutex_lock(&bucket->mutex);
+    unref(flight);
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+/*
+ * flight_stats - Take a snapshot of the counters.
+ */
+void
+flight_stats(FlightStats *stats)
+{
+    stats->leaders = atomic_load(&flights.leaders);
+    stats->followers = atomic_load(&flights.followers);
+    stats->timeouts = atomic_load(&flights.timeouts);
+}
+
+static FlightBucket *
+find_bucket(unsigned long hash)
+{
+    return &flights.buckets[hash % FLIGHT_BUCKETS];
+}
+
+static Flight *
+find_flight(FlightBucket *bucket, unsigned long hash, const char *key,
+            size_t key_len)
+{
+    Flight *flight;
+
+    for (flight = bucket->flights; flight; flight = flight->next) {
+        if (flight->hash == hash && flight->key_len == key_len
+            && !memcmp(flight->key, key, key_len))
+            return flight;
+    }
+
+    return NULL;
+}
+
+/*
+ * new_flight - Add a flight for key to its bucket, locked, held by its
+ *     leader.
+ */
+static Flight *
+new_flight(FlightBucket *bucket, unsigned long hash, const char *key,
+           size_t key_len)
+{
+    Flight *flight;
+
+    flight = malloc(sizeof(Flight));
+    flight->key = malloc(key_len);
+    memcpy(flight->key, key, key_len);
+    flight->key_len = key_len;
+    flight->hash = hash;
+    flight->done = 0;
+    flight->refcnt = 1;
+    pthread_cond_init(&flight->cond, &flights.condattr);
+    flight->waiters = NULL;
+    flight->next = bucket->flights;
+    bucket->flights = flight;
+
+    return flight;
+}
+
+/*
+ * unref - Drop a reference to the flight, with its bucket locked. The last
+ *     one frees it, it's out of the table by then.
+ */
+static void
+unref(Flight *flight)
+{
+    if (--flight->refcnt > 0)
+        return;
+
+    pthread_cond_destroy(&flight->cond);
+    free(flight->key);
+    free(flight);
+}
+
+static unsigned long
+hash_key(const char *key, size_t key_len)
+{
+    unsigned long hash = 5381;
+
+    for (size_t i = 0; i < key_len; i++)
+        hash = ((hash << 5) + hash) + key[i]; /* hash * 33 + c */
+
+    return hash;
+}
@@ -0,0 +1,62 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define FLIGHT_BUCKETS  256     /* In-flight table buckets */
+#define FLIGHT_TIMEOUT  10      /* Seconds a follower waits for its leader */
+
+/* A follower that can't block, told when the flight is over */
+typedef struct flight_waiter {
+    void (*wake)(void *arg);        /* Called with the flight's bucket locked */
+    void *arg;
+    struct flight_waiter *next;
+} FlightWaiter;
+
+/* A response being fetched from the server, for a leader and its followers */
+typedef struct flight {
+    char *key;
+    size_t key_len;
+    unsigned long hash;
+    int done;
+    int refcnt;                     /* The leader and the followers */
+    pthread_cond_t cond;            /* Blocking followers wait on it */
+    FlightWaiter *waiters;
+    struct flight *next;
+} Flight;
+
+typedef struct flight_stats {
+    unsigned long long leaders;     /* Requests that went to the server */
+    unsigned long long followers;   /* Requests that waited for a leader */
+    unsigned long long timeouts;    /* Followers that gave up waiting */
+} FlightStats;
+
+void
+flight_init(void);
+
+Flight *
+flight_join(const char *key, size_t key_len, int *leader);
+
+Flight *
+flight_lead(const char *key, size_t key_len);
+
+void
+flight_done(Flight *flight);
+
+int
+flight_wait(Flight *flight, int timeout);
+
+int
+flight_watch(Flight *flight, FlightWaiter *waiter);
+
+int
+flight_unwatch(Flight *flight, FlightWaiter *waiter);
+
+void
+flight_leave(Flight *flight);
+
+void
+flight_stats(FlightStats *stats);
+
+#endif
@@ -0,0 +1,289 @@
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upstream.h"
+
+typedef struct idle_conn {
+    int fd;
+    time_t since;
+} IdleConn;
+
+typedef struct upstream_host {
+    char *key;                      /* "hostname:port" */
+    IdleConn *idle;                 /* Most recently released last */
+    int nidle;
+    struct upstream_host *next;
+} UpstreamHost;
+
+typedef struct upstream_bucket {
+    sem_t mutex;
+    UpstreamHost *hosts;
+} UpstreamBucket;
+
+/*
+ * The pool is shared by every serving thread, like the resolver behind
+ * open_clientfd it needs no handle to be passed around
+ */
+static struct {
+    UpstreamBucket buckets[UPSTREAM_BUCKETS];
+    int max_idle, idle_timeout;
+    atomic_ullong hits, misses, stale, expired, overflow;
+} upstream;
+
+static UpstreamHost *
+find_host(UpstreamBucket *bucket, const char *key, int create);
+
+static void
+expire_idle(UpstreamHost *host, time_t now);
+
+static void *
+sweep_loop(void *vargp);
+
+static void
+sweep_bucket(UpstreamBucket *bucket, time_t now);
+
+static int
+is_alive(int fd);
+
+static unsigned long
+hash_key(const char *key);
+
+/*
+ * upstream_init - Keep up to max_idle idle connections per (hostname, port)
+ *     for at most idle_timeout seconds. A max_idle of 0 disables the pool.
+ *     A thread of its own closes the expired connections every
+ *     UPSTREAM_SWEEP seconds, of the hosts that are never asked for again
+ *     too.
+ */
+void
+upstream_init(int max_idle, int idle_timeout)
+{
+    pthread_t tid;
+
+    upstream.max_idle = max_idle;
+    upstream.idle_timeout = idle_timeout;
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+        sem_init(&upstream.buckets[i].mutex, 0, 1);
+        upstream.buckets[i].hosts = NULL;
+    }
+
+    if (upstream_enabled()) {
+        pthread_create(&tid, NULL, sweep_loop, NULL);
+        pthread_detach(tid);
+    }
+}
+
+int
+upstream_enabled(void)
+{
+    return upstream.max_idle > 0;
+}
+
+/*
+ * upstream_take - Take an idle connection to (hostname, port) out of the
+ *     pool. Connections that expired or were closed by the server meanwhile
+ *     are dropped on the way. Returns -1 if none is left, the caller then
+ *     opens a new one.
+ */
+int
+upstream_take(const char *hostname, const char *port)
+{
+    int fd;
+    char key[NI_MAXHOST + NI_MAXSERV + 1];
+    UpstreamBucket *bucket;
+    UpstreamHost *host;
+
+    if (!upstream_enabled())
+        return -1;
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    bucket = &upstream.buckets[hash_key(key) % UPSTREAM_BUCKETS];
+
+    fd = -1;
+    sem_wait(&bucket->mutex);
+    if ((host = find_host(bucket, key, 0))) {
+        expire_idle(host, time(NULL));
+        while (host->nidle > 0) {
+            fd = host->idle[--host->nidle].fd;
+            if (is_alive(fd))
+                break;
+            atomic_fetch_add(&upstream.stale, 1);
+            close(fd);
+            fd = -1;
+        }
+    }
+    sem_post(&bucket->mutex);
+
+    atomic_fetch_add(fd >= 0 ? &upstream.hits : &upstream.misses, 1);
+    return fd;
+}
+
+/*
+ * upstream_release - Give back the connection fd to (hostname, port) once
+ *     done with it. Only a reusable connection, one whose last response was
+ *     read completely and that the server keeps open, goes back to the pool;
+ *     any other is closed.
+ */
+void
+upstream_release(const char *hostname, const char *port, int fd, int reusable)
+{
+    char key[NI_MAXHOST + NI_MAXSERV + 1];
+    UpstreamBucket *bucket;
+    UpstreamHost *host;
+    time_t now;
+
+    if (!reusable || !upstream_enabled()) {
+        close(fd);
+        return;
+    }
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    bucket = &upstream.buckets[hash_key(key) % UPSTREAM_BUCKETS];
+    now = time(NULL);
+
+    sem_wait(&bucket->mutex);
+    host = find_host(bucket, key, 1);
+    expire_idle(host, now);
+    if (host->nidle < upstream.max_idle) {
+        host->idle[host->nidle].fd = fd;
+        host->idle[host->nidle].since = now;
+        host->nidle++;
+        fd = -1;
+    }
+    sem_post(&bucket->mutex);
+
+    if (fd >= 0) {
+        atomic_fetch_add(&upstream.overflow, 1);
+        close(fd);
+    }
+}
+
+/*
+ * upstream_stats - Take a snapshot of the pool counters.
+ */
+void
+upstream_stats(UpstreamStats *stats)
+{
+    stats->hits = atomic_load(&upstream.hits);
+    stats->misses = atomic_load(&upstream.misses);
+    stats->stale = atomic_load(&upstream.stale);
+    stats->expired = atomic_load(&upstream.expired);
+    stats->overflow = atomic_load(&upstream.overflow);
+}
+
+static UpstreamHost *
+find_host(UpstreamBucket *bucket, const char *key, int create)
+{
+    UpstreamHost *host;
+
+    for (host = bucket->hosts; host; host = host->next) {
+        if (!strcmp(host->key, key))
+            return host;
+    }
+
+    if (!create)
+        return NULL;
+
+    host = malloc(sizeof(UpstreamHost));
+    host->key = strdup(key);
+    host->idle = malloc(upstream.max_idle * sizeof(IdleConn));
+    host->nidle = 0;
+    host->next = bucket->hosts;
+    bucket->hosts = host;
+    return host;
+}
+
+/*
+ * expire_idle - Close the connections of host idle for longer than the
+ *     timeout, they are the oldest ones at the bottom of the stack.
+ */
+static void
+expire_idle(UpstreamHost *host, time_t now)
+{
+    int nexpired;
+
+    for (nexpired = 0; nexpired < host->nidle; nexpired++) {
+        if (now - host->idle[nexpired].since < upstream.idle_timeout)
+            break;
+        close(host->idle[nexpired].fd);
+    }
+
+    if (nexpired > 0) {
+        memmove(host->idle, host->idle + nexpired,
+                (host->nidle - nexpired) * sizeof(IdleConn));
+        host->nidle -= nexpired;
+        atomic_fetch_add(&upstream.expired, nexpired);
+    }
+}
+
+static void *
+sweep_loop(void *vargp)
+{
+    (void) vargp;
+
+    while (1) {
+        sleep(UPSTREAM_SWEEP);
+        for (int i = 0; i < UPSTREAM_BUCKETS; i++)
+            sweep_bucket(&upstream.buckets[i], time(NULL));
+    }
+
+    return NULL;
+}
+
+/*
+ * sweep_bucket - Close the expired connections of every host of bucket, and
+ *     free the hosts left with none.
+ */
+static void
+sweep_bucket(UpstreamBucket *bucket, time_t now)
+{
+    UpstreamHost **link, *host;
+
+    sem_wait(&bucket->mutex);
+    for (link = &bucket->hosts; (host = *link); ) {
+        expire_idle(host, now);
+        if (host->nidle) {
+            link = &host->next;
+            continue;
+        }
+        *link = host->next;
+        free(host->key);
+        free(host->idle);
+        free(host);
+    }
+    sem_post(&bucket->mutex);
+}
+
+/*
+ * is_alive - An idle connection has nothing to read, if it's readable the
+ *     server closed it (or sent something unexpected) and it can't be reused.
+ */
+static int
+is_alive(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+static unsigned long
+hash_key(const char *key)
+{
+    unsigned long hash = 5381;
+
+    while (*key)
+        hash = ((hash << 5) + hash) + *key++; /* hash * 33 + c */
+
+    return hash;
+}
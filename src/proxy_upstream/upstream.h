@@ -0,0 +1,32 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#define UPSTREAM_BUCKETS        256     /* Host table buckets */
+#define UPSTREAM_MAX_IDLE       8       /* Default idle connections per host */
+#define UPSTREAM_IDLE_TIMEOUT   30      /* Default idle timeout in seconds */
+#define UPSTREAM_SWEEP          5       /* Seconds between idle sweeps */
+
+typedef struct upstream_stats {
+    unsigned long long hits;        /* Requests sent on a pooled connection */
+    unsigned long long misses;      /* Requests that needed a new connection */
+    unsigned long long stale;       /* Pooled connections found closed */
+    unsigned long long expired;     /* Pooled connections idle for too long */
+    unsigned long long overflow;    /* Connections closed, host pool full */
+} UpstreamStats;
+
+void
+upstream_init(int max_idle, int idle_timeout);
+
+int
+upstream_enabled(void);
+
+int
+upstream_take(const char *hostname, const char *port);
+
+void
+upstream_release(const char *hostname, const char *port, int fd, int reusable);
+
+void
+upstream_stats(UpstreamStats *stats);
+
+#endif
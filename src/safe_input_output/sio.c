@@ -1,13 +1,70 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#endif
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "sio.h"
 
+/* A buffer sent with MSG_ZEROCOPY, kept until the kernel is done with it */
+typedef struct sio_hold {
+    unsigned first, count;          /* The sends it went out with */
+    unsigned pending;               /* Those not notified yet */
+    void (*release)(void *);
+    void *arg;
+} SioHold;
+
+/*
+ * The MSG_ZEROCOPY sends of the connection the thread serves. The thread and
+ * pool modes serve a connection on one thread until it's closed.
+ */
+typedef struct sio_zerocopy {
+    int fd;                         /* -1 when there's none */
+    int enabled;                    /* SO_ZEROCOPY is on, -1 if it can't be */
+    unsigned sends;                 /* Made on fd, the kernel numbers them */
+    int nholds;
+    SioHold holds[SIO_ZEROCOPY_HOLDS];
+} SioZerocopy;
+
+static __thread SioZerocopy zerocopy = {.fd = -1};
+
 static ssize_t
 sio_read (Sio *sio, char *usrbuf, size_t n);
 
+static ssize_t
+sio_fill(Sio *sio);
+
+static const char *
+find_newline(const char *p, size_t n);
+
+static void
+consume_iov(struct iovec **iov, int *iovcnt, size_t n);
+
+static int
+zerocopy_begin(SioZerocopy *zc, int fd);
+
+static void
+zerocopy_hold(SioZerocopy *zc, unsigned first, void (*release)(void *),
+              void *arg);
+
+static void
+zerocopy_reap(SioZerocopy *zc);
+
 
 /*
  * sio_initbuf - Associate a descriptor with a read buffer and reset buffer
@@ -41,33 +98,117 @@ sio_readn(Sio *sio, void *usrbuf, size_t n)
     return (n - nleft);         /* return >= 0 */
 }
 
-/* 
- * sio_read_line - Safly read a text line (buffered)
+/*
+ * sio_read_some - Read up to n bytes (buffered), returning as soon as some
+ *    are available. Unread bytes of the internal buffer come first; once it
+ *    is empty the data is read straight into usrbuf.
+ */
+ssize_t
+sio_read_some(Sio *sio, void *usrbuf, size_t n)
+{
+    ssize_t nread;
+
+    if (sio->sio_cnt > 0)
+        return sio_read(sio, usrbuf, n);
+
+    while ((nread = read(sio->sio_fd, usrbuf, n)) < 0) {
+        if (errno != EINTR)     /* Interrupted by sig handler return */
+            return -1;
+    }
+    return nread;
+}
+
+/*
+ * sio_read_line - Safly read a text line (buffered), at most maxlen - 1
+ *    bytes of it. The line end is searched in the whole unread block of the
+ *    internal buffer at once, and the line copied out with it.
  */
 ssize_t
 sio_read_line(Sio *sio, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, len;
+    ssize_t rc;
+    const char *eol = NULL;
+    char *bufp = usrbuf;
 
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = sio_read(sio, &c, 1)) == 1) {
-	        *bufp++ = c;
-	        if (c == '\n') {
-                n++;
-        		break;
-            }
-    	} else if (rc == 0) {
-    	    if (n == 1)
-    		    return 0;     /* EOF, no data read */
-    	    else
-    	    	break;        /* EOF, some data was read */
-    	} else {
-    	    return -1;	      /* Error */
+    while (!eol && n + 1 < maxlen) {
+        if (sio->sio_cnt <= 0 && (rc = sio_fill(sio)) <= 0) {
+            if (rc < 0)
+                return -1;      /* Error */
+            break;              /* EOF */
         }
+
+        len = sio->sio_cnt;
+        if (len > maxlen - 1 - n)
+            len = maxlen - 1 - n;
+        if ((eol = find_newline(sio->sio_bufptr, len)))
+            len = eol + 1 - sio->sio_bufptr;
+
+        memcpy(bufp + n, sio->sio_bufptr, len);
+        sio->sio_bufptr += len;
+        sio->sio_cnt -= len;
+        n += len;
     }
-    *bufp = 0;
-    return n-1;
+    bufp[n] = 0;
+    return n;
+}
+
+/*
+ * sio_read_span - Take the next text line (buffered) without copying it:
+ *    *line points to it in the internal buffer, and stays valid until the
+ *    next read from sio. A line longer than the buffer comes in parts, only
+ *    the last one ends with a newline. Returns its length, 0 on EOF or -1
+ *    on error.
+ */
+ssize_t
+sio_read_span(Sio *sio, const char **line)
+{
+    size_t len, scanned = 0;
+    ssize_t rc;
+    const char *eol;
+
+    if (sio->sio_cnt <= 0) {
+        sio->sio_cnt = 0;
+        sio->sio_bufptr = sio->sio_buf;
+    }
+
+    /* Only the bytes read since the last search are searched */
+    while (!(eol = find_newline(sio->sio_bufptr + scanned,
+                                sio->sio_cnt - scanned))) {
+        scanned = sio->sio_cnt;
+        if (sio->sio_cnt == SIO_BUFSIZE)
+            break;              /* Part of a longer line */
+        if ((rc = sio_fill(sio)) < 0)
+            return -1;
+        if (rc == 0)
+            break;              /* EOF, the rest is the last line */
+    }
+
+    len = eol ? eol + 1 - sio->sio_bufptr : sio->sio_cnt;
+    *line = sio->sio_bufptr;
+    sio->sio_bufptr += len;
+    sio->sio_cnt -= len;
+    return len;
+}
+
+/*
+ * sio_take - Take up to n of the bytes already in the internal buffer,
+ *    without reading more or copying them: *buf points to them, and stays
+ *    valid until the next read from sio. Returns their number, 0 if the
+ *    buffer is empty.
+ */
+ssize_t
+sio_take(Sio *sio, const char **buf, size_t n)
+{
+    if (sio->sio_cnt <= 0)
+        return 0;
+    if ((size_t) sio->sio_cnt < n)
+        n = sio->sio_cnt;
+
+    *buf = sio->sio_bufptr;
+    sio->sio_bufptr += n;
+    sio->sio_cnt -= n;
+    return n;
 }
 
 /*
@@ -97,6 +238,176 @@ sio_writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
+/*
+ * sio_writev - Safly write the iovcnt buffers of iov in as few calls as the
+ *    socket takes them, consuming iov as they're written. Returns the number
+ *    of bytes written or -1 on error.
+ */
+ssize_t
+sio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0) {
+        if ((nwritten = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)             /* Interrupted by sig handler return */
+                continue;
+            if (errno == EPIPE)
+                errno = 0;
+            return -1;
+        }
+        n += nwritten;
+        consume_iov(&iov, &iovcnt, nwritten);
+    }
+    return n;
+}
+
+/*
+ * sio_writev_held - Write iov as sio_writev does, from buffers held by the
+ *    caller's reference arg, which is given up with release. A write of at
+ *    least SIO_ZEROCOPY_MIN bytes is sent with MSG_ZEROCOPY where the kernel
+ *    supports it, the pages sent straight from the buffers: the reference is
+ *    then only released once the kernel is done with them, as notified on
+ *    the socket error queue, without waiting for it. Otherwise the buffers
+ *    are copied and the reference released before returning.
+ */
+ssize_t
+sio_writev_held(int fd, struct iovec *iov, int iovcnt,
+                void (*release)(void *), void *arg)
+{
+    ssize_t nwritten;
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    size_t n = 0;
+    unsigned first;
+    int saved_errno;
+    struct msghdr msg = {0};
+    SioZerocopy *zc = &zerocopy;
+
+    for (int i = 0; i < iovcnt; i++)
+        n += iov[i].iov_len;
+
+    if (n >= SIO_ZEROCOPY_MIN && zerocopy_begin(zc, fd)) {
+        n = 0;
+        first = zc->sends;
+        while (iovcnt > 0) {
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            if ((nwritten = sendmsg(fd, &msg, MSG_ZEROCOPY)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == ENOBUFS        /* No room to track the pages, */
+                    && (nwritten = sio_writev(fd, iov, iovcnt)) >= 0) {
+                    n += nwritten;          /* copy the rest instead */
+                    break;
+                }
+                saved_errno = errno == EPIPE ? 0 : errno;
+                zerocopy_hold(zc, first, release, arg);
+                errno = saved_errno;
+                return -1;
+            }
+            zc->sends++;
+            n += nwritten;
+            consume_iov(&iov, &iovcnt, nwritten);
+        }
+
+        zerocopy_hold(zc, first, release, arg);
+        return n;
+    }
+#endif
+
+    nwritten = sio_writev(fd, iov, iovcnt);
+    release(arg);
+    return nwritten;
+}
+
+/*
+ * sio_close - Close the connection fd, once the kernel is done with the
+ *    buffers sent from it with MSG_ZEROCOPY. It should be already: a client
+ *    is done with a connection once it has read all of it. One that stopped
+ *    reading is waited for SIO_ZEROCOPY_LINGER ms at most, then reset, so
+ *    that the kernel drops what it still had to send, and the buffers are
+ *    released.
+ */
+void
+sio_close(int fd)
+{
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    long left;
+    struct timespec now, deadline;
+    struct linger linger = {.l_onoff = 1, .l_linger = 0};
+    struct pollfd pfd = {.fd = fd, .events = 0};
+    SioZerocopy *zc = &zerocopy;
+    SioHold *hold;
+
+    if (zc->fd == fd) {
+        zerocopy_reap(zc);
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += SIO_ZEROCOPY_LINGER / 1000;
+        deadline.tv_nsec += SIO_ZEROCOPY_LINGER % 1000 * 1000000L;
+
+        while (zc->nholds > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = (deadline.tv_sec - now.tv_sec) * 1000
+                   + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if (left <= 0)
+                break;
+            poll(&pfd, 1, left);            /* POLLERR once one is queued */
+            zerocopy_reap(zc);
+        }
+
+        if (zc->nholds > 0)
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        close(fd);
+
+        for (hold = zc->holds; hold < zc->holds + zc->nholds; hold++)
+            hold->release(hold->arg);
+        zc->nholds = 0;
+        zc->fd = -1;
+        return;
+    }
+#endif
+
+    close(fd);
+}
+
+/*
+ * sio_splice - Safly move n bytes from infd to outfd through the pipe pipefd
+ *    with splice(2), so they never get copied to user space. Returns the
+ *    number of bytes moved, less than n on EOF, or -1 on error.
+ */
+ssize_t
+sio_splice(int infd, int outfd, int pipefd[2], size_t n)
+{
+    size_t nleft = n;
+    ssize_t nin, nout;
+
+    while (nleft > 0) {
+        if ((nin = splice(infd, NULL, pipefd[1], NULL, nleft,
+                          SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+            if (errno == EINTR)     /* Interrupted by sig handler return */
+                continue;
+            return -1;
+        } else if (nin == 0) {      /* EOF */
+            break;
+        }
+        nleft -= nin;
+
+        /* Drain the pipe into outfd */
+        while (nin > 0) {
+            if ((nout = splice(pipefd[0], NULL, outfd, NULL, nin,
+                               SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            nin -= nout;
+        }
+    }
+    return (n - nleft);
+}
+
 /* 
  * sio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, sio_cnt) bytes from an internal buffer to a user
@@ -135,3 +446,196 @@ sio_read(Sio *sio, char *usrbuf, size_t n)
     sio->sio_cnt -= cnt;
     return cnt;
 }
+
+/*
+ * sio_fill - Read more into the internal buffer, after its unread bytes,
+ *    which are moved to its start first if they reach its end. The buffer
+ *    mustn't be full. Returns the number of bytes read, 0 on EOF or -1 on
+ *    error.
+ */
+static ssize_t
+sio_fill(Sio *sio)
+{
+    ssize_t n;
+    char *end;
+
+    if (sio->sio_cnt <= 0) {
+        sio->sio_cnt = 0;
+        sio->sio_bufptr = sio->sio_buf;
+    }
+
+    end = sio->sio_bufptr + sio->sio_cnt;
+    if (end == sio->sio_buf + SIO_BUFSIZE) {
+        memmove(sio->sio_buf, sio->sio_bufptr, sio->sio_cnt);
+        sio->sio_bufptr = sio->sio_buf;
+        end = sio->sio_buf + sio->sio_cnt;
+    }
+
+    while ((n = read(sio->sio_fd, end, sio->sio_buf + SIO_BUFSIZE - end)) < 0) {
+        if (errno != EINTR)     /* Interrupted by sig handler return */
+            return -1;
+    }
+    sio->sio_cnt += n;
+    return n;
+}
+
+/*
+ * find_newline - Search n bytes for a newline, 32 or 16 at a time with the
+ *    AVX2 or SSE2 the build targets, or with memchr without either. A CR
+ *    before it is left for the caller, the line parser drops it.
+ */
+static const char *
+find_newline(const char *p, size_t n)
+{
+#if defined(__AVX2__)
+    const __m256i nl32 = _mm256_set1_epi8('\n');
+
+    for (; n >= 32; p += 32, n -= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) p);
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl32));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i nl16 = _mm_set1_epi8('\n');
+
+    for (; n >= 16; p += 16, n -= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl16));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    return memchr(p, '\n', n);
+}
+
+/*
+ * consume_iov - Move iov past the n bytes written from it.
+ */
+static void
+consume_iov(struct iovec **iov, int *iovcnt, size_t n)
+{
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
+
+/*
+ * zerocopy_begin - Get ready to send on fd with MSG_ZEROCOPY: turn on
+ *    SO_ZEROCOPY, and TCP_NODELAY, the first time, and take in the
+ *    notifications already there. Returns 0 if the write is to be copied
+ *    instead: the kernel can't do it, or too many buffers are still held.
+ */
+static int
+zerocopy_begin(SioZerocopy *zc, int fd)
+{
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    int one = 1;
+
+    if (zc->fd != fd) {
+        if (zc->nholds > 0)                 /* Another one isn't closed */
+            return 0;
+        zc->fd = fd;
+        zc->sends = 0;
+        zc->enabled = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                                 sizeof(one)) ? -1 : 1;
+
+        /*
+         * A write goes out whole in its sends, its last segment needn't
+         * wait for the ACK of the others, which the client may delay
+         */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (zc->enabled < 0)
+        return 0;
+
+    zerocopy_reap(zc);
+    return zc->nholds < SIO_ZEROCOPY_HOLDS;
+#else
+    (void) zc;
+    (void) fd;
+    return 0;
+#endif
+}
+
+/*
+ * zerocopy_hold - Keep the buffers of a write made with the sends from
+ *    first on, up to the last one, until they're all notified. A write
+ *    that was copied whole is released right away.
+ */
+static void
+zerocopy_hold(SioZerocopy *zc, unsigned first, void (*release)(void *),
+              void *arg)
+{
+    SioHold *hold;
+
+    if (zc->sends == first) {
+        release(arg);
+        return;
+    }
+
+    hold = &zc->holds[zc->nholds++];
+    hold->first = first;
+    hold->count = hold->pending = zc->sends - first;
+    hold->release = release;
+    hold->arg = arg;
+}
+
+/*
+ * zerocopy_reap - Take in the notifications queued on the socket error
+ *    queue, without waiting, and release the buffers whose sends are all
+ *    done. Each one covers a range of sends, which may come out of order.
+ */
+static void
+zerocopy_reap(SioZerocopy *zc)
+{
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 8];
+    unsigned lo, hi;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    SioHold *hold;
+
+    while (zc->nholds > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;                         /* None left */
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            for (hold = zc->holds; hold < zc->holds + zc->nholds; ) {
+                lo = serr->ee_info > hold->first ? serr->ee_info
+                                                 : hold->first;
+                hi = serr->ee_data < hold->first + hold->count - 1 ?
+                     serr->ee_data : hold->first + hold->count - 1;
+                if (lo <= hi)
+                    hold->pending -= hi - lo + 1;
+                if (hold->pending > 0) {
+                    hold++;
+                    continue;
+                }
+                hold->release(hold->arg);
+                *hold = zc->holds[--zc->nholds];
+            }
+        }
+    }
+#else
+    (void) zc;
+#endif
+}
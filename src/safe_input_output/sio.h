@@ -2,8 +2,12 @@
 #define SIO_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #define SIO_BUFSIZE 8192            /* 8KB buffer */
+#define SIO_ZEROCOPY_MIN 32768      /* Least bytes sent with MSG_ZEROCOPY */
+#define SIO_ZEROCOPY_HOLDS 32       /* Most such writes awaiting the kernel */
+#define SIO_ZEROCOPY_LINGER 1000    /* Longest wait for them on close, in ms */
 
 typedef struct {
     char sio_buf[SIO_BUFSIZE];      /* Internal buffer */
@@ -18,10 +22,32 @@ sio_initbuf(Sio *sio, int fd);
 ssize_t
 sio_readn(Sio *sio, void *usrbuf, size_t n);
 
+ssize_t
+sio_read_some(Sio *sio, void *usrbuf, size_t n);
+
 ssize_t
 sio_read_line(Sio *sio, void *usrbuf, size_t maxlen);
 
+ssize_t
+sio_read_span(Sio *sio, const char **line);
+
+ssize_t
+sio_take(Sio *sio, const char **buf, size_t n);
+
 ssize_t
 sio_writen(int fd, void *usrbuf, size_t n);
 
+ssize_t
+sio_writev(int fd, struct iovec *iov, int iovcnt);
+
+ssize_t
+sio_writev_held(int fd, struct iovec *iov, int iovcnt,
+                void (*release)(void *), void *arg);
+
+void
+sio_close(int fd);
+
+ssize_t
+sio_splice(int infd, int outfd, int pipefd[2], size_t n);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,477 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "dns.h"
+
+typedef struct dns_entry {
+    char *key;                      /* "hostname:port" */
+    char *hostname, *port;
+    DnsAddrs *addrs;                /* NULL if the resolution failed */
+    int error;                      /* getaddrinfo error, 0 on success */
+    time_t expires;
+    int resolving;                  /* A thread is running getaddrinfo */
+    int nwaiters;                   /* Threads waiting for it */
+    int users;                      /* Threads yet to take the result */
+    sem_t done;
+    DnsWaiter *waiters;             /* Lookups that can't block */
+    struct dns_entry *next;
+    struct dns_entry *next_job;     /* Queued for the resolver threads */
+} DnsEntry;
+
+typedef struct dns_shard {
+    sem_t mutex;
+    DnsEntry *entries;
+} DnsShard;
+
+/*
+ * Like the upstream pool, the resolver cache is shared by every serving
+ * thread and needs no handle to be passed around
+ */
+static struct {
+    DnsShard shards[DNS_SHARDS];
+    int ttl, negative_ttl;
+    DnsEntry *jobs_head, *jobs_tail; /* Names for the resolver threads */
+    pthread_mutex_t jobs_mutex;
+    pthread_cond_t jobs_nonempty;
+    atomic_ullong hits, negative, misses, coalesced, expired;
+} dns;
+
+static void *
+resolver_loop(void *vargp);
+
+static int
+resolve(const char *hostname, const char *port, DnsAddrs **addrs);
+
+static DnsAddrs *
+store_result(DnsEntry *entry, int rc, DnsAddrs *addrs);
+
+static DnsEntry *
+find_entry(DnsShard *shard, const char *key, const char *hostname,
+           const char *port);
+
+static void
+evict_entries(DnsShard *shard);
+
+static int
+entry_busy(const DnsEntry *entry);
+
+static void
+free_entry(DnsEntry *entry);
+
+static int
+take_result(DnsEntry *entry, DnsAddrs **addrs);
+
+static unsigned long
+hash_key(const char *key);
+
+/*
+ * dns_init - Keep resolutions for ttl seconds, and failures for at most
+ *     DNS_NEGATIVE_TTL seconds. A ttl of 0 disables the cache. nresolvers
+ *     threads serve dns_lookup_async, none if it isn't used.
+ */
+void
+dns_init(int ttl, int nresolvers)
+{
+    pthread_t tid;
+
+    dns.ttl = ttl;
+    dns.negative_ttl = ttl < DNS_NEGATIVE_TTL ? ttl : DNS_NEGATIVE_TTL;
+    for (int i = 0; i < DNS_SHARDS; i++) {
+        sem_init(&dns.shards[i].mutex, 0, 1);
+        dns.shards[i].entries = NULL;
+    }
+
+    pthread_mutex_init(&dns.jobs_mutex, NULL);
+    pthread_cond_init(&dns.jobs_nonempty, NULL);
+    for (int i = 0; i < nresolvers; i++) {
+        pthread_create(&tid, NULL, resolver_loop, NULL);
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * dns_lookup - Resolve (hostname, port) for a stream connection, from the
+ *     cache while the previous resolution hasn't expired. Concurrent lookups
+ *     of a name being resolved wait for that single getaddrinfo call instead
+ *     of starting their own.
+ *
+ *     Returns 0 and sets addrs, to be given back with dns_release once
+ *     connected, or the getaddrinfo error code.
+ */
+int
+dns_lookup(const char *hostname, const char *port, DnsAddrs **addrs)
+{
+    int rc;
+    char key[NI_MAXHOST + NI_MAXSERV + 1];
+    time_t now;
+    DnsShard *shard;
+    DnsEntry *entry;
+    DnsAddrs *old;
+
+    if (dns.ttl <= 0)
+        return resolve(hostname, port, addrs);
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    shard = &dns.shards[hash_key(key) % DNS_SHARDS];
+    now = time(NULL);
+
+    sem_wait(&shard->mutex);
+    entry = find_entry(shard, key, hostname, port);
+
+    if (entry->resolving) {         /* Share the resolution in flight */
+        entry->nwaiters++;
+        entry->users++;             /* Keeps it from being evicted */
+        sem_post(&shard->mutex);
+        while (sem_wait(&entry->done) < 0)
+            ;   /* Interrupted by a signal handler */
+
+        atomic_fetch_add(&dns.coalesced, 1);
+        sem_wait(&shard->mutex);
+        rc = take_result(entry, addrs);
+        entry->users--;
+        sem_post(&shard->mutex);
+        return rc;
+    }
+
+    if (entry->expires > now) {
+        atomic_fetch_add(&dns.hits, 1);
+        if (entry->error)
+            atomic_fetch_add(&dns.negative, 1);
+        rc = take_result(entry, addrs);
+        sem_post(&shard->mutex);
+        return rc;
+    }
+
+    atomic_fetch_add(&dns.misses, 1);
+    if (entry->expires)
+        atomic_fetch_add(&dns.expired, 1);
+    entry->resolving = 1;
+    sem_post(&shard->mutex);
+
+    /* Resolve without holding the shard, other names go on meanwhile */
+    rc = resolve(hostname, port, addrs);
+
+    sem_wait(&shard->mutex);
+    old = store_result(entry, rc, rc ? NULL : *addrs);
+    sem_post(&shard->mutex);
+
+    if (old)
+        dns_release(old);
+    return rc;
+}
+
+/*
+ * dns_lookup_async - Same as dns_lookup, for a caller that can't block: a
+ *     name that isn't cached is resolved by a resolver thread, which then
+ *     sets the result in waiter and calls its wake function. Lookups in
+ *     flight are shared even with the cache disabled.
+ *
+ *     Returns 1 if the result is set in waiter already, else 0.
+ */
+int
+dns_lookup_async(const char *hostname, const char *port, DnsWaiter *waiter)
+{
+    char key[NI_MAXHOST + NI_MAXSERV + 1];
+    DnsShard *shard;
+    DnsEntry *entry;
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    waiter->shard = hash_key(key) % DNS_SHARDS;
+    shard = &dns.shards[waiter->shard];
+
+    sem_wait(&shard->mutex);
+    entry = find_entry(shard, key, hostname, port);
+    waiter->entry = entry;
+
+    if (entry->resolving) {         /* Share the resolution in flight */
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        sem_post(&shard->mutex);
+        atomic_fetch_add(&dns.coalesced, 1);
+        return 0;
+    }
+
+    if (entry->expires > time(NULL)) {
+        atomic_fetch_add(&dns.hits, 1);
+        if (entry->error)
+            atomic_fetch_add(&dns.negative, 1);
+        waiter->error = take_result(entry, &waiter->addrs);
+        sem_post(&shard->mutex);
+        return 1;
+    }
+
+    atomic_fetch_add(&dns.misses, 1);
+    if (entry->expires)
+        atomic_fetch_add(&dns.expired, 1);
+    entry->resolving = 1;
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+    sem_post(&shard->mutex);
+
+    pthread_mutex_lock(&dns.jobs_mutex);
+    entry->next_job = NULL;
+    if (dns.jobs_tail)
+        dns.jobs_tail->next_job = entry;
+    else
+        dns.jobs_head = entry;
+    dns.jobs_tail = entry;
+    pthread_cond_signal(&dns.jobs_nonempty);
+    pthread_mutex_unlock(&dns.jobs_mutex);
+    return 0;
+}
+
+/*
+ * dns_unwatch - Stop waiting for the lookup of a caller that's gone.
+ *     Returns 0, or -1 if the waiter is woken already and its result, if
+ *     any, is to be released.
+ */
+int
+dns_unwatch(DnsWaiter *waiter)
+{
+    int rc = -1;
+    DnsWaiter **link;
+    DnsShard *shard;
+
+    /* Once woken, the waiter's entry may be evicted */
+    shard = &dns.shards[waiter->shard];
+    sem_wait(&shard->mutex);
+    if (waiter->entry) {
+        for (link = &waiter->entry->waiters; *link; link = &(*link)->next) {
+            if (*link == waiter) {
+                *link = waiter->next;
+                rc = 0;
+                break;
+            }
+        }
+    }
+    sem_post(&shard->mutex);
+
+    return rc;
+}
+
+/*
+ * dns_release - Drop a reference to addrs, the last one frees it.
+ */
+void
+dns_release(DnsAddrs *addrs)
+{
+    if (atomic_fetch_sub(&addrs->refcnt, 1) == 1) {
+        freeaddrinfo(addrs->ai);
+        free(addrs);
+    }
+}
+
+/*
+ * dns_stats - Take a snapshot of the cache counters.
+ */
+void
+dns_stats(DnsStats *stats)
+{
+    stats->hits = atomic_load(&dns.hits);
+    stats->negative = atomic_load(&dns.negative);
+    stats->misses = atomic_load(&dns.misses);
+    stats->coalesced = atomic_load(&dns.coalesced);
+    stats->expired = atomic_load(&dns.expired);
+}
+
+static void *
+resolver_loop(void *vargp)
+{
+    int rc;
+    DnsEntry *entry;
+    DnsShard *shard;
+    DnsAddrs *addrs, *old;
+
+    (void) vargp;
+
+    while (1) {
+        pthread_mutex_lock(&dns.jobs_mutex);
+        while (!dns.jobs_head)
+            pthread_cond_wait(&dns.jobs_nonempty, &dns.jobs_mutex);
+        entry = dns.jobs_head;
+        if (!(dns.jobs_head = entry->next_job))
+            dns.jobs_tail = NULL;
+        pthread_mutex_unlock(&dns.jobs_mutex);
+
+        /* An entry being resolved is never evicted, its names don't change */
+        rc = resolve(entry->hostname, entry->port, &addrs);
+
+        shard = &dns.shards[hash_key(entry->key) % DNS_SHARDS];
+        sem_wait(&shard->mutex);
+        old = store_result(entry, rc, rc ? NULL : addrs);
+        sem_post(&shard->mutex);
+
+        if (old)
+            dns_release(old);
+        if (!rc)
+            dns_release(addrs);
+    }
+
+    return NULL;
+}
+
+static int
+resolve(const char *hostname, const char *port, DnsAddrs **addrs)
+{
+    int rc;
+    struct addrinfo hints, *listp;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
+    hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
+    hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
+    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port,
+                gai_strerror(rc));
+        return rc;
+    }
+
+    *addrs = malloc(sizeof(DnsAddrs));
+    (*addrs)->ai = listp;
+    atomic_init(&(*addrs)->refcnt, 1);
+    return 0;
+}
+
+/*
+ * store_result - Cache the result of a resolution of entry, with its shard
+ *     locked, and wake the lookups waiting for it. Returns the addresses it
+ *     replaces, to be released.
+ */
+static DnsAddrs *
+store_result(DnsEntry *entry, int rc, DnsAddrs *addrs)
+{
+    DnsAddrs *old;
+    DnsWaiter *waiter, *next;
+
+    old = entry->addrs;
+    entry->addrs = addrs;
+    if (entry->addrs)
+        atomic_fetch_add(&entry->addrs->refcnt, 1);
+    entry->error = rc;
+    entry->expires = time(NULL) + (rc ? dns.negative_ttl : dns.ttl);
+    entry->resolving = 0;
+    for (; entry->nwaiters > 0; entry->nwaiters--)
+        sem_post(&entry->done);
+
+    for (waiter = entry->waiters; waiter; waiter = next) {
+        next = waiter->next;        /* The waiter may be gone once woken */
+        waiter->error = take_result(entry, &waiter->addrs);
+        waiter->entry = NULL;
+        waiter->wake(waiter->arg);
+    }
+    entry->waiters = NULL;
+
+    return old;
+}
+
+/*
+ * find_entry - Find the entry of key in shard, adding an expired one if
+ *     there's none yet. Adding one evicts the entries that made way for it.
+ */
+static DnsEntry *
+find_entry(DnsShard *shard, const char *key, const char *hostname,
+           const char *port)
+{
+    DnsEntry *entry;
+
+    for (entry = shard->entries; entry; entry = entry->next) {
+        if (!strcmp(entry->key, key))
+            return entry;
+    }
+
+    evict_entries(shard);
+    entry = calloc(1, sizeof(DnsEntry));
+    entry->key = strdup(key);
+    entry->hostname = strdup(hostname);
+    entry->port = strdup(port);
+    sem_init(&entry->done, 0, 0);
+    entry->next = shard->entries;
+    shard->entries = entry;
+    return entry;
+}
+
+/*
+ * evict_entries - Free the expired entries of shard, failures being kept
+ *     for less long, and the one closest to expiring if the shard still holds
+ *     DNS_SHARD_ENTRIES. Entries a lookup is using are left alone.
+ */
+static void
+evict_entries(DnsShard *shard)
+{
+    int nentries = 0;
+    time_t now = time(NULL);
+    DnsEntry *entry, **link, **victim = NULL;
+
+    for (link = &shard->entries; (entry = *link); ) {
+        if (!entry_busy(entry) && entry->expires <= now) {
+            *link = entry->next;
+            free_entry(entry);
+            continue;
+        }
+
+        if (!entry_busy(entry)
+            && (!victim || entry->expires < (*victim)->expires))
+            victim = link;
+        nentries++;
+        link = &entry->next;
+    }
+
+    if (nentries >= DNS_SHARD_ENTRIES && victim) {
+        entry = *victim;
+        *victim = entry->next;
+        free_entry(entry);
+    }
+}
+
+/*
+ * entry_busy - Whether a lookup still refers to entry.
+ */
+static int
+entry_busy(const DnsEntry *entry)
+{
+    return entry->resolving || entry->users || entry->waiters;
+}
+
+static void
+free_entry(DnsEntry *entry)
+{
+    if (entry->addrs)
+        dns_release(entry->addrs);
+    sem_destroy(&entry->done);
+    free(entry->key);
+    free(entry->hostname);
+    free(entry->port);
+    free(entry);
+}
+
+/*
+ * take_result - Hand out a reference to the cached result of entry, with
+ *     its shard locked.
+ */
+static int
+take_result(DnsEntry *entry, DnsAddrs **addrs)
+{
+    if (entry->error || !entry->addrs)
+        return entry->error ? entry->error : EAI_AGAIN;
+
+    atomic_fetch_add(&entry->addrs->refcnt, 1);
+    *addrs = entry->addrs;
+    return 0;
+}
+
+static unsigned long
+hash_key(const char *key)
+{
+    unsigned long hash = 5381;
+
+    while (*key)
+        hash = ((hash << 5) + hash) + *key++; /* hash * 33 + c */
+
+    return hash;
+}
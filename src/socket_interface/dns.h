@@ -0,0 +1,58 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <netdb.h>
+#include <stdatomic.h>
+
+#define DNS_SHARDS          64      /* Independently locked shards */
+#define DNS_TTL             60      /* Default seconds a resolution is kept */
+#define DNS_NEGATIVE_TTL    5       /* Seconds a failed resolution is kept */
+#define DNS_RESOLVERS       4       /* Resolver threads of the event loops */
+#define DNS_SHARD_ENTRIES   256     /* Names cached per shard at most */
+
+/* A resolved address list, shared by the cache and the connections using it */
+typedef struct dns_addrs {
+    struct addrinfo *ai;
+    atomic_int refcnt;
+} DnsAddrs;
+
+struct dns_entry;
+
+/* A lookup that can't block, told once the name is resolved */
+typedef struct dns_waiter {
+    void (*wake)(void *arg);        /* Called with the entry's shard locked */
+    void *arg;
+    int error;                      /* Result of the lookup, once woken */
+    DnsAddrs *addrs;                /* Set if there's no error */
+    struct dns_entry *entry;        /* NULL once woken */
+    unsigned shard;                 /* Index of the entry's shard */
+    struct dns_waiter *next;
+} DnsWaiter;
+
+typedef struct dns_stats {
+    unsigned long long hits;        /* Answered from the cache */
+    unsigned long long negative;    /* Cached failures among the hits */
+    unsigned long long misses;      /* Resolved with getaddrinfo */
+    unsigned long long coalesced;   /* Waited for a resolution in flight */
+    unsigned long long expired;     /* Misses on an expired entry */
+} DnsStats;
+
+void
+dns_init(int ttl, int nresolvers);
+
+int
+dns_lookup(const char *hostname, const char *port, DnsAddrs **addrs);
+
+int
+dns_lookup_async(const char *hostname, const char *port, DnsWaiter *waiter);
+
+int
+dns_unwatch(DnsWaiter *waiter);
+
+void
+dns_release(DnsAddrs *addrs);
+
+void
+dns_stats(DnsStats *stats);
+
+#endif
@@ -6,38 +6,38 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "dns.h"
 #include "interface.h"
 
 #define LISTENQ  1024  /* Second argument to listen() */
 
+static int
+open_listenfd_opt(char *port, int reuseport);
+
 /******************************** 
  * Client/server helper functions
  ********************************/
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. The server addresses
+ *     come from the resolver cache.
  *
  *     On error, returns: 
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
 int open_clientfd(char *hostname, char *port) {
-    int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    int clientfd;
+    struct addrinfo *p;
+    DnsAddrs *addrs;
 
     /* Get a list of potential server addresses */
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
-    hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
-    hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
-    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
-        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+    if (dns_lookup(hostname, port, &addrs) != 0)
         return -2;
-    }
   
     /* Walk the list for one that we can successfully connect to */
-    for (p = listp; p; p = p->ai_next) {
+    for (p = addrs->ai; p; p = p->ai_next) {
         /* Create a socket descriptor */
         if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
             continue; /* Socket failed, try the next */
@@ -47,18 +47,50 @@ int open_clientfd(char *hostname, char *port) {
             break; /* Success */
         if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
             fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
+            dns_release(addrs);
             return -1;
         } 
     } 
 
     /* Clean up */
-    freeaddrinfo(listp);
+    dns_release(addrs);
     if (!p) /* All connects failed */
         return -1;
     else    /* The last connect succeeded */
         return clientfd;
 }
 
+/*
+ * open_clientfd_nonblock - Same as open_clientfd, but to one of addrs,
+ *     resolved beforehand, and the returned socket descriptor is
+ *     non-blocking and the connection may still be in progress. The caller
+ *     waits for it to become writable and checks SO_ERROR to learn the
+ *     outcome.
+ *
+ *     On error, returns -1 with errno set.
+ */
+int open_clientfd_nonblock(DnsAddrs *addrs) {
+    int clientfd;
+    struct addrinfo *p;
+
+    /* Walk the list for one that accepts starting a connection */
+    for (p = addrs->ai; p; p = p->ai_next) {
+        if ((clientfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, 
+                               p->ai_protocol)) < 0) 
+            continue;
+
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0 
+            || errno == EINPROGRESS) 
+            break; /* Connected or in progress */
+        close(clientfd);
+    } 
+
+    if (!p)
+        return -1;
+    else
+        return clientfd;
+}
+
 /*  
  * open_listenfd - Open and return a listening socket on port. This
  *     function is reentrant and protocol-independent.
@@ -68,6 +100,22 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*  
+ * open_listenfd_reuseport - Same as open_listenfd, but with SO_REUSEPORT set
+ *     so that several sockets can listen on port, the kernel balancing the
+ *     incoming connections between them.
+ */
+int open_listenfd_reuseport(char *port) 
+{
+    return open_listenfd_opt(port, 1);
+}
+
+static int
+open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -92,6 +140,12 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
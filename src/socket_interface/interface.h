@@ -1,10 +1,18 @@
 #ifndef INTERFACE_H
 #define INTERFACE_H
 
+#include "dns.h"
+
 int
 open_clientfd(char *hostname, char *port);
 
+int
+open_clientfd_nonblock(DnsAddrs *addrs);
+
 int
 open_listenfd(char *port);
 
+int
+open_listenfd_reuseport(char *port);
+
 #endif
\ No newline at end of file